@@ -0,0 +1,116 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file arena.h
+ * @brief Arena (bump) allocator.
+ * @details
+ * An arena hands out memory by bumping a pointer inside large chunks allocated with osdep_heap_alloc(), and frees
+ * everything allocated after a checkpoint at once. This suits scratch memory that lives for a single frame, request
+ * or parser pass: allocating is a few instructions, freeing costs nothing per object, and the short-lived objects
+ * don't end up fragmenting the shared OS heap.
+ *
+ * Arenas are not thread-safe. Use one arena per thread, or protect it with a lock.
+ */
+
+#ifndef __OSDEP_ARENA_H__
+#define __OSDEP_ARENA_H__
+
+#include <muteki/common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Arena descriptor type.
+ */
+typedef struct osdep_arena_s osdep_arena_t;
+
+/**
+ * @brief Arena checkpoint.
+ * @see osdep_arena_mark
+ * @see osdep_arena_release
+ */
+typedef struct osdep_arena_mark_s {
+    /**
+     * @brief Chunk that was current when the checkpoint was taken.
+     */
+    void *chunk;
+    /**
+     * @brief Number of bytes used in that chunk when the checkpoint was taken.
+     */
+    size_t offset;
+} osdep_arena_mark_t;
+
+/**
+ * @brief Create an arena.
+ *
+ * @param chunk_size Size of each chunk in bytes. Allocations larger than this get a dedicated chunk. Set to 0 to use
+ * the default size (4KiB).
+ * @return The arena descriptor, or `NULL` if allocation fails.
+ */
+extern osdep_arena_t *osdep_arena_create(size_t chunk_size);
+
+/**
+ * @brief Destroy an arena and free all memory allocated from it.
+ *
+ * @param arena The arena descriptor.
+ * @x_void_return
+ */
+extern void osdep_arena_destroy(osdep_arena_t *arena);
+
+/**
+ * @brief Allocate 8-bytes aligned memory from an arena.
+ *
+ * @param arena The arena descriptor.
+ * @param size Size of the memory to allocate.
+ * @return Pointer to allocated memory, or `NULL` if allocation fails.
+ */
+__attribute__((assume_aligned(8))) extern void *osdep_arena_alloc(osdep_arena_t *arena, size_t size);
+
+/**
+ * @brief Allocate memory with a specific alignment from an arena.
+ *
+ * @param arena The arena descriptor.
+ * @param size Size of the memory to allocate.
+ * @param alignment Alignment of the memory. Must be a power of 2.
+ * @return Pointer to allocated memory, or `NULL` if allocation fails or if `alignment` is invalid.
+ */
+extern void *osdep_arena_alloc_aligned(osdep_arena_t *arena, size_t size, size_t alignment);
+
+/**
+ * @brief Take a checkpoint of an arena.
+ *
+ * @param arena The arena descriptor.
+ * @return The checkpoint.
+ */
+extern osdep_arena_mark_t osdep_arena_mark(const osdep_arena_t *arena);
+
+/**
+ * @brief Free everything allocated from an arena since a checkpoint.
+ * @details Checkpoints must be released in the reverse order they were taken. Releasing a checkpoint invalidates all
+ * checkpoints taken after it.
+ *
+ * @param arena The arena descriptor.
+ * @param mark Checkpoint previously returned by osdep_arena_mark().
+ * @x_void_return
+ */
+extern void osdep_arena_release(osdep_arena_t *arena, osdep_arena_mark_t mark);
+
+/**
+ * @brief Free everything allocated from an arena.
+ * @details The first chunk is kept so the arena can be reused without calling into the OS heap again.
+ *
+ * @param arena The arena descriptor.
+ * @x_void_return
+ */
+extern void osdep_arena_reset(osdep_arena_t *arena);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_ARENA_H__
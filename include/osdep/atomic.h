@@ -0,0 +1,48 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file atomic.h
+ * @brief Atomic primitives for ARMv4T.
+ * @details
+ * ARMv4T has no load-exclusive/store-exclusive instructions. The only atomic read-modify-write operation available is
+ * `SWP`, which atomically exchanges a register with a word in memory. Everything else has to be built on top of that.
+ *
+ * @note `SWP` is only available in ARM state. Code including this header must not be compiled as Thumb.
+ */
+
+#ifndef __OSDEP_ATOMIC_H__
+#define __OSDEP_ATOMIC_H__
+
+#include <muteki/common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Compiler barrier.
+ * @details Besta devices are all single core, so this is all it takes to order memory accesses between threads.
+ */
+#define OSDEP_BARRIER() asm volatile ("" ::: "memory")
+
+/**
+ * @brief Atomically exchange a word in memory.
+ *
+ * @param ptr Pointer to the word.
+ * @param value New value of the word.
+ * @return The previous value of the word.
+ */
+static inline uint32_t osdep_atomic_swap(volatile uint32_t *ptr, uint32_t value) {
+    uint32_t old;
+    asm volatile ("swp %0, %2, [%1]" : "=&r" (old) : "r" (ptr), "r" (value) : "memory");
+    return old;
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_ATOMIC_H__
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file channel.h
+ * @brief Single-producer single-consumer byte channel.
+ * @details
+ * Message queues carry 16 bytes per svc, which makes them a poor fit for streaming data between threads. A channel is a
+ * ring buffer shared by exactly one producer thread and one consumer thread. The producer reserves a contiguous region,
+ * fills it in place and commits it. The consumer peeks at the oldest contiguous region, reads it in place and releases
+ * it. Data is never copied and passing it takes no svc.
+ *
+ * Each side only parks on an event when the channel is empty (consumer) or too full (producer), and the other side
+ * only sets the event if it is actually parked. Commits can be batched so a parked consumer is only woken up once
+ * enough data is ready.
+ *
+ * Regions never wrap around the end of the buffer, so a large reservation may not fit even though the channel has
+ * enough free space in total. Reservations of up to half the buffer size always fit once the consumer has caught up.
+ */
+
+#ifndef __OSDEP_CHANNEL_H__
+#define __OSDEP_CHANNEL_H__
+
+#include <muteki/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Timeout value that waits forever.
+ */
+#define OSDEP_CHANNEL_WAIT_FOREVER ((unsigned int) -1)
+
+/**
+ * @brief Channel descriptor type.
+ */
+typedef struct osdep_channel_s osdep_channel_t;
+
+/**
+ * @brief Create a channel.
+ *
+ * @param size Size of the buffer in bytes.
+ * @param batch Number of bytes committed before a parked consumer is woken up. 0 is the same as 1.
+ * osdep_channel_flush() wakes the consumer up regardless.
+ * @return The channel, or `NULL` on error.
+ */
+extern osdep_channel_t *osdep_channel_create(size_t size, size_t batch);
+
+/**
+ * @brief Destroy a channel.
+ * @details Neither side may be using the channel while or after this is called.
+ *
+ * @param channel The channel.
+ * @x_void_return
+ */
+extern void osdep_channel_destroy(osdep_channel_t *channel);
+
+/**
+ * @brief Reserve a contiguous region for writing.
+ * @details Producer only. The region is not visible to the consumer until committed. Reserving again drops the previous
+ * reservation.
+ *
+ * @param channel The channel.
+ * @param size Size of the region in bytes.
+ * @return The region, or `NULL` if there is not enough contiguous free space.
+ */
+extern void *osdep_channel_reserve(osdep_channel_t *channel, size_t size);
+
+/**
+ * @brief osdep_channel_reserve() that waits for the consumer to free enough space.
+ *
+ * @param channel The channel.
+ * @param size Size of the region in bytes. Must not be larger than half the buffer size.
+ * @param timeout Timeout in OSSleep() units, or #OSDEP_CHANNEL_WAIT_FOREVER.
+ * @return The region, or `NULL` if the wait timed out or `size` is too large.
+ */
+extern void *osdep_channel_reserve_wait(osdep_channel_t *channel, size_t size, unsigned int timeout);
+
+/**
+ * @brief Make the beginning of the reserved region visible to the consumer.
+ * @details Producer only.
+ *
+ * @param channel The channel.
+ * @param size Number of bytes to commit. Must not be larger than the reservation. The rest of it is dropped.
+ * @x_void_return
+ */
+extern void osdep_channel_commit(osdep_channel_t *channel, size_t size);
+
+/**
+ * @brief Wake up the consumer if it is parked, even if fewer bytes than the batch size were committed.
+ * @details Producer only.
+ *
+ * @param channel The channel.
+ * @x_void_return
+ */
+extern void osdep_channel_flush(osdep_channel_t *channel);
+
+/**
+ * @brief Mark the end of the stream and wake up the consumer.
+ * @details Producer only. Nothing may be committed afterwards.
+ *
+ * @param channel The channel.
+ * @x_void_return
+ */
+extern void osdep_channel_close(osdep_channel_t *channel);
+
+/**
+ * @brief Get the oldest contiguous region of committed data.
+ * @details Consumer only. More data may follow the region.
+ *
+ * @param channel The channel.
+ * @param[out] size Size of the region in bytes. 0 if the channel is empty.
+ * @return The region, or `NULL` if the channel is empty.
+ */
+extern const void *osdep_channel_peek(osdep_channel_t *channel, size_t *size);
+
+/**
+ * @brief osdep_channel_peek() that waits for data.
+ *
+ * @param channel The channel.
+ * @param[out] size Size of the region in bytes. 0 if the channel is empty.
+ * @param timeout Timeout in OSSleep() units, or #OSDEP_CHANNEL_WAIT_FOREVER.
+ * @return The region, or `NULL` if the wait timed out or the channel is closed and empty.
+ */
+extern const void *osdep_channel_peek_wait(osdep_channel_t *channel, size_t *size, unsigned int timeout);
+
+/**
+ * @brief Give the beginning of the peeked region back to the producer.
+ * @details Consumer only.
+ *
+ * @param channel The channel.
+ * @param size Number of bytes to release. Must not be larger than the region returned by the last peek.
+ * @x_void_return
+ */
+extern void osdep_channel_release(osdep_channel_t *channel, size_t size);
+
+/**
+ * @brief Check whether the producer has closed the channel.
+ * @details Data committed before closing may still be waiting to be read.
+ *
+ * @param channel The channel.
+ * @retval true The channel is closed.
+ * @retval false The channel is open.
+ */
+extern bool osdep_channel_is_closed(const osdep_channel_t *channel);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_CHANNEL_H__
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file cond.h
+ * @brief Condition variables.
+ * @details
+ * The kernel has no condition variable. This builds one out of an osdep_mutex_t guarding a FIFO queue of waiters, each
+ * of which parks on an event of its own. Signals wake waiters in the order they started waiting. A waiter only wakes up
+ * when it is signaled or its timeout runs out, so signals are never picked up late.
+ *
+ * Condition variables can be statically initialized with #OSDEP_COND_INITIALIZER. Zero-filled memory is a valid
+ * condition variable as well.
+ */
+
+#ifndef __OSDEP_COND_H__
+#define __OSDEP_COND_H__
+
+#include <muteki/threading.h>
+#include <osdep/mutex.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Condition variable descriptor.
+ * @details Treat all fields as private.
+ */
+typedef struct osdep_cond_s {
+    /** Guards the waiter queue. */
+    osdep_mutex_t lock;
+    /** First waiter. */
+    struct osdep_cond_waiter_s *volatile head;
+    /** Last waiter. */
+    struct osdep_cond_waiter_s *tail;
+} osdep_cond_t;
+
+/**
+ * @brief Static initializer for osdep_cond_t.
+ */
+#define OSDEP_COND_INITIALIZER { OSDEP_MUTEX_INITIALIZER(OSDEP_MUTEX_NORMAL), NULL, NULL }
+
+/**
+ * @brief Initialize a condition variable.
+ *
+ * @param cond The condition variable descriptor.
+ * @x_void_return
+ */
+extern void osdep_cond_init(osdep_cond_t *cond);
+
+/**
+ * @brief Destroy a condition variable.
+ * @details The condition variable must not have any waiter.
+ *
+ * @param cond The condition variable descriptor.
+ * @x_void_return
+ */
+extern void osdep_cond_destroy(osdep_cond_t *cond);
+
+/**
+ * @brief Unlock a mutex, wait for a condition variable to be signaled and lock the mutex again.
+ *
+ * @param cond The condition variable descriptor.
+ * @param mutex The mutex. Must be locked exactly once by the current thread.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_cond_wait(osdep_cond_t *cond, osdep_mutex_t *mutex);
+
+/**
+ * @brief osdep_cond_wait() with a timeout.
+ *
+ * @param cond The condition variable descriptor.
+ * @param mutex The mutex. Must be locked exactly once by the current thread.
+ * @param timeout Timeout in OSSleep() units.
+ * @return The result. The mutex is locked again in all cases.
+ * @see wait_result_t
+ */
+extern wait_result_t osdep_cond_timedwait(osdep_cond_t *cond, osdep_mutex_t *mutex, unsigned int timeout);
+
+/**
+ * @brief Wake the longest waiting thread.
+ *
+ * @param cond The condition variable descriptor.
+ * @x_void_return
+ */
+extern void osdep_cond_signal(osdep_cond_t *cond);
+
+/**
+ * @brief Wake all waiting threads.
+ *
+ * @param cond The condition variable descriptor.
+ * @x_void_return
+ */
+extern void osdep_cond_broadcast(osdep_cond_t *cond);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_COND_H__
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file coro.h
+ * @brief Stackful coroutines scheduled cooperatively on a single thread.
+ * @details
+ * Every kernel thread costs a descriptor, a stack sized for the worst case and a round trip through the kernel
+ * scheduler on each switch. Coroutines are a lighter alternative for tasks that mostly wait: each one has its own small
+ * stack, and switching between them is a handful of loads and stores that never leave user mode.
+ *
+ * A scheduler runs its coroutines on the thread that calls osdep_coro_sched_run(), one at a time, until each of them
+ * returns. A coroutine keeps running until it calls osdep_coro_yield(), osdep_coro_sleep() or osdep_coro_wait_event().
+ * The scheduler only blocks the thread in OSWaitForEvent() or OSSleep() when every coroutine is sleeping or waiting.
+ * Any other blocking call made by a coroutine blocks all of them.
+ *
+ * When created with per-coroutine TLS, each coroutine gets its own UTLS space (see utls.h), so TLS variables and
+ * tsd.h values are private to the coroutine rather than shared by the whole thread. The destructors of its tsd.h values
+ * run when the coroutine finishes.
+ *
+ * A running scheduler takes one entry of the thread stack registry (see osdep_thread_alias_create()) to keep
+ * osdep_thread_get_current() from taking the svc fallback on coroutine stacks, which TLS lookups depend on.
+ *
+ * Coroutine stacks are not checked for overflow, except for a canary at the bottom that is checked whenever the
+ * coroutine switches back to the scheduler. The context switch routine is written in ARM assembly, so this module must
+ * be built in ARM state.
+ */
+
+#ifndef __OSDEP_CORO_H__
+#define __OSDEP_CORO_H__
+
+#include <muteki/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Timeout value that waits forever.
+ */
+#define OSDEP_CORO_WAIT_FOREVER ((unsigned int) -1)
+
+/**
+ * @brief Scheduler descriptor type.
+ */
+typedef struct osdep_coro_sched_s osdep_coro_sched_t;
+
+/**
+ * @brief Coroutine descriptor type.
+ */
+typedef struct osdep_coro_s osdep_coro_t;
+
+/**
+ * @brief Entry point type for coroutines.
+ * @param user_data User data passed to osdep_coro_spawn().
+ */
+typedef void (*osdep_coro_func_t)(void *user_data);
+
+/**
+ * @brief Create a scheduler.
+ *
+ * @param stack_size Stack size of each coroutine in bytes.
+ * @param max_pooled Number of finished coroutines whose memory is kept around for reuse by osdep_coro_spawn().
+ * @param per_coro_tls Give each coroutine its own UTLS space.
+ * @return The scheduler, or `NULL` on error.
+ */
+extern osdep_coro_sched_t *osdep_coro_sched_create(size_t stack_size, size_t max_pooled, bool per_coro_tls);
+
+/**
+ * @brief Destroy a scheduler.
+ * @details Coroutines that were spawned but never ran to completion are dropped, after running the destructors of their
+ * tsd.h values. Must not be called while the scheduler is running.
+ *
+ * @param sched The scheduler.
+ * @x_void_return
+ */
+extern void osdep_coro_sched_destroy(osdep_coro_sched_t *sched);
+
+/**
+ * @brief Create a coroutine.
+ * @details The coroutine starts running the next time the scheduler picks it. This may be called from a coroutine of
+ * the same scheduler, or from the thread that runs the scheduler before osdep_coro_sched_run() is called.
+ *
+ * @param sched The scheduler.
+ * @param func The entry point. The coroutine finishes when it returns.
+ * @param user_data User data passed to `func`.
+ * @return The coroutine, or `NULL` on error. The descriptor is only valid until the coroutine finishes.
+ */
+extern osdep_coro_t *osdep_coro_spawn(osdep_coro_sched_t *sched, osdep_coro_func_t func, void *user_data);
+
+/**
+ * @brief Run the coroutines of a scheduler on the current thread until all of them have finished.
+ *
+ * @param sched The scheduler.
+ * @retval true @x_term ok
+ * @retval false The scheduler is already running, or no KTLS slot is available to track it.
+ */
+extern bool osdep_coro_sched_run(osdep_coro_sched_t *sched);
+
+/**
+ * @brief Get the running coroutine.
+ *
+ * @x_void_param
+ * @return The running coroutine, or `NULL` when not called from a coroutine.
+ */
+extern osdep_coro_t *osdep_coro_self(void);
+
+/**
+ * @brief Let the other ready coroutines run.
+ * @details Outside of coroutines this is a no-op.
+ *
+ * @x_void_param
+ * @x_void_return
+ */
+extern void osdep_coro_yield(void);
+
+/**
+ * @brief Suspend the running coroutine for a while.
+ * @details Outside of coroutines this calls OSSleep().
+ *
+ * @param millis Time to sleep in milliseconds. 0 is the same as osdep_coro_yield().
+ * @x_void_return
+ */
+extern void osdep_coro_sleep(unsigned int millis);
+
+/**
+ * @brief Suspend the running coroutine until an event is set.
+ * @details
+ * Outside of coroutines this calls OSWaitForEvent(). Events are cleared on resolve the same way OSWaitForEvent()
+ * clears them. Events may be set by any thread or coroutine, but only one coroutine should wait on an event at a time.
+ *
+ * @param event The event.
+ * @param timeout Timeout in OSSleep() units, or #OSDEP_CORO_WAIT_FOREVER.
+ * @return The result.
+ */
+extern wait_result_t osdep_coro_wait_event(event_t *event, unsigned int timeout);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_CORO_H__
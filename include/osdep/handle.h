@@ -0,0 +1,193 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file handle.h
+ * @brief Movable-handle allocator for large buffers.
+ * @details
+ * Without an MMU, a long session fragments the OS heap until a large allocation fails even though there is plenty of
+ * memory free in total. A handle zone reserves one contiguous memchunk up front and hands out handles to relocatable
+ * blocks inside of it. Clients lock a handle to get a pointer to its block, and unlock it when done. Unlocked blocks
+ * may be slid together by the zone at any time to merge the free space between them into one large free block.
+ *
+ * This suits large buffers that are only touched for short, well-defined periods of time, such as pixel buffers of
+ * `lcd_surface_t`, decoded images and audio buffers. For example, a surface buffer is locked and assigned to
+ * lcd_surface_t::buffer before drawing, and unlocked after drawing. Pointers obtained from osdep_handle_lock() must not
+ * be used after the matching osdep_handle_unlock() call.
+ *
+ * Locked blocks are pinned. Keeping blocks locked for a long time limits what compaction can achieve.
+ *
+ * Zones are thread-safe.
+ */
+
+#ifndef __OSDEP_HANDLE_H__
+#define __OSDEP_HANDLE_H__
+
+#include <muteki/common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Handle zone descriptor type.
+ */
+typedef struct osdep_hzone_s osdep_hzone_t;
+
+/**
+ * @brief Handle type.
+ */
+typedef struct osdep_handle_s *osdep_handle_t;
+
+/**
+ * @brief Statistics of a handle zone.
+ * @see osdep_hzone_get_stats
+ */
+typedef struct osdep_hzone_stats_s {
+    /**
+     * @brief Size of the memory managed by the zone.
+     */
+    size_t size;
+    /**
+     * @brief Free memory in the zone, including the headers of free blocks.
+     */
+    size_t free_bytes;
+    /**
+     * @brief Size of the largest block that can be allocated without compacting the zone.
+     */
+    size_t largest_free;
+    /**
+     * @brief Number of handles in use.
+     */
+    size_t handles_used;
+    /**
+     * @brief Number of handles currently locked.
+     */
+    size_t handles_locked;
+    /**
+     * @brief Number of times the zone was compacted.
+     */
+    size_t compactions;
+    /**
+     * @brief Number of blocks moved by compaction.
+     */
+    size_t blocks_moved;
+    /**
+     * @brief Number of bytes moved by compaction. This is the main cost of compaction.
+     */
+    size_t bytes_moved;
+    /**
+     * @brief Number of bytes moved by the last compaction.
+     */
+    size_t last_bytes_moved;
+    /**
+     * @brief Number of allocations that failed even after compacting the zone.
+     */
+    size_t failed_allocs;
+} osdep_hzone_stats_t;
+
+/**
+ * @brief Create a handle zone.
+ *
+ * @param size Size of the memory to reserve for the blocks, in bytes.
+ * @param max_handles Maximum number of handles that can be allocated at the same time.
+ * @return The zone descriptor, or `NULL` if allocation fails.
+ */
+extern osdep_hzone_t *osdep_hzone_create(size_t size, size_t max_handles);
+
+/**
+ * @brief Destroy a handle zone and free all blocks allocated from it.
+ *
+ * @param zone The zone descriptor.
+ * @x_void_return
+ */
+extern void osdep_hzone_destroy(osdep_hzone_t *zone);
+
+/**
+ * @brief Slide all unlocked blocks of a zone together.
+ * @details Zones compact themselves when an allocation does not fit anywhere but there is enough free memory in total,
+ * so this only needs to be called to move that cost to a convenient time (e.g. while loading a level).
+ *
+ * @param zone The zone descriptor.
+ * @return Size of the largest block that can be allocated after compaction.
+ */
+extern size_t osdep_hzone_compact(osdep_hzone_t *zone);
+
+/**
+ * @brief Get statistics of a handle zone.
+ *
+ * @param zone The zone descriptor.
+ * @param stats The output stats buffer.
+ * @x_void_return
+ */
+extern void osdep_hzone_get_stats(osdep_hzone_t *zone, osdep_hzone_stats_t *stats);
+
+/**
+ * @brief Allocate a block from a handle zone.
+ * @details The block starts unlocked.
+ *
+ * @param zone The zone descriptor.
+ * @param size Size of the block.
+ * @return The handle, or `NULL` if allocation fails.
+ */
+extern osdep_handle_t osdep_handle_alloc(osdep_hzone_t *zone, size_t size);
+
+/**
+ * @brief Free a block and its handle.
+ * @details The block may be freed while locked.
+ *
+ * @param zone The zone descriptor.
+ * @param handle The handle. Can be `NULL`.
+ * @x_void_return
+ */
+extern void osdep_handle_free(osdep_hzone_t *zone, osdep_handle_t handle);
+
+/**
+ * @brief Resize a block.
+ * @details
+ * Locked blocks can only be resized in place, i.e. when shrinking or when the block is followed by enough free memory.
+ * Unlocked blocks may be moved and the content is preserved either way.
+ *
+ * @param zone The zone descriptor.
+ * @param handle The handle.
+ * @param size New size of the block.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_handle_resize(osdep_hzone_t *zone, osdep_handle_t handle, size_t size);
+
+/**
+ * @brief Lock a block in place and get a pointer to it.
+ * @details Locks nest. The block stays pinned until osdep_handle_unlock() has been called as many times.
+ *
+ * @param zone The zone descriptor.
+ * @param handle The handle.
+ * @return 8-bytes aligned pointer to the block.
+ */
+__attribute__((assume_aligned(8))) extern void *osdep_handle_lock(osdep_hzone_t *zone, osdep_handle_t handle);
+
+/**
+ * @brief Unlock a block so it can be moved again.
+ *
+ * @param zone The zone descriptor.
+ * @param handle The handle.
+ * @x_void_return
+ */
+extern void osdep_handle_unlock(osdep_hzone_t *zone, osdep_handle_t handle);
+
+/**
+ * @brief Get the usable size of a block.
+ *
+ * @param zone The zone descriptor.
+ * @param handle The handle.
+ * @return Size of the block. This may be slightly larger than the requested size.
+ */
+extern size_t osdep_handle_get_size(osdep_hzone_t *zone, osdep_handle_t handle);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_HANDLE_H__
@@ -24,6 +24,110 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Statistics of the osdep heap.
+ * @see osdep_heap_get_stats
+ */
+typedef struct osdep_heap_stats_s {
+    /**
+     * @brief Total usable size of the memory currently allocated with osdep_heap_alloc().
+     * @details This is the sum of osdep_heap_get_alloc_size() over all live allocations, which may be larger than
+     * what was asked for.
+     */
+    size_t live_bytes;
+    /**
+     * @brief Number of live allocations.
+     */
+    size_t live_blocks;
+    /**
+     * @brief Highest value of ::live_bytes seen since startup or since the last osdep_heap_reset_peak() call.
+     */
+    size_t peak_live_bytes;
+    /**
+     * @brief Number of successful allocations since startup.
+     * @details An osdep_heap_realloc() call that moves the memory counts as an allocation and a free.
+     */
+    size_t total_allocs;
+    /**
+     * @brief Number of frees since startup.
+     */
+    size_t total_frees;
+    /**
+     * @brief Number of bytes taken by mchx headers and alignment padding of live allocations.
+     * @details Memory held by the slab allocator and per-thread caches that is not handed out is not counted here. See
+     * osdep_heap_slab_get_stats() for that.
+     */
+    size_t overhead_bytes;
+    /**
+     * @brief Free memory as reported by GetFreeMemory().
+     */
+    size_t free_bytes;
+    /**
+     * @brief Result of the last osdep_heap_probe_largest_block() call, or 0 if it was never called.
+     */
+    size_t largest_block;
+} osdep_heap_stats_t;
+
+/**
+ * @brief Statistics of the slab allocator.
+ */
+typedef struct osdep_heap_slab_stats_s {
+    /**
+     * @brief If true, small allocations are currently served by the slab allocator.
+     */
+    bool is_enabled;
+    /**
+     * @brief Number of allocations served by the slab allocator.
+     */
+    size_t hits;
+    /**
+     * @brief Number of allocations served by per-thread caches without taking the slab allocator lock.
+     * @details These are also counted in ::hits.
+     */
+    size_t tcache_hits;
+    /**
+     * @brief Number of allocations that fell through to lmalloc() while the slab allocator was enabled.
+     * @details This counts both allocations that are too large for any size class and the ones that could not get a
+     * fresh slab chunk. The hit rate is `hits / (hits + misses)`.
+     */
+    size_t misses;
+    /**
+     * @brief Number of slab chunks currently held by the slab allocator.
+     */
+    size_t chunks;
+    /**
+     * @brief Number of objects currently handed out by the slab allocator.
+     * @details Objects held in per-thread caches are counted as handed out.
+     */
+    size_t objects_used;
+    /**
+     * @brief Number of objects that can be handed out without allocating more slab chunks.
+     */
+    size_t objects_free;
+} osdep_heap_slab_stats_t;
+
+/**
+ * @brief Statistics of the heap tracer.
+ */
+typedef struct osdep_heap_trace_stats_s {
+    /**
+     * @brief If true, the heap tracer is running.
+     */
+    bool is_running;
+    /**
+     * @brief Number of records written to the trace file in the current session.
+     */
+    size_t records_written;
+    /**
+     * @brief Number of records waiting in the ring buffer.
+     */
+    size_t records_pending;
+    /**
+     * @brief Number of records dropped because the ring buffer was full.
+     */
+    size_t records_dropped;
+} osdep_heap_trace_stats_t;
+
 /**
  * @brief Allocate and format mchx memchunk.
  *
@@ -32,6 +136,60 @@ extern "C" {
  */
 __attribute__((assume_aligned(8))) extern void *osdep_heap_alloc(size_t size);
 
+/**
+ * @brief Allocate, clear and format mchx memchunk.
+ * @details Large allocations are cleared by lcalloc(), so callers don't need to touch every byte themselves.
+ *
+ * @param nmemb Number of data units to allocate.
+ * @param size Size of each data unit.
+ * @return Pointer to allocated memory, or NULL if allocation fails.
+ */
+__attribute__((assume_aligned(8))) extern void *osdep_heap_calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief Allocate and format mchx memchunk with a specific alignment.
+ * @details
+ * The mchx header is placed right before the aligned pointer, so the memory is freed with osdep_heap_free() and its
+ * size is queried with osdep_heap_get_alloc_size() as usual. Alignments of 8 bytes or less are served by
+ * osdep_heap_alloc(). Larger alignments over-allocate by `alignment + 4` bytes in total, header included.
+ *
+ * This is meant to back memalign() and posix_memalign(). The latter should reject alignments that are not multiples of
+ * `sizeof(void *)` and return `ENOMEM` when this returns `NULL`.
+ *
+ * Note that osdep_heap_realloc() only keeps the 8-bytes alignment when it has to move the memory.
+ *
+ * @param alignment Alignment of the memory. Must be a power of 2.
+ * @param size Size of the memory to allocate.
+ * @return Pointer to allocated memory, or `NULL` if allocation fails or if `alignment` is invalid.
+ */
+extern void *osdep_heap_memalign(size_t alignment, size_t size);
+
+/**
+ * @brief C11 aligned_alloc() on top of osdep_heap_memalign().
+ * @details `size` does not need to be a multiple of `alignment`.
+ *
+ * @param alignment Alignment of the memory. Must be a power of 2.
+ * @param size Size of the memory to allocate.
+ * @return Pointer to allocated memory, or `NULL` if allocation fails or if `alignment` is invalid.
+ */
+extern void *osdep_heap_aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief Resize a mchx memchunk.
+ * @details
+ * The memchunk is resized in place whenever the new size fits in its usable size. Otherwise a new memchunk is
+ * allocated and the content is moved over. Growing a memchunk that has to be moved also reserves some headroom so
+ * repeated small extensions are mostly done in place.
+ *
+ * The returned memory is always 8-bytes aligned.
+ *
+ * @param ptr Memory allocated by osdep_heap_alloc(), or `NULL` to allocate new memory.
+ * @param size New size of the memory. Passing 0 frees `ptr`.
+ * @return Pointer to the resized memory, or `NULL` if allocation fails (in which case `ptr` is left untouched) or if
+ * `size` is 0.
+ */
+__attribute__((assume_aligned(8))) extern void *osdep_heap_realloc(void *ptr, size_t size);
+
 /**
  * @brief Get usable size of an allocated mchx memchunk.
  *
@@ -48,8 +206,100 @@ size_t osdep_heap_get_alloc_size(const void *ptr);
  */
 extern void osdep_heap_free(void *ptr);
 
+/**
+ * @brief Enable or disable the slab allocator.
+ * @details
+ * When enabled, allocations of up to 256 bytes are served from power-of-two size classes carved from large lmalloc()
+ * chunks instead of calling lmalloc() for each of them. This saves the syscall round-trip and most of the mchx
+ * over-allocation on small objects.
+ *
+ * Memory allocated by the slab allocator is freed with osdep_heap_free() as usual, even after the slab allocator
+ * has been disabled. Disabling the slab allocator only stops it from serving new allocations and releases the slab
+ * chunks that are no longer in use.
+ *
+ * @param enable Set to `true` to enable the slab allocator.
+ * @x_void_return
+ */
+extern void osdep_heap_slab_enable(bool enable);
+
+/**
+ * @brief Enable or disable per-thread caches in front of the slab allocator.
+ * @details
+ * When enabled, each thread keeps a small number of free objects of each slab size class in a cache stored in the
+ * KTLS slots starting at ::OSDEP_KTLS_KEY_HEAP_TCACHE, so most small allocations and frees don't need to take the
+ * slab allocator lock. Objects can be freed on any thread. A cache that grows too deep is partially flushed back to
+ * the slab allocator, and the whole cache is flushed when the thread exits through osdep_thread_exit().
+ *
+ * This only has effect while the slab allocator is enabled.
+ *
+ * Disabling the caches only flushes the cache of the calling thread. Every other thread that used its cache keeps the
+ * objects in it, which also keeps their slab chunks from being released, until it calls osdep_heap_tcache_flush_self()
+ * or exits through osdep_thread_exit().
+ *
+ * @param enable Set to `true` to enable per-thread caches.
+ * @x_void_return
+ */
+extern void osdep_heap_tcache_enable(bool enable);
+
+/**
+ * @brief Return all objects held in the cache of the current thread to the slab allocator.
+ *
+ * @x_void_param
+ * @x_void_return
+ */
+extern void osdep_heap_tcache_flush_self(void);
+
+/**
+ * @brief Get statistics of the slab allocator.
+ * @param stats The output stats buffer.
+ * @x_void_return
+ */
+extern void osdep_heap_slab_get_stats(osdep_heap_slab_stats_t *stats);
+
+/**
+ * @brief Get statistics of the osdep heap.
+ * @details This only takes a short lock and makes a single GetFreeMemory() call, so it's cheap enough to be called
+ * every frame.
+ *
+ * @param stats The output stats buffer.
+ * @x_void_return
+ */
+extern void osdep_heap_get_stats(osdep_heap_stats_t *stats);
+
+/**
+ * @brief Reset osdep_heap_stats_t::peak_live_bytes to the current live size.
+ *
+ * @x_void_param
+ * @x_void_return
+ */
+extern void osdep_heap_reset_peak(void);
+
+/**
+ * @brief Estimate the size of the largest memory that osdep_heap_alloc() can currently allocate.
+ * @details
+ * The OS heap does not report its largest free block, so this binary searches for it by trying to lmalloc() blocks
+ * between 0 and the free memory reported by GetFreeMemory() and freeing them right away. The search stops after
+ * `max_steps` attempts or when the estimate is within 256 bytes, and the result is a lower bound.
+ *
+ * Each step is a syscall round-trip, and allocations made by other threads while a probe block is held may fail, so
+ * this should be called occasionally (e.g. when a level loads) rather than every frame. The result is also cached in
+ * osdep_heap_stats_t::largest_block.
+ *
+ * @param max_steps Maximum number of lmalloc() attempts. Set to 0 to use the default (16).
+ * @return The estimated size in bytes.
+ */
+extern size_t osdep_heap_probe_largest_block(unsigned int max_steps);
+
 /**
  * @brief Start the heap tracer.
+ * @details
+ * Every lmalloc() and _lfree() done by the osdep heap is recorded into an in-memory ring buffer, which is drained into
+ * `C:\\HEAPT.BIN` by a background thread or by osdep_heap_trace_flush(). Records that don't fit in the ring buffer
+ * are dropped and counted instead of stalling the allocator.
+ *
+ * Each session starts with the `HTR2` marker, followed by records of 5 little-endian 32-bit words: raw pointer, size
+ * of the memchunk (0 on free), sequence number, thread descriptor and return address of the caller. A record with a
+ * raw pointer of `0xffffffff` reports the number of records dropped since the previous flush in its size field.
  *
  * @x_void_param
  * @retval true @x_term ok
@@ -57,6 +307,22 @@ extern void osdep_heap_free(void *ptr);
  */
 extern bool osdep_heap_trace_start(void);
 
+/**
+ * @brief Write all records currently held in the ring buffer to the trace file.
+ *
+ * @x_void_param
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_heap_trace_flush(void);
+
+/**
+ * @brief Get statistics of the heap tracer.
+ * @param stats The output stats buffer.
+ * @x_void_return
+ */
+extern void osdep_heap_trace_get_stats(osdep_heap_trace_stats_t *stats);
+
 /**
  * @brief Stop the heap tracer.
  *
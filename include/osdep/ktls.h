@@ -8,6 +8,18 @@
  * @brief Kernel TLS (KTLS) control.
  * @details This is what TLSv1 used as the backend. Provided here in case one wants to hold data across applets/modules
  * within the same thread.
+ *
+ * There are only 8 slots on each thread. Get keys from osdep_ktls_claim() or osdep_ktls_field_claim() instead of
+ * picking a fixed number, so modules linked into the same image can't silently take each other's slots.
+ *
+ * The claim registry lives in the image osdep is linked into, and the kernel offers nowhere to put one that all images
+ * can find. Images that run code on each other's threads (e.g. an applet and a resident module it calls into) must
+ * therefore be built with disjoint `ktls_claim_slots` masks. Slots outside the mask show up as owned by
+ * `"ktls.other_image"` and are never handed out.
+ *
+ * The raw key accessors (osdep_ktls_set(), osdep_ktls_alloc(), osdep_ktls_free() and their `_self` variants) are
+ * deprecated in favor of claimed keys. They refuse to write slots claimed by osdep itself, such as
+ * #OSDEP_KTLS_KEY_UTLS and #OSDEP_KTLS_KEY_HEAP_TCACHE.
  */
 #ifndef __OSDEP_KTLS_H__
 #define __OSDEP_KTLS_H__
@@ -20,8 +32,21 @@ extern "C" {
 
 static const unsigned int OSDEP_KTLS_KEY_MAX = sizeof(((thread_t *) NULL)->unk_0x34) / 4 - 1;
 
+/**
+ * @brief First of the 2 KTLS slots used to cache the UTLS block of a thread.
+ * @see osdep_utls_cinit
+ */
+static const unsigned int OSDEP_KTLS_KEY_UTLS = 4;
+
+/**
+ * @brief First of the 2 KTLS slots used by the per-thread heap caches.
+ * @see osdep_heap_tcache_enable
+ */
+static const unsigned int OSDEP_KTLS_KEY_HEAP_TCACHE = 6;
+
 /**
  * @brief Initialize the TLS container on a specific thread.
+ * @details Slots claimed by osdep itself are left alone.
  *
  * @param thr Pointer to a thread descriptor.
  * @retval 0 @x_term ok
@@ -34,6 +59,7 @@ extern int osdep_ktls_init(thread_t *thr);
  * @param thr Pointer to a thread descriptor.
  * @param key Numerical key. Must be in the range of `(0, 8)`.
  * @return Pointer to the TLS slot. Or `NULL` when an invalid key was supplied.
+ * @warning Writes through the returned pointer are not checked against the slot claims.
  */
 extern void **osdep_ktls_get(thread_t *thr, unsigned int key);
 
@@ -54,7 +80,7 @@ extern void *osdep_ktls_getvalue(thread_t *thr, unsigned int key);
  * @param key Numerical key. Must be in the range of `(0, 8)`.
  * @param value Value to be stored into the TLS slot.
  * @retval 0 @x_term ok
- * @retval -1 @x_term ng
+ * @retval -1 Invalid key, or the slot is claimed by osdep.
  */
 extern int osdep_ktls_set(thread_t *thr, unsigned int key, void *value);
 
@@ -64,7 +90,7 @@ extern int osdep_ktls_set(thread_t *thr, unsigned int key, void *value);
  * @param thr Pointer to a thread descriptor.
  * @param key Numerical key. Must be in the range of `(0, 8)`.
  * @param bytes Number of bytes to allocate.
- * @return Allocated buffer, or NULL if the slot is not NULL, or if the allocation fails.
+ * @return Allocated buffer, or NULL if the slot is not NULL or claimed by osdep, or if the allocation fails.
  */
 extern void *osdep_ktls_alloc(thread_t *thr, unsigned int key, size_t bytes);
 
@@ -74,9 +100,146 @@ extern void *osdep_ktls_alloc(thread_t *thr, unsigned int key, size_t bytes);
  * @param thr Pointer to a thread descriptor.
  * @param key Numerical key. Must be in the range of `(0, 8)`.
  * @retval 0 @x_term ok
+ * @retval -1 Invalid key, empty slot, or the slot is claimed by osdep.
  */
 extern int osdep_ktls_free(thread_t *thr, unsigned int key);
 
+/**
+ * @brief Store a value in a pair of TLS slots along with a guard value.
+ * @details
+ * KTLS slots are not initialized by the kernel, so a slot that was never set may contain anything, including a stale
+ * pointer left by a previous thread whose descriptor got reused. Guarded slots store `value` in slot `key` and a
+ * checksum of `value`, the thread descriptor and `salt` in slot `key + 1`, so osdep_ktls_getvalue_guarded() can tell
+ * whether the value was really set by the caller without dereferencing it.
+ *
+ * @param thr Pointer to a thread descriptor.
+ * @param key Numerical key. Must be in the range of `(0, 7)`. Slot `key + 1` is used as well.
+ * @param value Value to be stored into the TLS slot.
+ * @param salt Value that identifies the owner of the slot (e.g. the address of a static variable in the owning module).
+ * @retval 0 @x_term ok
+ * @retval -1 @x_term ng
+ */
+extern int osdep_ktls_set_guarded(thread_t *thr, unsigned int key, void *value, uintptr_t salt);
+
+/**
+ * @brief Get the value stored in a pair of TLS slots by osdep_ktls_set_guarded().
+ *
+ * @param thr Pointer to a thread descriptor.
+ * @param key Numerical key. Must be in the range of `(0, 7)`.
+ * @param salt Value passed to osdep_ktls_set_guarded().
+ * @return Value stored in the TLS slot. Or `NULL` when the guard does not match or an invalid key was supplied.
+ */
+extern void *osdep_ktls_getvalue_guarded(const thread_t *thr, unsigned int key, uintptr_t salt);
+
+/**
+ * @brief Number of bits of a packed KTLS slot available to fields.
+ * @see osdep_ktls_field_claim
+ */
+#define OSDEP_KTLS_PACKED_BITS 16
+
+/**
+ * @brief Packed KTLS field descriptor.
+ * @see osdep_ktls_field_claim
+ */
+typedef struct osdep_ktls_field_s {
+    /**
+     * @brief Key of the packed slot holding the field.
+     */
+    unsigned char key;
+    /**
+     * @brief Position of the lowest bit of the field.
+     */
+    unsigned char shift;
+    /**
+     * @brief Width of the field in bits.
+     */
+    unsigned char width;
+} osdep_ktls_field_t;
+
+/**
+ * @brief Claim a range of free KTLS slots.
+ * @details
+ * Keys handed out by the registry are owned by a tag, so modules that share threads don't overwrite each other's slots
+ * by convention-based numbering. Claiming the same tag again returns the same key as long as `nslots` matches. The
+ * slots used by osdep itself (#OSDEP_KTLS_KEY_UTLS and #OSDEP_KTLS_KEY_HEAP_TCACHE) are claimed from the start.
+ *
+ * Keys are only unique within the image. Only slots in the `ktls_claim_slots` mask this image was built with are
+ * handed out, so images that share threads don't get the same keys as long as their masks are disjoint. The guarded
+ * accessors are still recommended for values that outlive a call into another image.
+ *
+ * @param tag Unique name of the owner, e.g. `"libfoo.cache"`. Must stay valid until the slots are released.
+ * @param nslots Number of consecutive slots to claim.
+ * @return The first key, or -1 if no such range is free or `tag` was claimed with a different `nslots`.
+ */
+extern int osdep_ktls_claim(const char *tag, unsigned int nslots);
+
+/**
+ * @brief Claim a specific range of KTLS slots.
+ * @details Use this to register slots whose key was fixed before the registry existed. Claims that overlap slots owned
+ * by another tag or left out of this image's `ktls_claim_slots` mask are rejected and reported with WriteComDebugMsg().
+ *
+ * @param tag Unique name of the owner.
+ * @param key The first key.
+ * @param nslots Number of consecutive slots to claim.
+ * @retval 0 @x_term ok
+ * @retval -1 @x_term ng
+ */
+extern int osdep_ktls_claim_at(const char *tag, unsigned int key, unsigned int nslots);
+
+/**
+ * @brief Release the slots or the field claimed by a tag.
+ * @details Bits of a packed slot are not reused after release.
+ *
+ * @param tag The tag.
+ * @retval 0 @x_term ok
+ * @retval -1 @x_term ng
+ */
+extern int osdep_ktls_unclaim(const char *tag);
+
+/**
+ * @brief Get the tag owning a KTLS slot.
+ *
+ * @param key Numerical key.
+ * @return The tag, or `NULL` if the slot is free or the key is invalid.
+ */
+extern const char *osdep_ktls_get_owner(unsigned int key);
+
+/**
+ * @brief Claim a small field inside a KTLS slot shared with other fields.
+ * @details
+ * Several small per-thread values (flags, indices, small counters) can share a single slot this way. Packed slots
+ * carry a check value in the bits not used by fields, so fields of a thread that never set any of them read as 0
+ * instead of whatever the slot contained. Packed slots are claimed on demand with the tag `"osdep.ktls.packed"`.
+ *
+ * @param tag Unique name of the owner. Claiming the same tag again returns the same field as long as `bits` matches.
+ * @param bits Width of the field. Must be in the range of `[1, OSDEP_KTLS_PACKED_BITS]`.
+ * @param[out] field The field descriptor.
+ * @retval 0 @x_term ok
+ * @retval -1 @x_term ng
+ */
+extern int osdep_ktls_field_claim(const char *tag, unsigned int bits, osdep_ktls_field_t *field);
+
+/**
+ * @brief Get the value of a packed field on a thread.
+ *
+ * @param thr Pointer to a thread descriptor.
+ * @param field The field descriptor.
+ * @return Value of the field. 0 if the thread never set any field in the same slot.
+ */
+extern uint32_t osdep_ktls_field_get(const thread_t *thr, osdep_ktls_field_t field);
+
+/**
+ * @brief Set the value of a packed field on a thread.
+ * @details Only the thread itself should set its fields, since this is a read-modify-write of the whole slot.
+ *
+ * @param thr Pointer to a thread descriptor.
+ * @param field The field descriptor.
+ * @param value New value. Bits that don't fit in the field are discarded.
+ * @retval 0 @x_term ok
+ * @retval -1 @x_term ng
+ */
+extern int osdep_ktls_field_set(thread_t *thr, osdep_ktls_field_t field, uint32_t value);
+
 /**
  * @brief Initialize the TLS container on the current thread.
  *
@@ -90,6 +253,7 @@ extern int osdep_ktls_init_self(void);
  *
  * @param key Numerical key. Must be in the range of `(0, 8)`.
  * @return Pointer to the TLS slot. Or `NULL` when an invalid key was supplied.
+ * @warning Writes through the returned pointer are not checked against the slot claims.
  */
 extern void **osdep_ktls_get_self(unsigned int key);
 
@@ -107,7 +271,7 @@ extern void *osdep_ktls_getvalue_self(unsigned int key);
  * @param key Numerical key. Must be in the range of `(0, 8)`.
  * @param value Value to be stored into the TLS slot.
  * @retval 0 @x_term ok
- * @retval -1 @x_term ng 
+ * @retval -1 Invalid key, or the slot is claimed by osdep.
  */
 extern int osdep_ktls_set_self(unsigned int key, void *value);
 
@@ -116,7 +280,7 @@ extern int osdep_ktls_set_self(unsigned int key, void *value);
  *
  * @param key Numerical key. Must be in the range of `(0, 8)`.
  * @param bytes Number of bytes to allocate.
- * @return Allocated buffer, or NULL if the slot is not NULL, or if the allocation fails.
+ * @return Allocated buffer, or NULL if the slot is not NULL or claimed by osdep, or if the allocation fails.
  */
 extern void *osdep_ktls_alloc_self(unsigned int key, size_t bytes);
 
@@ -124,7 +288,8 @@ extern void *osdep_ktls_alloc_self(unsigned int key, size_t bytes);
  * @brief Free memory previously allocated by osdep_ktls_alloc().
  *
  * @param key Numerical key. Must be in the range of `(0, 8)`.
- * @retval 0 @x_term ok 
+ * @retval 0 @x_term ok
+ * @retval -1 Invalid key, empty slot, or the slot is claimed by osdep.
  */
 extern int osdep_ktls_free_self(unsigned int key);
 
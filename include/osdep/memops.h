@@ -0,0 +1,50 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file memops.h
+ * @brief Block copy and clear routines.
+ * @details
+ * These move 32 bytes per iteration with `ldm`/`stm` bursts whenever both ends can be brought to a 4-bytes boundary
+ * together, and fall back to a byte loop otherwise. They are meant for large, mostly aligned blocks such as TLS
+ * templates and reallocated memory.
+ *
+ * The routines use ARM state instructions internally but can be called from Thumb code.
+ */
+
+#ifndef __OSDEP_MEMOPS_H__
+#define __OSDEP_MEMOPS_H__
+
+#include <muteki/common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Copy memory.
+ * @details The copy always goes forwards, so overlapping ranges are fine as long as `dst` is not above `src`.
+ *
+ * @param dst Destination.
+ * @param src Source.
+ * @param size Number of bytes to copy.
+ * @x_void_return
+ */
+extern void osdep_memops_copy(void *dst, const void *src, size_t size);
+
+/**
+ * @brief Fill memory with zeroes.
+ *
+ * @param dst Destination.
+ * @param size Number of bytes to clear.
+ * @x_void_return
+ */
+extern void osdep_memops_zero(void *dst, size_t size);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_MEMOPS_H__
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file mutex.h
+ * @brief Hybrid user-mode mutex.
+ * @details
+ * Critical sections cost an svc on every enter and leave, even though they are almost never contended. The mutex here
+ * is taken and released with a single `SWP` when uncontended, and only falls back to parking on an OS semaphore when
+ * another thread holds it. The semaphore is created on first contention, so a mutex that is never contended never
+ * calls into the OS at all.
+ *
+ * Mutexes can be statically initialized with #OSDEP_MUTEX_INITIALIZER, which makes them usable as libc locks.
+ * Zero-filled memory is a valid unlocked #OSDEP_MUTEX_NORMAL mutex as well.
+ *
+ * @note This uses `SWP` and must be built in ARM state. See atomic.h.
+ */
+
+#ifndef __OSDEP_MUTEX_H__
+#define __OSDEP_MUTEX_H__
+
+#include <muteki/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Mutex types.
+ */
+typedef enum osdep_mutex_type_e {
+    /** Not recursive. Relocking from the owner deadlocks, and the owner is not tracked. Fastest. */
+    OSDEP_MUTEX_NORMAL = 0,
+    /** Can be locked again by the owner. Needs to be unlocked as many times. */
+    OSDEP_MUTEX_RECURSIVE,
+    /** Not recursive. Relocking from the owner and unlocking from another thread fail instead. */
+    OSDEP_MUTEX_ERRORCHECK,
+} osdep_mutex_type_t;
+
+/**
+ * @brief Mutex descriptor.
+ * @details Treat all fields as private.
+ */
+typedef struct osdep_mutex_s {
+    /** 0 when unlocked, 1 when locked, 2 when locked and other threads may be waiting. */
+    volatile uint32_t state;
+    /** Guards the creation of ::sem. */
+    volatile uint32_t sem_lock;
+    /** Semaphore waiters park on. Created on first contention. */
+    semaphore_t *volatile sem;
+    /** Owner of a recursive or error-checking mutex. */
+    thread_t *volatile owner;
+    /** Recursion depth of a recursive mutex. */
+    unsigned int depth;
+    /** Mutex type. */
+    osdep_mutex_type_t type;
+} osdep_mutex_t;
+
+/**
+ * @brief Static initializer for osdep_mutex_t.
+ * @param type Mutex type. See ::osdep_mutex_type_t.
+ */
+#define OSDEP_MUTEX_INITIALIZER(type) { 0, 0, NULL, NULL, 0, (type) }
+
+/**
+ * @brief Results of osdep_mutex_benchmark().
+ * @details All times are in milliseconds for the whole run.
+ */
+typedef struct osdep_mutex_benchmark_s {
+    /**
+     * @brief Number of lock/unlock pairs timed for each primitive.
+     */
+    size_t iterations;
+    /**
+     * @brief Time taken by uncontended #OSDEP_MUTEX_NORMAL mutexes.
+     */
+    unsigned int mutex_normal_ms;
+    /**
+     * @brief Time taken by uncontended #OSDEP_MUTEX_RECURSIVE mutexes.
+     */
+    unsigned int mutex_recursive_ms;
+    /**
+     * @brief Time taken by uncontended critical sections.
+     */
+    unsigned int critical_section_ms;
+} osdep_mutex_benchmark_t;
+
+/**
+ * @brief Initialize a mutex.
+ *
+ * @param mutex The mutex descriptor.
+ * @param type Mutex type.
+ * @x_void_return
+ */
+extern void osdep_mutex_init(osdep_mutex_t *mutex, osdep_mutex_type_t type);
+
+/**
+ * @brief Destroy a mutex.
+ * @details The mutex must be unlocked and must not have any waiter.
+ *
+ * @param mutex The mutex descriptor.
+ * @x_void_return
+ */
+extern void osdep_mutex_destroy(osdep_mutex_t *mutex);
+
+/**
+ * @brief Lock a mutex, waiting for it if needed.
+ *
+ * @param mutex The mutex descriptor.
+ * @retval true @x_term ok
+ * @retval false The mutex is error-checking and already owned by the current thread.
+ */
+extern bool osdep_mutex_lock(osdep_mutex_t *mutex);
+
+/**
+ * @brief Lock a mutex only if that does not require waiting.
+ *
+ * @param mutex The mutex descriptor.
+ * @retval true @x_term ok
+ * @retval false The mutex is owned by another thread, or by the current thread and is not recursive.
+ */
+extern bool osdep_mutex_trylock(osdep_mutex_t *mutex);
+
+/**
+ * @brief Unlock a mutex.
+ *
+ * @param mutex The mutex descriptor.
+ * @retval true @x_term ok
+ * @retval false The mutex is recursive or error-checking and not owned by the current thread.
+ */
+extern bool osdep_mutex_unlock(osdep_mutex_t *mutex);
+
+/**
+ * @brief Time uncontended mutexes against critical sections on the current device.
+ * @details This takes a while. Use at least 100000 iterations, since times are read from the millisecond clock.
+ *
+ * @param iterations Number of lock/unlock pairs to time for each primitive.
+ * @param[out] result The results.
+ * @x_void_return
+ */
+extern void osdep_mutex_benchmark(size_t iterations, osdep_mutex_benchmark_t *result);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_MUTEX_H__
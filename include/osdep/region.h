@@ -0,0 +1,120 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file region.h
+ * @brief Scoped region allocator backed by the secondary heap.
+ * @details
+ * Regions hand out memory from the secondary heap managed by AllocBlock() and FreeBlock(). Each region starts a new
+ * segment on that heap, so ending a region frees everything allocated from it with a single FreeBlock() call. Regions
+ * nest like a stack: a region begun while another one is active must be ended first. Ending any other region than the
+ * innermost one is reported with WriteComDebugMsg() and does nothing.
+ *
+ * The secondary heap is small (usually 64KiB). When it runs out, or when allocating from a region that is not the
+ * innermost one, memory is taken from the primary heap with osdep_heap_alloc() instead and freed when the region ends.
+ *
+ * The secondary heap is shared by the whole system and its segments only work in LIFO order, so regions should only be
+ * used from a single thread (usually the UI thread).
+ *
+ * Ending a region frees every secondary heap block allocated after the region's first one, no matter who allocated it.
+ * UI syscalls allocate there as well, so don't create UI objects (or call anything else that may use AllocBlock())
+ * while a region is active unless they are gone before it ends.
+ */
+
+#ifndef __OSDEP_REGION_H__
+#define __OSDEP_REGION_H__
+
+#include <muteki/common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Region descriptor type.
+ */
+typedef struct osdep_region_s osdep_region_t;
+
+/**
+ * @brief Region descriptor structure.
+ * @details This is usually allocated on the stack of the function that owns the scope. The fields are private.
+ */
+struct osdep_region_s {
+    /** Region that was innermost when this region began. */
+    osdep_region_t *parent;
+    /** First block allocated on the secondary heap. Starts the segment. */
+    void *segment;
+    /** Allocations that fell back to the primary heap. */
+    void *fallback;
+    /** Tag passed to AllocBlock(). */
+    unsigned short tag;
+    /** Set when the region has been ended. */
+    bool is_ended;
+};
+
+/**
+ * @brief Allocate a single object of `type` from a region.
+ * @param region The region descriptor.
+ * @param type Type of the object.
+ * @return Pointer to the uninitialized object, or `NULL` if allocation fails.
+ */
+#define OSDEP_REGION_NEW(region, type) ((type *) osdep_region_alloc((region), sizeof(type)))
+
+/**
+ * @brief Allocate an array of `nmemb` objects of `type` from a region.
+ * @param region The region descriptor.
+ * @param type Type of the objects.
+ * @param nmemb Number of objects.
+ * @return Pointer to the uninitialized array, or `NULL` if allocation fails.
+ */
+#define OSDEP_REGION_NEW_ARRAY(region, type, nmemb) \
+    ((type *) osdep_region_alloc_array((region), sizeof(type), (nmemb)))
+
+/**
+ * @brief Begin a region and make it the innermost one.
+ *
+ * @param[out] region The region descriptor.
+ * @param tag Tag passed to AllocBlock().
+ * @x_void_return
+ */
+extern void osdep_region_begin(osdep_region_t *region, unsigned short tag);
+
+/**
+ * @brief End a region and free everything allocated from it.
+ * @details `region` must be the innermost active region. Otherwise this reports the mistake with WriteComDebugMsg() and
+ * leaves every region alone. Ending a region that has already been ended does nothing.
+ * @warning Secondary heap blocks allocated by others (e.g. by UI syscalls) after the region's first allocation are
+ * freed as well.
+ *
+ * @param region The region descriptor.
+ * @x_void_return
+ */
+extern void osdep_region_end(osdep_region_t *region);
+
+/**
+ * @brief Allocate 8-bytes aligned memory from a region.
+ *
+ * @param region The region descriptor.
+ * @param size Size of the memory to allocate.
+ * @return Pointer to allocated memory, or `NULL` if allocation fails.
+ */
+__attribute__((assume_aligned(8))) extern void *osdep_region_alloc(osdep_region_t *region, size_t size);
+
+/**
+ * @brief Allocate 8-bytes aligned memory for an array from a region.
+ *
+ * @param region The region descriptor.
+ * @param size Size of each array member.
+ * @param nmemb Number of array members.
+ * @return Pointer to allocated memory, or `NULL` if allocation fails or the size overflows.
+ */
+__attribute__((assume_aligned(8))) extern void *osdep_region_alloc_array(osdep_region_t *region, size_t size,
+                                                                         size_t nmemb);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_REGION_H__
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file rwlock.h
+ * @brief Reader-writer locks.
+ * @details
+ * The lock state is guarded by an osdep_mutex_t that is only held for a few instructions, so taking a read lock while
+ * no writer holds or waits for the lock costs a couple of `SWP`s and no svc. Everything else queues up in FIFO order
+ * and parks on an event of its own. A writer waits for the readers that came before it, and readers that come after a
+ * waiting writer wait for that writer, so neither side can starve the other.
+ *
+ * Because of that, taking a read lock again on a thread that already holds one deadlocks if a writer started waiting
+ * in between.
+ *
+ * Locks can be statically initialized with #OSDEP_RWLOCK_INITIALIZER. Zero-filled memory is a valid lock as well.
+ */
+
+#ifndef __OSDEP_RWLOCK_H__
+#define __OSDEP_RWLOCK_H__
+
+#include <muteki/threading.h>
+#include <osdep/mutex.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Reader-writer lock descriptor.
+ * @details Treat all fields as private.
+ */
+typedef struct osdep_rwlock_s {
+    /** Guards all other fields. */
+    osdep_mutex_t lock;
+    /** Number of readers holding the lock. */
+    unsigned int readers;
+    /** Whether a writer holds the lock. */
+    bool writer;
+    /** First waiter. */
+    struct osdep_rwlock_waiter_s *head;
+    /** Last waiter. */
+    struct osdep_rwlock_waiter_s *tail;
+} osdep_rwlock_t;
+
+/**
+ * @brief Static initializer for osdep_rwlock_t.
+ */
+#define OSDEP_RWLOCK_INITIALIZER { OSDEP_MUTEX_INITIALIZER(OSDEP_MUTEX_NORMAL), 0, false, NULL, NULL }
+
+/**
+ * @brief Initialize a reader-writer lock.
+ *
+ * @param rwlock The lock descriptor.
+ * @x_void_return
+ */
+extern void osdep_rwlock_init(osdep_rwlock_t *rwlock);
+
+/**
+ * @brief Destroy a reader-writer lock.
+ * @details The lock must be unlocked and must not have any waiter.
+ *
+ * @param rwlock The lock descriptor.
+ * @x_void_return
+ */
+extern void osdep_rwlock_destroy(osdep_rwlock_t *rwlock);
+
+/**
+ * @brief Take a read lock, waiting for it if needed.
+ *
+ * @param rwlock The lock descriptor.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_rwlock_rdlock(osdep_rwlock_t *rwlock);
+
+/**
+ * @brief Take a read lock only if that does not require waiting.
+ *
+ * @param rwlock The lock descriptor.
+ * @retval true @x_term ok
+ * @retval false A writer holds or waits for the lock.
+ */
+extern bool osdep_rwlock_tryrdlock(osdep_rwlock_t *rwlock);
+
+/**
+ * @brief Take a write lock, waiting for it if needed.
+ *
+ * @param rwlock The lock descriptor.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_rwlock_wrlock(osdep_rwlock_t *rwlock);
+
+/**
+ * @brief Take a write lock only if that does not require waiting.
+ *
+ * @param rwlock The lock descriptor.
+ * @retval true @x_term ok
+ * @retval false The lock is held or waited for by another thread.
+ */
+extern bool osdep_rwlock_trywrlock(osdep_rwlock_t *rwlock);
+
+/**
+ * @brief Release a read or write lock.
+ *
+ * @param rwlock The lock descriptor.
+ * @retval true @x_term ok
+ * @retval false The lock is not held.
+ */
+extern bool osdep_rwlock_unlock(osdep_rwlock_t *rwlock);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_RWLOCK_H__
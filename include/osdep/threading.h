@@ -17,13 +17,156 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Callback type for thread exit hooks.
+ * @param thr The thread that is exiting.
+ */
+typedef void (*osdep_thread_exit_hook_t)(thread_t *thr);
+
+/**
+ * @brief Extra stack range of a thread in the stack registry.
+ */
+typedef struct osdep_thread_alias_s osdep_thread_alias_t;
+
+/**
+ * @brief Results of osdep_thread_benchmark_get_current().
+ * @details All times are in milliseconds for the whole run.
+ */
+typedef struct osdep_thread_benchmark_s {
+    /**
+     * @brief Number of lookups timed for each path.
+     */
+    size_t iterations;
+    /**
+     * @brief Whether the calling thread was found in the stack registry.
+     * @details When `false`, ::registry_ms is the time taken by lookups that miss.
+     */
+    bool is_registered;
+    /**
+     * @brief Time taken by stack registry lookups.
+     */
+    unsigned int registry_ms;
+    /**
+     * @brief Time taken by the critical section svc fallback.
+     */
+    unsigned int svc_ms;
+} osdep_thread_benchmark_t;
+
 /**
  * @brief Get the current running thread.
+ * @details
+ * Threads created with osdep_thread_create() or registered with osdep_thread_register_current() are looked up by
+ * comparing the current stack pointer against their stack ranges, which takes no syscall. So is code running on a stack
+ * recorded with osdep_thread_alias_move(). All other threads fall back to a critical section trick that costs an svc
+ * on every call.
+ *
+ * Define `OSDEP_THREAD_VERIFY_CURRENT` when building osdep to check every registry hit against the slow path.
+ *
  * @x_void_param
  * @return Current running thread.
  */
 extern thread_t *osdep_thread_get_current(void);
 
+/**
+ * @brief Create a new thread that can be looked up quickly.
+ * @details
+ * Drop-in replacement of OSCreateThread(). The thread stack range is recorded so osdep_thread_get_current() doesn't
+ * need a syscall on the new thread, and the exit hooks are run when `func` returns.
+ *
+ * Up to 16 threads can be registered at the same time. Threads created beyond that still run the exit hooks, but are
+ * looked up with the slow path. This is reported with WriteComDebugMsg().
+ *
+ * @param func Function to execute in the new thread.
+ * @param user_data User data for the thread.
+ * @param stack_size The size of the thread stack.
+ * @param defer_start Do not immediately schedule this thread and create it as suspended.
+ * @return The thread descriptor, or `NULL` on error.
+ */
+extern thread_t *osdep_thread_create(thread_func_t func, void *user_data, size_t stack_size, bool defer_start);
+
+/**
+ * @brief Record the stack range of the current thread.
+ * @details Use this on threads not created by osdep_thread_create(), such as the main thread. The registration is
+ * dropped by osdep_thread_run_exit_hooks().
+ *
+ * @param stack_size Size of the stack allocated for the current thread.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_thread_register_current(size_t stack_size);
+
+/**
+ * @brief Reserve a stack registry entry for stacks other than the own stack of a thread.
+ * @details Use this when `thr` switches to stacks of its own in user mode, e.g. to run coroutines, so that
+ * osdep_thread_get_current() keeps taking the fast path on them. The alias shares the 16 entries with threads.
+ *
+ * @param thr The thread.
+ * @return The alias, which doesn't cover any stack yet, or `NULL` if the registry is full.
+ */
+extern osdep_thread_alias_t *osdep_thread_alias_create(thread_t *thr);
+
+/**
+ * @brief Point an alias at another stack.
+ * @details This only updates the entry without taking any lock, so it is cheap enough to call on every context switch.
+ * Call it on the thread the alias was created for. The stack must not be in use by any other thread.
+ *
+ * @param alias The alias.
+ * @param stack Lowest address of the stack, or `NULL` to cover no stack.
+ * @param stack_size Size of the stack in bytes.
+ * @x_void_return
+ */
+extern void osdep_thread_alias_move(osdep_thread_alias_t *alias, void *stack, size_t stack_size);
+
+/**
+ * @brief Release an alias.
+ *
+ * @param alias The alias. Can be `NULL`.
+ * @x_void_return
+ */
+extern void osdep_thread_alias_destroy(osdep_thread_alias_t *alias);
+
+/**
+ * @brief Register a hook that releases per-thread resources when a thread exits.
+ * @details Hooks are called by osdep_thread_exit() and osdep_thread_run_exit_hooks(). Registering the same hook more
+ * than once has no effect.
+ *
+ * @param hook The hook.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_thread_add_exit_hook(osdep_thread_exit_hook_t hook);
+
+/**
+ * @brief Call all registered exit hooks on a thread.
+ * @details Call this on a thread that is about to be terminated with OSTerminateThread(). Hooks are run on the calling
+ * thread, not on `thr`. This also drops the stack range of `thr` recorded by osdep_thread_create() or
+ * osdep_thread_register_current(), and clears the aliases of `thr`. Those still need osdep_thread_alias_destroy().
+ *
+ * @param thr The thread descriptor.
+ * @x_void_return
+ */
+extern void osdep_thread_run_exit_hooks(thread_t *thr);
+
+/**
+ * @brief Run all registered exit hooks on the current thread and terminate it.
+ * @details Use this in place of OSExitThread() so per-thread resources held by osdep are released.
+ *
+ * @param exit_code The exit code.
+ * @retval 0 @x_term ok
+ */
+extern int osdep_thread_exit(int exit_code);
+
+/**
+ * @brief Time the stack registry lookup of osdep_thread_get_current() against its svc fallback on the current device.
+ * @details This takes a while. Use at least 100000 iterations, since times are read from the millisecond clock. Run
+ * this on a thread created with osdep_thread_create() to time registry hits.
+ *
+ * @param iterations Number of lookups to time for each path.
+ * @param[out] result The results.
+ * @x_void_return
+ */
+extern void osdep_thread_benchmark_get_current(size_t iterations, osdep_thread_benchmark_t *result);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
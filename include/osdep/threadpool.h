@@ -0,0 +1,179 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file threadpool.h
+ * @brief Fixed-size worker thread pool.
+ * @details
+ * Creating a thread costs a kernel allocation and a stack allocation, which adds up for short background jobs. A pool
+ * keeps a fixed set of worker threads around and feeds them jobs through bounded queues.
+ *
+ * Jobs are submitted to one of up to #OSDEP_THREADPOOL_LANES_MAX lanes. Each lane has its own queue and its own
+ * workers, which are moved to a scheduler slot of choice with OSSetThreadPriority(), so jobs on a high priority lane
+ * don't wait behind jobs on a low priority one.
+ *
+ * Idle workers park on a semaphore. Submitting only posts to it when the queue goes from empty to non-empty, and a
+ * worker that takes a job off a queue that is still non-empty passes the wakeup on to the next idle worker. A busy
+ * pool therefore doesn't make any svc to hand out jobs.
+ */
+
+#ifndef __OSDEP_THREADPOOL_H__
+#define __OSDEP_THREADPOOL_H__
+
+#include <muteki/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Maximum number of lanes in a pool.
+ */
+#define OSDEP_THREADPOOL_LANES_MAX 4
+
+/**
+ * @brief Pool descriptor type.
+ */
+typedef struct osdep_threadpool_s osdep_threadpool_t;
+
+/**
+ * @brief Job function type.
+ * @param user_data User data passed to osdep_threadpool_submit().
+ * @return The result of the job, which is stored in the future.
+ */
+typedef int (*osdep_threadpool_func_t)(void *user_data);
+
+/**
+ * @brief Lane configuration.
+ */
+typedef struct osdep_threadpool_lane_config_s {
+    /**
+     * @brief Number of workers serving this lane. Must not be 0.
+     */
+    size_t workers;
+    /**
+     * @brief Maximum number of queued jobs. Must not be 0.
+     */
+    size_t capacity;
+    /**
+     * @brief Slot passed to OSSetThreadPriority() for the workers, or a negative value to keep the default one.
+     */
+    short slot;
+} osdep_threadpool_lane_config_t;
+
+/**
+ * @brief Pool configuration.
+ */
+typedef struct osdep_threadpool_config_s {
+    /**
+     * @brief Stack size of each worker.
+     */
+    size_t stack_size;
+    /**
+     * @brief Number of lanes. Must be in the range of `[1, OSDEP_THREADPOOL_LANES_MAX]`.
+     */
+    size_t lanes;
+    /**
+     * @brief Configuration of each lane.
+     */
+    osdep_threadpool_lane_config_t lane[OSDEP_THREADPOOL_LANES_MAX];
+} osdep_threadpool_config_t;
+
+/**
+ * @brief Future holding the result of a job.
+ * @details
+ * Futures are initialized by osdep_threadpool_submit() and can live anywhere, including the stack of the submitting
+ * thread, as long as they outlive the job or a wait on them. Only one thread may wait on a future at a time.
+ *
+ * Treat all fields as private.
+ */
+typedef struct osdep_threadpool_future_s {
+    /** Pending, waited on or done. */
+    volatile uint32_t state;
+    /** Return value of the job. */
+    int result;
+    /** Event of the waiting thread. */
+    event_t *volatile event;
+} osdep_threadpool_future_t;
+
+/**
+ * @brief Create a pool and start its workers.
+ *
+ * @param config The pool configuration.
+ * @return The pool, or `NULL` if the configuration is invalid or any of the workers could not be created.
+ */
+extern osdep_threadpool_t *osdep_threadpool_create(const osdep_threadpool_config_t *config);
+
+/**
+ * @brief Run all queued jobs, stop the workers and destroy the pool.
+ * @details Nothing may submit to the pool while or after this is called.
+ *
+ * @param pool The pool.
+ * @x_void_return
+ */
+extern void osdep_threadpool_destroy(osdep_threadpool_t *pool);
+
+/**
+ * @brief Queue a job, waiting for room in the queue if needed.
+ *
+ * @param pool The pool.
+ * @param lane Index of the lane.
+ * @param func The job function.
+ * @param user_data User data passed to `func`.
+ * @param[out] future Future that receives the result, or `NULL` if the result is not needed.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_threadpool_submit(osdep_threadpool_t *pool, size_t lane, osdep_threadpool_func_t func,
+                                    void *user_data, osdep_threadpool_future_t *future);
+
+/**
+ * @brief Queue a job only if there is room in the queue.
+ *
+ * @param pool The pool.
+ * @param lane Index of the lane.
+ * @param func The job function.
+ * @param user_data User data passed to `func`.
+ * @param[out] future Future that receives the result, or `NULL` if the result is not needed.
+ * @retval true @x_term ok
+ * @retval false The queue is full, or the lane does not exist.
+ */
+extern bool osdep_threadpool_try_submit(osdep_threadpool_t *pool, size_t lane, osdep_threadpool_func_t func,
+                                        void *user_data, osdep_threadpool_future_t *future);
+
+/**
+ * @brief Check whether the job of a future has finished.
+ *
+ * @param future The future.
+ * @retval true The job has finished.
+ * @retval false The job is still queued or running.
+ */
+extern bool osdep_threadpool_future_is_done(const osdep_threadpool_future_t *future);
+
+/**
+ * @brief Wait for the job of a future to finish.
+ *
+ * @param future The future.
+ * @return The result of the job.
+ */
+extern int osdep_threadpool_future_wait(osdep_threadpool_future_t *future);
+
+/**
+ * @brief osdep_threadpool_future_wait() with a timeout.
+ *
+ * @param future The future.
+ * @param timeout Timeout in OSSleep() units.
+ * @param[out] result The result of the job. Only set when the job has finished. Can be `NULL`.
+ * @return The result of the wait.
+ * @see wait_result_t
+ */
+extern wait_result_t osdep_threadpool_future_timedwait(osdep_threadpool_future_t *future, unsigned int timeout,
+                                                       int *result);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_THREADPOOL_H__
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file timer.h
+ * @brief Software timers multiplexed onto Timer1.
+ * @details
+ * SetTimer1IntHandler() only takes a single callback. The timer service takes it over and drives any number of
+ * one-shot and periodic software timers off it, kept in a hierarchical timer wheel so arming and cancelling a timer
+ * takes constant time no matter how many are pending.
+ *
+ * The Timer1 callback only bumps a tick counter and sets an event when the earliest pending timer is due. Timer
+ * callbacks run on a dispatcher thread owned by the service, one at a time, so they may block, take locks and arm or
+ * cancel timers (including their own). A timer that takes too long delays all other timers.
+ *
+ * Time is measured in ticks. The length of a tick is the Timer1 interval passed to osdep_timer_service_start().
+ * Timers fire on the first tick at or after their expiry time.
+ */
+
+#ifndef __OSDEP_TIMER_H__
+#define __OSDEP_TIMER_H__
+
+#include <muteki/common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Software timer descriptor type.
+ */
+typedef struct osdep_timer_s osdep_timer_t;
+
+/**
+ * @brief Callback type for software timers.
+ * @param timer The timer that fired.
+ * @param user_data User data passed to osdep_timer_init().
+ */
+typedef void (*osdep_timer_callback_t)(osdep_timer_t *timer, void *user_data);
+
+/**
+ * @brief Timer list node.
+ * @details Treat all fields as private.
+ */
+typedef struct osdep_timer_node_s {
+    struct osdep_timer_node_s *prev;
+    struct osdep_timer_node_s *next;
+} osdep_timer_node_t;
+
+/**
+ * @brief Software timer descriptor.
+ * @details Initialize with osdep_timer_init(). Treat all fields as private.
+ */
+struct osdep_timer_s {
+    /** Link in the wheel slot. Must be the first field. */
+    osdep_timer_node_t node;
+    /** Tick the timer expires on. */
+    uint32_t expires;
+    /** Period in ticks, or 0 for one-shot timers. */
+    uint32_t period;
+    /** The callback. */
+    osdep_timer_callback_t callback;
+    /** User data passed to the callback. */
+    void *user_data;
+    /** Wheel slot the timer is in. */
+    unsigned short slot;
+    /** Whether the timer is pending. */
+    unsigned char state;
+};
+
+/**
+ * @brief Take over the Timer1 handler and start the dispatcher thread.
+ * @details The previous handler is restored by osdep_timer_service_stop().
+ *
+ * @param interval Length of a tick in 10 milliseconds increments. Must not be 0.
+ * @param stack_size Stack size of the dispatcher thread, which runs the timer callbacks.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_timer_service_start(short interval, size_t stack_size);
+
+/**
+ * @brief Stop the dispatcher thread and give back the Timer1 handler.
+ * @details Timers still pending are dropped without firing. Must not be called from a timer callback.
+ *
+ * @x_void_param
+ * @x_void_return
+ */
+extern void osdep_timer_service_stop(void);
+
+/**
+ * @brief Get the number of ticks since the timer service was started.
+ *
+ * @x_void_param
+ * @return The current tick. Wraps around.
+ */
+extern uint32_t osdep_timer_now(void);
+
+/**
+ * @brief Initialize a software timer.
+ *
+ * @param timer The timer descriptor.
+ * @param callback The callback.
+ * @param user_data User data passed to the callback.
+ * @x_void_return
+ */
+extern void osdep_timer_init(osdep_timer_t *timer, osdep_timer_callback_t callback, void *user_data);
+
+/**
+ * @brief Arm a software timer, or re-arm it if it is already pending.
+ * @details
+ * Periodic timers are re-armed right before their callback runs, so they keep a fixed rate. A periodic timer that fell
+ * behind by more than a period fires once on the next tick and continues from there, instead of firing for every
+ * period it missed.
+ *
+ * @param timer The timer descriptor.
+ * @param delay Number of ticks from now until the timer fires. 0 fires it on the next tick.
+ * @param period Number of ticks between subsequent firings, or 0 to fire only once.
+ * @retval true @x_term ok
+ * @retval false The timer service is not running.
+ */
+extern bool osdep_timer_arm(osdep_timer_t *timer, uint32_t delay, uint32_t period);
+
+/**
+ * @brief Cancel a pending software timer.
+ * @details
+ * This does not wait for a callback that is already running. Once this returns, the timer won't fire again, so a
+ * timer can be freed after cancelling it from its own callback, or after this returns `true`. On `false` from another
+ * thread, the timer may only be freed once its callback is known to have returned.
+ *
+ * @param timer The timer descriptor.
+ * @retval true The timer was pending and its callback is not running. It is no longer in use by the service.
+ * @retval false The timer was not pending, or its callback is running on the dispatcher thread.
+ */
+extern bool osdep_timer_cancel(osdep_timer_t *timer);
+
+/**
+ * @brief Check whether a software timer is pending.
+ *
+ * @param timer The timer descriptor.
+ * @retval true The timer is pending.
+ * @retval false The timer is not pending.
+ */
+extern bool osdep_timer_is_pending(const osdep_timer_t *timer);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_TIMER_H__
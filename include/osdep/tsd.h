@@ -0,0 +1,108 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file tsd.h
+ * @brief Thread-specific data (TSD) with dynamically allocated keys.
+ * @details
+ * KTLS only has a handful of fixed slots shared by every module, and UTLS only serves the static TLS segment laid out
+ * by the compiler. This provides the `pthread_key_*` model on top of UTLS instead: keys are allocated at runtime, and
+ * each thread keeps a dense array of values indexed by key, hung off of the TCB of its UTLS block. Getting a value is
+ * an array lookup once the UTLS block is cached.
+ *
+ * Destructors of keys are run by the thread exit hooks, so they only run on threads that exit through
+ * osdep_thread_exit() or that get osdep_thread_run_exit_hooks() called on them. The value arrays of threads reclaimed
+ * by osdep_utls_sweep() are freed without calling destructors. When osdep_thread_run_exit_hooks() is called on another
+ * thread, destructors run on the calling thread, but osdep_tsd_get() and osdep_tsd_set() still reach the values of the
+ * exiting thread while they run. TLS space that doesn't belong to any thread runs them through
+ * osdep_tsd_run_destructors() instead.
+ */
+
+#ifndef __OSDEP_TSD_H__
+#define __OSDEP_TSD_H__
+
+#include <muteki/common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Maximum number of keys that can exist at the same time.
+ */
+#define OSDEP_TSD_KEYS_MAX 64
+
+/**
+ * @brief Maximum number of times destructors are run on an exiting thread.
+ * @details Destructors may set values again. They are run again on those values up to this many times in total.
+ */
+#define OSDEP_TSD_DESTRUCTOR_ITERATIONS 4
+
+/**
+ * @brief Key type.
+ */
+typedef unsigned int osdep_tsd_key_t;
+
+/**
+ * @brief Callback type for key destructors.
+ * @param value The non-`NULL` value the exiting thread had for the key.
+ */
+typedef void (*osdep_tsd_destructor_t)(void *value);
+
+/**
+ * @brief Allocate a key.
+ * @details All threads start with `NULL` as the value of a new key.
+ *
+ * @param[out] key The new key.
+ * @param destructor Destructor to call on non-`NULL` values on thread exit. Can be `NULL`.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_tsd_key_create(osdep_tsd_key_t *key, osdep_tsd_destructor_t destructor);
+
+/**
+ * @brief Free a key.
+ * @details The destructor is not called on existing values. Freeing the values is up to the caller.
+ *
+ * @param key The key.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_tsd_key_delete(osdep_tsd_key_t key);
+
+/**
+ * @brief Get the value of a key on the current thread.
+ *
+ * @param key The key.
+ * @return The value, or `NULL` if the thread has not set it or if the key is invalid.
+ */
+extern void *osdep_tsd_get(osdep_tsd_key_t key);
+
+/**
+ * @brief Set the value of a key on the current thread.
+ *
+ * @param key The key.
+ * @param value The value.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_tsd_set(osdep_tsd_key_t key, const void *value);
+
+/**
+ * @brief Run the destructors of the values stored in a TLS space and free its values.
+ * @details This is what the thread exit hook does. Call it on TLS space from osdep_utls_block_create() before
+ * destroying it. The space doesn't need to be installed on the calling thread, osdep_tsd_get() and osdep_tsd_set()
+ * reach it while the destructors run.
+ *
+ * @param tls The TLS space. Can be `NULL`.
+ * @x_void_return
+ */
+extern void osdep_tsd_run_destructors(void *tls);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __OSDEP_TSD_H__
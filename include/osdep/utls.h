@@ -8,6 +8,11 @@
  * @brief Userspace TLS (UTLS) control.
  * @details A hash-table-backed TLS storage emulator local to the current module. Include this header to control the
  * lifecycle of UTLS.
+ *
+ * Once the TLS space of a thread is allocated, it is also cached in the KTLS slots starting at ::OSDEP_KTLS_KEY_UTLS.
+ * Subsequent accesses from that thread are served from there without taking the container lock or hashing. When
+ * several modules in the same process use UTLS, the cache only holds the space of the module that accessed it last and
+ * the others go through the hash table.
  */
 
 #ifndef __OSDEP_UTLS_H__
@@ -19,6 +24,37 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Number of words taken by each slot of the UTLS container.
+ */
+#define OSDEP_UTLS_ELEMENT_WORDS 4
+
+/**
+ * @brief Define a static initial table and TLS block pool for the UTLS container.
+ * @details
+ * Use this once at file scope in the application. The container then starts with a table of `1 << size_shift` slots
+ * and carves TLS blocks from a `pool_size` bytes static pool before touching the heap, so TLS accesses during early
+ * startup don't need any heap allocation as long as they fit. The table holds up to `(1 << size_shift) * 3 / 4` threads
+ * before it has to grow. Each TLS block takes the size of `.tdata` plus `.tbss` plus 8 bytes, rounded up to a multiple
+ * of 8.
+ *
+ * Without this, the container starts with a 16-slot table allocated on first use.
+ *
+ * @param size_shift Log2 of the number of slots in the table.
+ * @param pool_size Size of the TLS block pool in bytes. Can be 0.
+ */
+#define OSDEP_UTLS_STATIC_TABLE(size_shift, pool_size) \
+    uintptr_t __osdep_utls_static_table[(1u << (size_shift)) * OSDEP_UTLS_ELEMENT_WORDS]; \
+    const size_t __osdep_utls_static_table_shift = (size_shift); \
+    uint64_t __osdep_utls_static_pool[((pool_size) + 15u) / 8u]; \
+    const size_t __osdep_utls_static_pool_size = ((pool_size) + 7u) / 8u * 8u
+
+// Defined by OSDEP_UTLS_STATIC_TABLE().
+extern uintptr_t __osdep_utls_static_table[];
+extern const size_t __osdep_utls_static_table_shift;
+extern uint64_t __osdep_utls_static_pool[];
+extern const size_t __osdep_utls_static_pool_size;
+
 /**
  * @brief Statistics of TLS allocation
  */
@@ -35,8 +71,112 @@ typedef struct osdep_utls_stats_s {
      * @brief Number of slots already allocated for the container. Only valid when ::is_initialized is true.
      */
     size_t slots_allocated;
+    /**
+     * @brief Number of slots that held an element that has been removed since the last rebuild of the container.
+     * @details These slots are reused by later insertions, and are counted towards the load factor until then.
+     */
+    size_t slots_deleted;
+    /**
+     * @brief Sum of the probe lengths of all used slots.
+     * @details The probe length of a slot is the number of slots a lookup inspects before finding it, starting at 1.
+     * The average probe length is `probe_length_total / slots_used`.
+     */
+    size_t probe_length_total;
+    /**
+     * @brief Longest probe length among used slots. This never exceeds 8.
+     */
+    size_t probe_length_max;
+    /**
+     * @brief Number of TLS blocks in pools created by osdep_utls_reserve() and OSDEP_UTLS_STATIC_TABLE().
+     */
+    size_t pool_blocks;
+    /**
+     * @brief Number of TLS blocks in pools that are not in use.
+     */
+    size_t pool_blocks_free;
+    /**
+     * @brief If true, osdep was built with `OSDEP_UTLS_STATS` and the counters below are valid.
+     * @details The counters are kept since startup or since the last osdep_utls_reset_counters() call. They are updated
+     * without locking on the fast path, so they may miss a few events when threads race on them.
+     */
+    bool has_counters;
+    /**
+     * @brief Number of __aeabi_read_tp() calls.
+     */
+    uint32_t read_tp_calls;
+    /**
+     * @brief Number of __aeabi_read_tp() calls that missed the KTLS cache and took the container lock.
+     */
+    uint32_t read_tp_misses;
+    /**
+     * @brief Number of times the container lock was taken.
+     */
+    uint32_t lock_acquisitions;
+    /**
+     * @brief Number of times the container lock was already held when trying to take it.
+     */
+    uint32_t lock_contentions;
+    /**
+     * @brief Number of TLS blocks allocated and initialized on the first TLS access of a thread.
+     */
+    uint32_t first_touches;
+    /**
+     * @brief Number of bytes initialized by first touches.
+     */
+    uint32_t first_touch_bytes;
+    /**
+     * @brief Time spent in first touches, in units of the clock set by osdep_utls_set_stats_clock().
+     */
+    uint32_t first_touch_time;
+    /**
+     * @brief Number of times the container was rebuilt, including growing and shrinking it.
+     */
+    uint32_t rebuilds;
+    /**
+     * @brief Number of rebuilds that grew the container.
+     */
+    uint32_t growths;
+    /**
+     * @brief Number of elements moved by rebuilds.
+     */
+    uint32_t rebuild_elements_moved;
+    /**
+     * @brief Time spent in rebuilds, in units of the clock set by osdep_utls_set_stats_clock().
+     */
+    uint32_t rebuild_time;
 } osdep_utls_stats_t;
 
+/**
+ * @brief Results of osdep_utls_benchmark().
+ * @details All times are in milliseconds for the whole run.
+ */
+typedef struct osdep_utls_benchmark_s {
+    /**
+     * @brief Number of lookups timed for each path.
+     */
+    size_t iterations;
+    /**
+     * @brief Time taken by lookups that hit the pointer cached in KTLS.
+     */
+    unsigned int cached_ms;
+    /**
+     * @brief Time taken by lookups that miss the cache and go through osdep_thread_get_current(), the container lock
+     * and the dict.
+     */
+    unsigned int dict_ms;
+    /**
+     * @brief Time taken by the lookup __aeabi_read_tp() used before the cache existed, which found the thread with an
+     * svc and took a critical section around the dict.
+     */
+    unsigned int legacy_ms;
+} osdep_utls_benchmark_t;
+
+/**
+ * @brief Clock callback type for UTLS instrumentation.
+ * @return Current value of a free-running counter, e.g. a hardware timer.
+ */
+typedef uint32_t (*osdep_utls_clock_t)(void);
+
 /**
  * @brief Manually initialize UTLS container.
  * @details This is normally not needed as the __aeabi_read_tp() implementation will automatically call this on first
@@ -64,12 +204,136 @@ extern void osdep_utls_cfini(void);
  */
 extern void *osdep_utls_peek(const thread_t *thr);
 
+/**
+ * @brief Get the TLS space of the current thread, allocating it if needed.
+ * @details The first 2 words of the TLS space are the thread control block (TCB). Word 0 holds the value array used by
+ * tsd.h and word 1 holds the per-thread call count of osdep_utls_get_thread_calls().
+ *
+ * @x_void_param
+ * @return TLS space, or `NULL` if allocation fails.
+ */
+extern void *osdep_utls_self(void);
+
+/**
+ * @brief Make room for a number of threads in the UTLS container ahead of time.
+ * @details
+ * Growing the container and allocating TLS space normally happens on the first TLS access of each thread while holding
+ * the container lock, which may cause latency spikes on time-sensitive threads. This sizes the container so that
+ * `nthreads` threads fit without growing it, and preallocates the TLS space of the threads that don't have it yet in a
+ * single contiguous pool. The container is not shrunk below the reserved size afterwards.
+ *
+ * @param nthreads Total number of threads expected to use TLS at the same time.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_utls_reserve(size_t nthreads);
+
+/**
+ * @brief Free the TLS space of a thread.
+ * @details
+ * This is called automatically on threads that exit through osdep_thread_exit(). Threads that exit in other ways are
+ * reclaimed by osdep_utls_sweep(), which also runs automatically before the container grows.
+ *
+ * The thread must not access any TLS variable after this, or new TLS space will be allocated for it.
+ *
+ * @param thr Thread pointer.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+extern bool osdep_utls_release(thread_t *thr);
+
+/**
+ * @brief Allocate TLS space that doesn't belong to any thread.
+ * @details The space is initialized the same way as the TLS space of a new thread. Install it on a thread with
+ * osdep_utls_switch(), e.g. to give each coroutine running on the thread its own TLS.
+ *
+ * @x_void_param
+ * @return The TLS space, or `NULL` if allocation fails.
+ */
+extern void *osdep_utls_block_create(void);
+
+/**
+ * @brief Free TLS space allocated by osdep_utls_block_create().
+ * @details The space must not be installed on any thread. Values stored with tsd.h are freed without running their
+ * destructors, so call osdep_tsd_run_destructors() on it first.
+ *
+ * @param block The TLS space.
+ * @x_void_return
+ */
+extern void osdep_utls_block_destroy(void *block);
+
+/**
+ * @brief Change the TLS space __aeabi_read_tp() returns on the current thread.
+ * @details This only replaces the cached pointer, so it is cheap enough to call on every context switch. Unlike the own
+ * TLS space of the thread, the installed space stays cached across osdep_utls_sweep().
+ *
+ * @param thr The current thread.
+ * @param block TLS space from osdep_utls_block_create(), or `NULL` to go back to the own TLS space of the thread.
+ * @x_void_return
+ */
+extern void osdep_utls_switch(thread_t *thr, void *block);
+
+/**
+ * @brief Free the TLS space of all threads that have exited.
+ * @details A thread is considered exited when its descriptor does not look like the one the TLS space was allocated for
+ * anymore, which happens once the kernel frees or reuses it. The container is shrunk afterwards when it's mostly
+ * empty.
+ *
+ * Freeing anything invalidates the cached TLS pointer of every thread, so each live thread takes the locked lookup
+ * path once more on its next TLS access.
+ *
+ * @x_void_param
+ * @return Number of threads whose TLS space was freed.
+ */
+extern size_t osdep_utls_sweep(void);
+
 /**
  * @brief Get statistics of TLS allocation.
  * @param stats The output stats buffer.
  * @x_void_return
  */
 extern void osdep_utls_get_stats(osdep_utls_stats_t *stats);
+
+/**
+ * @brief Reset the counters of osdep_utls_stats_t.
+ * @details Does nothing unless osdep was built with `OSDEP_UTLS_STATS`.
+ *
+ * @x_void_param
+ * @x_void_return
+ */
+extern void osdep_utls_reset_counters(void);
+
+/**
+ * @brief Set the clock used to time first touches and rebuilds.
+ * @details The OS doesn't provide a clock fine enough for this, so timing is off until one is set. Does nothing unless
+ * osdep was built with `OSDEP_UTLS_STATS`.
+ *
+ * @param clock The clock callback, or `NULL` to stop timing.
+ * @x_void_return
+ */
+extern void osdep_utls_set_stats_clock(osdep_utls_clock_t clock);
+
+/**
+ * @brief Get the number of __aeabi_read_tp() calls made by a thread.
+ * @details The count is kept in the TLS space of the thread and starts when the space is allocated.
+ *
+ * @param thr Thread pointer.
+ * @return The number of calls, or 0 if `thr` has no TLS space or osdep was built without `OSDEP_UTLS_STATS`.
+ */
+extern uint32_t osdep_utls_get_thread_calls(const thread_t *thr);
+
+/**
+ * @brief Time the cached __aeabi_read_tp() path against the dict lookups it replaces on the current device.
+ * @details
+ * This takes a while. Use at least 100000 iterations, since times are read from the millisecond clock. The cached and
+ * dict paths include the osdep_thread_get_current() call, so run this on a thread created with osdep_thread_create()
+ * to leave the svc fallback out of them. Other threads can't allocate TLS space while the legacy path is timed.
+ *
+ * @param iterations Number of lookups to time for each path.
+ * @param[out] result The results. All times are 0 if the current thread can't get its TLS space.
+ * @x_void_return
+ */
+extern void osdep_utls_benchmark(size_t iterations, osdep_utls_benchmark_t *result);
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -0,0 +1,284 @@
+#!/usr/bin/env python3
+# Copyright 2025 dogtopus
+# SPDX-License-Identifier: MIT
+
+import argparse
+import bisect
+import csv
+import struct
+import sys
+
+# Session markers written by osdep_heap_trace_start().
+MARKER_V1 = b'HTRC'
+MARKER_V2 = b'HTR2'
+
+# v1 records: raw pointer, size.
+RECORD_V1 = struct.Struct('<II')
+# v2 records: raw pointer, size, sequence number, thread, caller.
+RECORD_V2 = struct.Struct('<IIIII')
+
+DROP_MARKER = 0xffffffff
+
+READ_SIZE = 1 << 16
+
+
+def parse_args():
+    p = argparse.ArgumentParser(description='Analyze heap traces (HEAPT.BIN) produced by the libmuteki-osdep heap tracer.')
+    p.add_argument('trace', help='Path to the trace file.')
+    p.add_argument('-s', '--session', type=int, action='append', help='Only analyze the specified session(s) (0-based). Can be specified multiple times.')
+    p.add_argument('-n', '--top', type=int, default=20, help='Number of leaked pointers and failed allocations to list per session.')
+    p.add_argument('-i', '--sample-interval', type=int, default=1000, help='Estimate fragmentation every N events.')
+    p.add_argument('-f', '--fragmentation-csv', help='Write every fragmentation sample to this CSV file.')
+    return p, p.parse_args()
+
+
+def iter_events(f):
+    """
+    Stream a trace file and yield `('session', version)` when a session marker is found, and
+    `('record', (ptr, size, timestamp, thread, caller))` for each record. v1 records have no timestamp, thread or caller,
+    so those are reported as None.
+    """
+    buf = b''
+    pos = 0
+    record = None
+    eof = False
+
+    while True:
+        need = 4 if record is None else record.size
+        if len(buf) - pos < need:
+            if eof:
+                if len(buf) - pos != 0:
+                    print(f'Warning: {len(buf) - pos} trailing bytes ignored.', file=sys.stderr)
+                return
+            chunk = f.read(READ_SIZE)
+            if not chunk:
+                eof = True
+            buf = buf[pos:] + chunk
+            pos = 0
+            continue
+
+        word = buf[pos:pos + 4]
+        if word == MARKER_V1:
+            record = RECORD_V1
+            pos += 4
+            yield 'session', 1
+            continue
+        if word == MARKER_V2:
+            record = RECORD_V2
+            pos += 4
+            yield 'session', 2
+            continue
+        if record is None:
+            raise ValueError('Trace does not start with a session marker.')
+
+        if record is RECORD_V1:
+            ptr, size = record.unpack_from(buf, pos)
+            yield 'record', (ptr, size, None, None, None)
+        else:
+            yield 'record', record.unpack_from(buf, pos)
+        pos += record.size
+
+
+def size_bucket(size):
+    """Power-of-two bucket (upper bound, inclusive) of an allocation size."""
+    bucket = 8
+    while bucket < size:
+        bucket <<= 1
+    return bucket
+
+
+def format_bytes(n):
+    for unit in ('B', 'KiB', 'MiB'):
+        if n < 1024 or unit == 'MiB':
+            return f'{n} {unit}' if unit == 'B' else f'{n:.1f} {unit}'
+        n /= 1024
+
+
+def format_addr(addr):
+    return '-' if addr is None else f'0x{addr:08x}'
+
+
+class Session:
+    def __init__(self, index, version):
+        self.index = index
+        self.version = version
+        self.events = 0
+        self.allocs = 0
+        self.frees = 0
+        self.failed = []
+        self.failed_count = 0
+        self.unknown_frees = 0
+        self.dropped = 0
+        # ptr -> (size, time, thread, caller)
+        self.live = {}
+        # Sorted raw pointers of live blocks, for fragmentation estimation.
+        self.live_addrs = []
+        self.live_bytes = 0
+        self.peak_bytes = 0
+        self.peak_blocks = 0
+        self.peak_time = 0
+        self.size_histogram = {}
+        self.lifetime_histogram = {}
+        self.samples = []
+
+    def now(self, timestamp):
+        return self.events if timestamp is None else timestamp
+
+    def on_record(self, ptr, size, timestamp, thread, caller, top):
+        if ptr == DROP_MARKER and self.version >= 2:
+            self.dropped += size
+            return
+
+        self.events += 1
+        now = self.now(timestamp)
+
+        if size == 0:
+            info = self.live.pop(ptr, None)
+            if info is None:
+                self.unknown_frees += 1
+                return
+            self.frees += 1
+            self.live_bytes -= info[0]
+            del self.live_addrs[bisect.bisect_left(self.live_addrs, ptr)]
+            lifetime = size_bucket(max(now - info[1], 1))
+            self.lifetime_histogram[lifetime] = self.lifetime_histogram.get(lifetime, 0) + 1
+            return
+
+        if ptr == 0:
+            self.failed_count += 1
+            if len(self.failed) < top:
+                self.failed.append((size, now, thread, caller, self.live_bytes))
+            return
+
+        self.allocs += 1
+        bucket = size_bucket(size)
+        self.size_histogram[bucket] = self.size_histogram.get(bucket, 0) + 1
+
+        old = self.live.get(ptr)
+        if old is not None:
+            # Missed a free (e.g. dropped record). Treat the old block as gone.
+            self.live_bytes -= old[0]
+            del self.live_addrs[bisect.bisect_left(self.live_addrs, ptr)]
+
+        self.live[ptr] = (size, now, thread, caller)
+        bisect.insort(self.live_addrs, ptr)
+        self.live_bytes += size
+        if self.live_bytes > self.peak_bytes:
+            self.peak_bytes = self.live_bytes
+            self.peak_blocks = len(self.live)
+            self.peak_time = now
+
+    def sample_fragmentation(self):
+        """
+        Estimate external fragmentation within the address range currently covered by live blocks. The trace does not
+        know the real heap boundaries, so free space outside of that range is not accounted for.
+        """
+        if len(self.live_addrs) < 2:
+            return
+        largest_gap = 0
+        free_bytes = 0
+        cursor = self.live_addrs[0]
+        for addr in self.live_addrs:
+            if addr > cursor:
+                gap = addr - cursor
+                free_bytes += gap
+                if gap > largest_gap:
+                    largest_gap = gap
+            end = addr + self.live[addr][0]
+            if end > cursor:
+                cursor = end
+        span = cursor - self.live_addrs[0]
+        fragmentation = 0.0 if free_bytes == 0 else 1.0 - largest_gap / free_bytes
+        self.samples.append((self.events, self.live_bytes, span, free_bytes, largest_gap, fragmentation))
+
+    def report(self, top, out):
+        out.write(f'== Session {self.index} (v{self.version}) ==\n')
+        out.write(f'Events: {self.events}, allocations: {self.allocs}, frees: {self.frees}, '
+                  f'failed allocations: {self.failed_count}\n')
+        if self.dropped:
+            out.write(f'Dropped records: {self.dropped} (results below are incomplete)\n')
+        if self.unknown_frees:
+            out.write(f'Frees of unknown pointers: {self.unknown_frees}\n')
+        out.write(f'Peak live: {format_bytes(self.peak_bytes)} in {self.peak_blocks} blocks at t={self.peak_time}\n')
+        out.write(f'Live at end: {format_bytes(self.live_bytes)} in {len(self.live)} blocks\n')
+
+        out.write('\nAllocation sizes (memchunk size incl. overhead):\n')
+        for bucket in sorted(self.size_histogram):
+            out.write(f'  <= {bucket:>10}: {self.size_histogram[bucket]}\n')
+
+        out.write('\nAllocation lifetimes (events):\n')
+        for bucket in sorted(self.lifetime_histogram):
+            out.write(f'  <= {bucket:>10}: {self.lifetime_histogram[bucket]}\n')
+
+        if self.samples:
+            worst = max(self.samples, key=lambda s: s[5])
+            last = self.samples[-1]
+            out.write('\nExternal fragmentation (within the live address range):\n')
+            out.write(f'  Samples: {len(self.samples)}\n')
+            out.write(f'  Worst: {worst[5]:.2%} at event {worst[0]} '
+                      f'(free {format_bytes(worst[3])}, largest hole {format_bytes(worst[4])})\n')
+            out.write(f'  Last: {last[5]:.2%} at event {last[0]} '
+                      f'(free {format_bytes(last[3])}, largest hole {format_bytes(last[4])})\n')
+
+        if self.failed:
+            out.write(f'\nFailed allocations (first {len(self.failed)} of {self.failed_count}):\n')
+            out.write('  size        t           thread      caller      live bytes\n')
+            for size, now, thread, caller, live_bytes in self.failed:
+                out.write(f'  {size:<10}  {now:<10}  {format_addr(thread)}  {format_addr(caller)}  {live_bytes}\n')
+
+        if self.live:
+            leaks = sorted(self.live.items(), key=lambda kv: kv[1][0], reverse=True)[:top]
+            out.write(f'\nLeaked pointers (largest {len(leaks)} of {len(self.live)}):\n')
+            out.write('  ptr         size        t           thread      caller\n')
+            for ptr, (size, now, thread, caller) in leaks:
+                out.write(f'  {format_addr(ptr)}  {size:<10}  {now:<10}  {format_addr(thread)}  {format_addr(caller)}\n')
+
+        out.write('\n')
+
+
+def main():
+    p, args = parse_args()
+
+    if args.sample_interval <= 0:
+        p.error('--sample-interval must be positive.')
+
+    csv_file = None
+    csv_writer = None
+    if args.fragmentation_csv is not None:
+        csv_file = open(args.fragmentation_csv, 'w', newline='')
+        csv_writer = csv.writer(csv_file)
+        csv_writer.writerow(('session', 'event', 'live_bytes', 'span', 'free_bytes', 'largest_hole', 'fragmentation'))
+
+    selected = None if args.session is None else set(args.session)
+    session = None
+    session_count = 0
+
+    def finish(s):
+        if s is None:
+            return
+        s.sample_fragmentation()
+        s.report(args.top, sys.stdout)
+        if csv_writer is not None:
+            for sample in s.samples:
+                csv_writer.writerow((s.index, *sample))
+
+    with open(args.trace, 'rb') as f:
+        for kind, value in iter_events(f):
+            if kind == 'session':
+                finish(session)
+                session = Session(session_count, value) if selected is None or session_count in selected else None
+                session_count += 1
+                continue
+            if session is None:
+                continue
+            session.on_record(*value, args.top)
+            if session.events % args.sample_interval == 0:
+                session.sample_fragmentation()
+        finish(session)
+
+    if csv_file is not None:
+        csv_file.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,165 @@
+#include "osdep/arena.h"
+#include "osdep/heap.h"
+
+typedef struct arena_chunk_s arena_chunk_t;
+
+#define ARENA_DEFAULT_CHUNK_SIZE (4096u)
+#define ARENA_ALIGN_UP(x, a) (((x) + ((a) - 1)) & (~((a) - 1)))
+// Keep the data area of each chunk 8-bytes aligned.
+#define ARENA_CHUNK_HEADER_SIZE ARENA_ALIGN_UP(sizeof(arena_chunk_t), 8u)
+#define ARENA_HEADER_SIZE ARENA_ALIGN_UP(sizeof(osdep_arena_t), 8u)
+
+struct arena_chunk_s {
+    /** Previously current chunk. `NULL` for the first chunk. */
+    arena_chunk_t *prev;
+    /** Size of the data area. */
+    size_t size;
+    /** Number of bytes used in the data area. */
+    size_t used;
+};
+
+struct osdep_arena_s {
+    /** Chunk new allocations are carved from. */
+    arena_chunk_t *current;
+    /** A retired chunk of the default size kept around to avoid an osdep_heap_alloc() call on the next overflow. */
+    arena_chunk_t *spare;
+    /** Default size of the data area of each chunk. */
+    size_t chunk_size;
+};
+
+static inline uintptr_t arena_chunk_data(const arena_chunk_t *chunk) {
+    return ((uintptr_t) chunk) + ARENA_CHUNK_HEADER_SIZE;
+}
+
+static inline arena_chunk_t *arena_first_chunk(const osdep_arena_t *arena) {
+    // The first chunk lives in the same memchunk right after the arena descriptor.
+    return (arena_chunk_t *) (((uintptr_t) arena) + ARENA_HEADER_SIZE);
+}
+
+static void arena_chunk_retire(osdep_arena_t *arena, arena_chunk_t *chunk) {
+    if (arena->spare == NULL && chunk->size == arena->chunk_size) {
+        chunk->used = 0;
+        arena->spare = chunk;
+        return;
+    }
+    osdep_heap_free(chunk);
+}
+
+static void *arena_alloc_slow(osdep_arena_t *arena, size_t size, size_t alignment) {
+    // Data areas are 8-bytes aligned, so only larger alignments need extra room.
+    size_t needed = size + ((alignment > 8) ? (alignment - 8) : 0);
+    if (needed < size) {
+        return NULL;
+    }
+
+    arena_chunk_t *chunk = NULL;
+    if (needed <= arena->chunk_size) {
+        if (arena->spare != NULL) {
+            chunk = arena->spare;
+            arena->spare = NULL;
+        } else {
+            chunk = osdep_heap_alloc(ARENA_CHUNK_HEADER_SIZE + arena->chunk_size);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->size = arena->chunk_size;
+        }
+    } else {
+        if (ARENA_CHUNK_HEADER_SIZE + needed < needed) {
+            return NULL;
+        }
+        chunk = osdep_heap_alloc(ARENA_CHUNK_HEADER_SIZE + needed);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->size = needed;
+    }
+
+    chunk->prev = arena->current;
+    chunk->used = 0;
+    arena->current = chunk;
+
+    uintptr_t base = arena_chunk_data(chunk);
+    uintptr_t p = ARENA_ALIGN_UP(base, (uintptr_t) alignment);
+    chunk->used = (p - base) + size;
+    return (void *) p;
+}
+
+osdep_arena_t *osdep_arena_create(size_t chunk_size) {
+    if (chunk_size == 0) {
+        chunk_size = ARENA_DEFAULT_CHUNK_SIZE;
+    }
+    chunk_size = ARENA_ALIGN_UP(chunk_size, 8u);
+
+    osdep_arena_t *arena = osdep_heap_alloc(ARENA_HEADER_SIZE + ARENA_CHUNK_HEADER_SIZE + chunk_size);
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena_chunk_t *first = arena_first_chunk(arena);
+    first->prev = NULL;
+    first->size = chunk_size;
+    first->used = 0;
+
+    arena->current = first;
+    arena->spare = NULL;
+    arena->chunk_size = chunk_size;
+
+    return arena;
+}
+
+void osdep_arena_destroy(osdep_arena_t *arena) {
+    if (arena == NULL) {
+        return;
+    }
+    osdep_arena_reset(arena);
+    if (arena->spare != NULL) {
+        osdep_heap_free(arena->spare);
+    }
+    osdep_heap_free(arena);
+}
+
+void *osdep_arena_alloc_aligned(osdep_arena_t *arena, size_t size, size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+
+    arena_chunk_t *chunk = arena->current;
+    uintptr_t base = arena_chunk_data(chunk);
+    uintptr_t p = ARENA_ALIGN_UP(base + chunk->used, (uintptr_t) alignment);
+    size_t offset = p - base;
+
+    if (offset <= chunk->size && size <= chunk->size - offset) {
+        chunk->used = offset + size;
+        return (void *) p;
+    }
+
+    return arena_alloc_slow(arena, size, alignment);
+}
+
+__attribute__((assume_aligned(8)))
+void *osdep_arena_alloc(osdep_arena_t *arena, size_t size) {
+    return osdep_arena_alloc_aligned(arena, size, 8);
+}
+
+osdep_arena_mark_t osdep_arena_mark(const osdep_arena_t *arena) {
+    osdep_arena_mark_t mark = { arena->current, arena->current->used };
+    return mark;
+}
+
+void osdep_arena_release(osdep_arena_t *arena, osdep_arena_mark_t mark) {
+    while (arena->current != mark.chunk && arena->current->prev != NULL) {
+        arena_chunk_t *chunk = arena->current;
+        arena->current = chunk->prev;
+        arena_chunk_retire(arena, chunk);
+    }
+
+    if (arena->current == mark.chunk && mark.offset <= arena->current->used) {
+        arena->current->used = mark.offset;
+    }
+}
+
+void osdep_arena_reset(osdep_arena_t *arena) {
+    osdep_arena_mark_t mark = { arena_first_chunk(arena), 0 };
+    osdep_arena_release(arena, mark);
+}
@@ -0,0 +1,262 @@
+#include "osdep/atomic.h"
+#include "osdep/channel.h"
+#include "osdep/heap.h"
+#include "wait.h"
+
+/*
+ * Data lives in [read, write) when write >= read. Once the producer runs out of room at the end of the buffer it
+ * wraps around to 0 and records where the data stops in watermark, after which data lives in [read, watermark) and
+ * [0, write). write never catches up with read from behind, so read == write always means empty.
+ */
+struct osdep_channel_s {
+    uint8_t *buf;
+    size_t size;
+    size_t batch;
+    /** Consumer parks on this. */
+    event_t *data_event;
+    /** Producer parks on this. */
+    event_t *space_event;
+
+    // Written by the producer only.
+    volatile size_t write;
+    volatile size_t watermark;
+    volatile bool closed;
+    size_t reserved_at;
+    size_t reserved;
+    /** Bytes committed since the consumer parked. */
+    size_t pending;
+
+    // Written by the consumer only.
+    volatile size_t read;
+
+    // Set by the side that parks, cleared by whichever side gets to it first.
+    volatile uint32_t consumer_parked;
+    volatile uint32_t producer_parked;
+};
+
+static void channel_wake_consumer(osdep_channel_t *channel, bool force) {
+    if (channel->consumer_parked == 0) {
+        // The consumer is still busy with what it has and will see the new data on its own.
+        channel->pending = 0;
+        return;
+    }
+    if (!force && channel->pending < channel->batch) {
+        return;
+    }
+    channel->pending = 0;
+    if (osdep_atomic_swap(&channel->consumer_parked, 0) != 0) {
+        OSSetEvent(channel->data_event);
+    }
+}
+
+static bool channel_park(volatile uint32_t *parked, event_t *event, unsigned int *timeout) {
+    // Stay parked until the other side swaps the flag and sets the event, or the time is up.
+    wait_result_t wr = WAIT_RESULT_TIMEOUT;
+    while (*timeout != 0) {
+        unsigned int slice = (*timeout < OSDEP_WAIT_MAX) ? *timeout : OSDEP_WAIT_MAX;
+        wr = OSWaitForEvent(event, (short) slice);
+        if (wr != WAIT_RESULT_TIMEOUT) {
+            break;
+        }
+        if (*timeout != OSDEP_CHANNEL_WAIT_FOREVER) {
+            *timeout -= slice;
+        }
+    }
+    // Whoever woke us up already cleared this. If nobody did, don't let them set the event for nothing. If somebody
+    // did right as we gave up, the caller still gets to look one more time.
+    bool woken = (osdep_atomic_swap(parked, 0) == 0);
+    return wr == WAIT_RESULT_RESOLVED || woken;
+}
+
+osdep_channel_t *osdep_channel_create(size_t size, size_t batch) {
+    if (size < 2) {
+        return NULL;
+    }
+
+    osdep_channel_t *channel = osdep_heap_alloc(sizeof(osdep_channel_t));
+    if (channel == NULL) {
+        return NULL;
+    }
+    channel->buf = osdep_heap_alloc(size);
+    channel->data_event = OSCreateEvent(0, 0);
+    channel->space_event = OSCreateEvent(0, 0);
+    channel->size = size;
+    channel->batch = (batch == 0) ? 1 : batch;
+    channel->write = 0;
+    channel->watermark = size;
+    channel->closed = false;
+    channel->reserved_at = 0;
+    channel->reserved = 0;
+    channel->pending = 0;
+    channel->read = 0;
+    channel->consumer_parked = 0;
+    channel->producer_parked = 0;
+
+    if (channel->buf == NULL || channel->data_event == NULL || channel->space_event == NULL) {
+        osdep_channel_destroy(channel);
+        return NULL;
+    }
+    return channel;
+}
+
+void osdep_channel_destroy(osdep_channel_t *channel) {
+    if (channel->data_event != NULL) {
+        OSCloseEvent(channel->data_event);
+    }
+    if (channel->space_event != NULL) {
+        OSCloseEvent(channel->space_event);
+    }
+    osdep_heap_free(channel->buf);
+    osdep_heap_free(channel);
+}
+
+void *osdep_channel_reserve(osdep_channel_t *channel, size_t size) {
+    const size_t w = channel->write;
+    const size_t r = channel->read;
+    size_t at;
+
+    channel->reserved = 0;
+    if (size == 0 || size >= channel->size) {
+        return NULL;
+    }
+
+    if (w >= r) {
+        if (channel->size - w >= size) {
+            at = w;
+        } else if (size < r) {
+            at = 0;
+        } else {
+            return NULL;
+        }
+    } else if (r - w > size) {
+        at = w;
+    } else {
+        return NULL;
+    }
+
+    channel->reserved_at = at;
+    channel->reserved = size;
+    return channel->buf + at;
+}
+
+void *osdep_channel_reserve_wait(osdep_channel_t *channel, size_t size, unsigned int timeout) {
+    if (size > channel->size / 2) {
+        return NULL;
+    }
+
+    for (;;) {
+        void *region = osdep_channel_reserve(channel, size);
+        if (region != NULL) {
+            return region;
+        }
+
+        // The consumer may be holding off for a full batch that won't come while we are stuck.
+        channel_wake_consumer(channel, true);
+        channel->producer_parked = 1;
+        OSDEP_BARRIER();
+        region = osdep_channel_reserve(channel, size);
+        if (region != NULL) {
+            osdep_atomic_swap(&channel->producer_parked, 0);
+            return region;
+        }
+        if (!channel_park(&channel->producer_parked, channel->space_event, &timeout)) {
+            return NULL;
+        }
+    }
+}
+
+void osdep_channel_commit(osdep_channel_t *channel, size_t size) {
+    if (size > channel->reserved) {
+        size = channel->reserved;
+    }
+    channel->reserved = 0;
+    if (size == 0) {
+        return;
+    }
+
+    const size_t at = channel->reserved_at;
+    OSDEP_BARRIER();
+    if (at != channel->write) {
+        // Wrapped around. The consumer must see where the old data stops before it sees the new write position.
+        channel->watermark = channel->write;
+        OSDEP_BARRIER();
+    }
+    channel->write = at + size;
+    OSDEP_BARRIER();
+
+    channel->pending += size;
+    channel_wake_consumer(channel, false);
+}
+
+void osdep_channel_flush(osdep_channel_t *channel) {
+    channel_wake_consumer(channel, true);
+}
+
+void osdep_channel_close(osdep_channel_t *channel) {
+    channel->reserved = 0;
+    channel->closed = true;
+    OSDEP_BARRIER();
+    channel_wake_consumer(channel, true);
+}
+
+const void *osdep_channel_peek(osdep_channel_t *channel, size_t *size) {
+    size_t r = channel->read;
+    const size_t w = channel->write;
+    OSDEP_BARRIER();
+
+    if (r > w) {
+        const size_t watermark = channel->watermark;
+        if (r < watermark) {
+            *size = watermark - r;
+            return channel->buf + r;
+        }
+        // Done with the data before the wrap point.
+        r = 0;
+        channel->read = 0;
+    }
+
+    if (r == w) {
+        *size = 0;
+        return NULL;
+    }
+    *size = w - r;
+    return channel->buf + r;
+}
+
+const void *osdep_channel_peek_wait(osdep_channel_t *channel, size_t *size, unsigned int timeout) {
+    for (;;) {
+        const void *region = osdep_channel_peek(channel, size);
+        if (region != NULL) {
+            return region;
+        }
+        if (channel->closed) {
+            // Anything committed before closing is visible by now.
+            OSDEP_BARRIER();
+            return osdep_channel_peek(channel, size);
+        }
+
+        channel->consumer_parked = 1;
+        OSDEP_BARRIER();
+        region = osdep_channel_peek(channel, size);
+        if (region != NULL || channel->closed) {
+            osdep_atomic_swap(&channel->consumer_parked, 0);
+            continue;
+        }
+        if (!channel_park(&channel->consumer_parked, channel->data_event, &timeout)) {
+            return NULL;
+        }
+    }
+}
+
+void osdep_channel_release(osdep_channel_t *channel, size_t size) {
+    OSDEP_BARRIER();
+    channel->read += size;
+    OSDEP_BARRIER();
+    if (channel->producer_parked != 0 && osdep_atomic_swap(&channel->producer_parked, 0) != 0) {
+        OSSetEvent(channel->space_event);
+    }
+}
+
+bool osdep_channel_is_closed(const osdep_channel_t *channel) {
+    return channel->closed;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file clock.h
+ * @brief Millisecond clock used internally by osdep.
+ * @details GetSysTime() is the only clock with sub-second resolution that is available everywhere. It only goes up to a
+ * day, so elapsed times are only correct for intervals shorter than that.
+ */
+
+#ifndef __OSDEP_CLOCK_H__
+#define __OSDEP_CLOCK_H__
+
+#include <muteki/datetime.h>
+
+/**
+ * @brief Get the number of milliseconds since midnight.
+ *
+ * @x_void_param
+ * @return The current time.
+ */
+static inline unsigned int osdep_clock_ms(void) {
+    datetime_t dt;
+    GetSysTime(&dt);
+    return ((((unsigned int) dt.hour * 60u) + dt.minute) * 60u + dt.second) * 1000u + dt.millis;
+}
+
+/**
+ * @brief Get the number of milliseconds between two readings of osdep_clock_ms().
+ *
+ * @param start The earlier reading.
+ * @param now The later reading. May have wrapped around midnight.
+ * @return The elapsed time.
+ */
+static inline unsigned int osdep_clock_elapsed_ms(unsigned int start, unsigned int now) {
+    const unsigned int ms_per_day = 24u * 60u * 60u * 1000u;
+    return (now >= start) ? (now - start) : (now + ms_per_day - start);
+}
+
+#endif  // __OSDEP_CLOCK_H__
@@ -0,0 +1,147 @@
+#include "osdep/cond.h"
+#include "wait.h"
+
+typedef struct osdep_cond_waiter_s cond_waiter_t;
+
+struct osdep_cond_waiter_s {
+    cond_waiter_t *next;
+    /** Per-wait event. Only set by the thread that dequeued this waiter, while holding osdep_cond_t::lock. */
+    event_t *event;
+    /** Set when dequeued by a signal. Only read or written while holding osdep_cond_t::lock. */
+    bool signaled;
+};
+
+static void cond_enqueue(osdep_cond_t *cond, cond_waiter_t *waiter) {
+    waiter->next = NULL;
+    if (cond->tail == NULL) {
+        cond->head = waiter;
+    } else {
+        cond->tail->next = waiter;
+    }
+    cond->tail = waiter;
+}
+
+static void cond_unlink(osdep_cond_t *cond, cond_waiter_t *waiter) {
+    cond_waiter_t *prev = NULL;
+    for (cond_waiter_t *w = cond->head; w != NULL; prev = w, w = w->next) {
+        if (w != waiter) {
+            continue;
+        }
+        if (prev == NULL) {
+            cond->head = w->next;
+        } else {
+            prev->next = w->next;
+        }
+        if (cond->tail == w) {
+            cond->tail = prev;
+        }
+        return;
+    }
+}
+
+static void cond_wake(cond_waiter_t *waiter) {
+    // The waiter frees the event and its stack frame as soon as it sees this under the lock, which can't happen before
+    // we release the lock.
+    waiter->signaled = true;
+    OSSetEvent(waiter->event);
+}
+
+static wait_result_t cond_wait_common(osdep_cond_t *cond, osdep_mutex_t *mutex, bool timed, unsigned int timeout) {
+    cond_waiter_t waiter = {
+        .next = NULL,
+        .event = OSCreateEvent(0, 0),
+        .signaled = false,
+    };
+    if (waiter.event == NULL) {
+        return WAIT_RESULT_ERROR;
+    }
+
+    // Queue up before releasing the mutex, so a signal sent right after that can't be missed.
+    osdep_mutex_lock(&cond->lock);
+    cond_enqueue(cond, &waiter);
+    osdep_mutex_unlock(&cond->lock);
+    osdep_mutex_unlock(mutex);
+
+    wait_result_t result;
+    for (;;) {
+        unsigned int slice = OSDEP_WAIT_MAX;
+        if (timed && timeout < slice) {
+            slice = timeout;
+        }
+        wait_result_t wr = (slice != 0) ? OSWaitForEvent(waiter.event, (short) slice) : WAIT_RESULT_TIMEOUT;
+        if (timed && wr == WAIT_RESULT_TIMEOUT) {
+            timeout -= slice;
+        }
+
+        osdep_mutex_lock(&cond->lock);
+        if (waiter.signaled) {
+            osdep_mutex_unlock(&cond->lock);
+            result = WAIT_RESULT_RESOLVED;
+            break;
+        }
+        if (wr == WAIT_RESULT_ERROR || (timed && timeout == 0)) {
+            cond_unlink(cond, &waiter);
+            osdep_mutex_unlock(&cond->lock);
+            result = (wr == WAIT_RESULT_ERROR) ? WAIT_RESULT_ERROR : WAIT_RESULT_TIMEOUT;
+            break;
+        }
+        osdep_mutex_unlock(&cond->lock);
+    }
+
+    OSCloseEvent(waiter.event);
+    osdep_mutex_lock(mutex);
+    return result;
+}
+
+void osdep_cond_init(osdep_cond_t *cond) {
+    osdep_mutex_init(&cond->lock, OSDEP_MUTEX_NORMAL);
+    cond->head = NULL;
+    cond->tail = NULL;
+}
+
+void osdep_cond_destroy(osdep_cond_t *cond) {
+    osdep_mutex_destroy(&cond->lock);
+}
+
+bool osdep_cond_wait(osdep_cond_t *cond, osdep_mutex_t *mutex) {
+    return cond_wait_common(cond, mutex, false, 0) == WAIT_RESULT_RESOLVED;
+}
+
+wait_result_t osdep_cond_timedwait(osdep_cond_t *cond, osdep_mutex_t *mutex, unsigned int timeout) {
+    return cond_wait_common(cond, mutex, true, timeout);
+}
+
+void osdep_cond_signal(osdep_cond_t *cond) {
+    // Waiters queue up before releasing the mutex, so this can't miss one that the signaling thread should see.
+    if (cond->head == NULL) {
+        return;
+    }
+
+    osdep_mutex_lock(&cond->lock);
+    cond_waiter_t *waiter = cond->head;
+    if (waiter != NULL) {
+        cond->head = waiter->next;
+        if (cond->head == NULL) {
+            cond->tail = NULL;
+        }
+        cond_wake(waiter);
+    }
+    osdep_mutex_unlock(&cond->lock);
+}
+
+void osdep_cond_broadcast(osdep_cond_t *cond) {
+    if (cond->head == NULL) {
+        return;
+    }
+
+    osdep_mutex_lock(&cond->lock);
+    cond_waiter_t *waiter = cond->head;
+    cond->head = NULL;
+    cond->tail = NULL;
+    while (waiter != NULL) {
+        cond_waiter_t *next = waiter->next;
+        cond_wake(waiter);
+        waiter = next;
+    }
+    osdep_mutex_unlock(&cond->lock);
+}
@@ -0,0 +1,534 @@
+#include "muteki/utils.h"
+#include "osdep/coro.h"
+#include "osdep/heap.h"
+#include "osdep/ktls.h"
+#include "osdep/threading.h"
+#include "osdep/tsd.h"
+#include "osdep/utls.h"
+#include "clock.h"
+
+#define CORO_READY (0u)
+#define CORO_RUNNING (1u)
+#define CORO_WAITING (2u)
+#define CORO_DEAD (3u)
+#define CORO_CANARY (0xc0defaceu)
+// Longest stretch (in OSSleep() units) the thread blocks at once when every coroutine is blocked.
+#define CORO_WAIT_SLICE (1000u)
+// Same as above but when coroutines wait on more than one event, since the thread can only block on one of them.
+#define CORO_POLL_INTERVAL (10u)
+
+/**
+ * Callee-saved registers of a suspended context, in the order coro_switch() stores them: r4-r11, lr, sp.
+ */
+typedef struct coro_context_s {
+    uint32_t regs[10];
+} coro_context_t;
+
+struct osdep_coro_s {
+    /** Must be the first field. */
+    coro_context_t ctx;
+    osdep_coro_sched_t *sched;
+    /** Link in the ready queue, the wait list or the pool. */
+    osdep_coro_t *next;
+    osdep_coro_func_t func;
+    void *user_data;
+    /** UTLS space, if the scheduler uses per-coroutine TLS. */
+    void *tls;
+    /** Bottom word of the stack. */
+    uint32_t *canary;
+    /** Event being waited on, or NULL when sleeping. */
+    event_t *event;
+    /** Clock reading when the wait started. */
+    unsigned int wait_start;
+    unsigned int wait_timeout;
+    wait_result_t wait_result;
+    unsigned char state;
+};
+
+struct osdep_coro_sched_s {
+    /** Context of osdep_coro_sched_run(). */
+    coro_context_t ctx;
+    /** Thread running the scheduler, or NULL when it's not running. */
+    thread_t *thread;
+    /** Stack registry entry covering the running coroutine, or NULL when the registry was full. */
+    osdep_thread_alias_t *alias;
+    osdep_coro_t *current;
+    osdep_coro_t *ready_head;
+    osdep_coro_t *ready_tail;
+    size_t ready_count;
+    /** Coroutines that are sleeping or waiting on an event, in the order they started waiting. */
+    osdep_coro_t *waiting_head;
+    osdep_coro_t *waiting_tail;
+    /** Finished coroutines kept for reuse. */
+    osdep_coro_t *pool;
+    size_t pooled;
+    size_t max_pooled;
+    size_t stack_size;
+    /** Number of coroutines that have not finished. */
+    size_t live;
+    bool per_coro_tls;
+};
+
+// KTLS slot pair holding the scheduler running on each thread.
+static int __coro_ktls_key = -1;
+
+static inline uintptr_t coro_ktls_salt(void) {
+    return (uintptr_t) &__coro_ktls_key;
+}
+
+static int coro_ktls_key(void) {
+    if (__coro_ktls_key < 0) {
+        __coro_ktls_key = osdep_ktls_claim("osdep.coro", 2);
+    }
+    return __coro_ktls_key;
+}
+
+static osdep_coro_sched_t *coro_current_sched(void) {
+    if (__coro_ktls_key < 0) {
+        return NULL;
+    }
+    return osdep_ktls_getvalue_guarded(osdep_thread_get_current(), __coro_ktls_key, coro_ktls_salt());
+}
+
+/**
+ * @brief Save the current context to `from` and continue from `to`.
+ * @details Only the callee-saved registers need to be kept since this is an ordinary function call to the compiler.
+ */
+__attribute__((naked))
+static void coro_switch(__attribute__((unused)) coro_context_t *from,
+                        __attribute__((unused)) const coro_context_t *to) {
+    asm (
+        "stmia r0, {r4-r11, lr}\n\t"
+        "str sp, [r0, #36]\n\t"
+        "ldmia r1, {r4-r11, lr}\n\t"
+        "ldr sp, [r1, #36]\n\t"
+        "bx lr"
+    );
+}
+
+__attribute__((used))
+static void coro_main(osdep_coro_t *co) {
+    co->func(co->user_data);
+    co->state = CORO_DEAD;
+    // The scheduler frees the stack once it's off it. Dead coroutines are never switched back to.
+    coro_switch(&co->ctx, &co->sched->ctx);
+}
+
+/**
+ * @brief First code a coroutine runs. The initial context holds the coroutine in r4.
+ */
+__attribute__((naked))
+static void coro_boot(void) {
+    asm (
+        "mov r0, r4\n\t"
+        "bl coro_main\n\t"
+    );
+}
+
+static void coro_context_init(osdep_coro_t *co, void *stack_top) {
+    uint32_t sb;
+    // Carry over r9 in case the image uses it as the static base.
+    asm ("mov %0, r9" : "=r" (sb));
+    for (size_t i = 0; i < 8; i++) {
+        co->ctx.regs[i] = 0;
+    }
+    co->ctx.regs[0] = (uint32_t) co;
+    co->ctx.regs[5] = sb;
+    co->ctx.regs[8] = (uint32_t) &coro_boot;
+    co->ctx.regs[9] = (uint32_t) stack_top;
+}
+
+static inline size_t coro_header_size(void) {
+    return (sizeof(osdep_coro_t) + 7u) & (~((size_t) 7u));
+}
+
+static void coro_ready_push(osdep_coro_sched_t *sched, osdep_coro_t *co) {
+    co->state = CORO_READY;
+    co->next = NULL;
+    if (sched->ready_tail == NULL) {
+        sched->ready_head = co;
+    } else {
+        sched->ready_tail->next = co;
+    }
+    sched->ready_tail = co;
+    sched->ready_count++;
+}
+
+static osdep_coro_t *coro_ready_pop(osdep_coro_sched_t *sched) {
+    osdep_coro_t *co = sched->ready_head;
+    sched->ready_head = co->next;
+    if (sched->ready_head == NULL) {
+        sched->ready_tail = NULL;
+    }
+    sched->ready_count--;
+    return co;
+}
+
+static void coro_waiting_push(osdep_coro_sched_t *sched, osdep_coro_t *co) {
+    co->next = NULL;
+    if (sched->waiting_tail == NULL) {
+        sched->waiting_head = co;
+    } else {
+        sched->waiting_tail->next = co;
+    }
+    sched->waiting_tail = co;
+}
+
+static void coro_waiting_remove(osdep_coro_sched_t *sched, osdep_coro_t *co) {
+    osdep_coro_t *prev = NULL;
+    for (osdep_coro_t *it = sched->waiting_head; it != co; it = it->next) {
+        prev = it;
+    }
+    if (prev == NULL) {
+        sched->waiting_head = co->next;
+    } else {
+        prev->next = co->next;
+    }
+    if (sched->waiting_tail == co) {
+        sched->waiting_tail = prev;
+    }
+}
+
+static void coro_wake(osdep_coro_sched_t *sched, osdep_coro_t *co, wait_result_t wr) {
+    co->wait_result = wr;
+    co->event = NULL;
+    coro_ready_push(sched, co);
+}
+
+/**
+ * @brief Consume an event if it's set, without blocking.
+ */
+static bool coro_event_try(event_t *event) {
+    // Peeking at the flag keeps the common not-set case free of svcs.
+    if (event->flag == 0) {
+        return false;
+    }
+    // Another thread may have consumed it in the meantime, in which case this times out right away.
+    return OSWaitForEvent(event, 1) == WAIT_RESULT_RESOLVED;
+}
+
+/**
+ * @brief Move waiters that are done waiting to the ready queue.
+ *
+ * @param sched The scheduler.
+ * @param block Block the thread until at least one waiter might be done, if none is done already.
+ */
+static void coro_poll(osdep_coro_sched_t *sched, bool block) {
+    unsigned int now = 0;
+    bool have_now = false;
+    unsigned int next = OSDEP_CORO_WAIT_FOREVER;
+    osdep_coro_t *event_waiter = NULL;
+    size_t event_waiters = 0;
+    osdep_coro_t *prev = NULL;
+    osdep_coro_t *co = sched->waiting_head;
+
+    while (co != NULL) {
+        osdep_coro_t *co_next = co->next;
+        bool done = false;
+        wait_result_t wr = WAIT_RESULT_TIMEOUT;
+
+        if (co->event != NULL && coro_event_try(co->event)) {
+            done = true;
+            wr = WAIT_RESULT_RESOLVED;
+        } else if (co->wait_timeout != OSDEP_CORO_WAIT_FOREVER) {
+            if (!have_now) {
+                now = osdep_clock_ms();
+                have_now = true;
+            }
+            const unsigned int elapsed = osdep_clock_elapsed_ms(co->wait_start, now);
+            if (elapsed >= co->wait_timeout) {
+                done = true;
+            } else if (co->wait_timeout - elapsed < next) {
+                next = co->wait_timeout - elapsed;
+            }
+        }
+
+        if (done) {
+            if (prev == NULL) {
+                sched->waiting_head = co_next;
+            } else {
+                prev->next = co_next;
+            }
+            if (sched->waiting_tail == co) {
+                sched->waiting_tail = prev;
+            }
+            coro_wake(sched, co, wr);
+        } else {
+            if (co->event != NULL && event_waiter == NULL) {
+                event_waiter = co;
+            }
+            event_waiters += (co->event != NULL) ? 1 : 0;
+            prev = co;
+        }
+        co = co_next;
+    }
+
+    if (!block || sched->ready_head != NULL || sched->waiting_head == NULL) {
+        return;
+    }
+
+    // Everything is blocked, so the thread can block too.
+    unsigned int slice = (event_waiters > 1) ? CORO_POLL_INTERVAL : CORO_WAIT_SLICE;
+    if (next < slice) {
+        slice = next;
+    }
+    if (event_waiter == NULL) {
+        OSSleep((short) slice);
+        return;
+    }
+    if (OSWaitForEvent(event_waiter->event, (short) slice) == WAIT_RESULT_RESOLVED) {
+        coro_waiting_remove(sched, event_waiter);
+        coro_wake(sched, event_waiter, WAIT_RESULT_RESOLVED);
+    } else if (event_waiters > 1) {
+        // Block on a different event next time.
+        coro_waiting_remove(sched, event_waiter);
+        coro_waiting_push(sched, event_waiter);
+    }
+}
+
+static void coro_free(osdep_coro_sched_t *sched, osdep_coro_t *co) {
+    if (co->tls != NULL) {
+        osdep_tsd_run_destructors(co->tls);
+        osdep_utls_block_destroy(co->tls);
+        co->tls = NULL;
+    }
+    if (sched->pooled < sched->max_pooled) {
+        co->next = sched->pool;
+        sched->pool = co;
+        sched->pooled++;
+        return;
+    }
+    osdep_heap_free(co);
+}
+
+static void coro_resume(osdep_coro_sched_t *sched, osdep_coro_t *co) {
+    sched->current = co;
+    co->state = CORO_RUNNING;
+    if (sched->per_coro_tls) {
+        osdep_utls_switch(sched->thread, co->tls);
+    }
+    // So that osdep_thread_get_current(), and with it TLS and the scheduler lookup, doesn't need an svc in coroutines.
+    if (sched->alias != NULL) {
+        osdep_thread_alias_move(sched->alias, co->canary, sched->stack_size);
+    }
+    coro_switch(&sched->ctx, &co->ctx);
+    if (sched->per_coro_tls) {
+        osdep_utls_switch(sched->thread, NULL);
+    }
+    sched->current = NULL;
+
+    if (*co->canary != CORO_CANARY) {
+        WriteComDebugMsg("osdep_coro_sched_run: Stack overflow in coroutine %p.", (void *) co);
+    }
+    if (co->state == CORO_DEAD) {
+        if (sched->alias != NULL) {
+            osdep_thread_alias_move(sched->alias, NULL, 0);
+        }
+        sched->live--;
+        coro_free(sched, co);
+    }
+}
+
+/**
+ * @brief Suspend the running coroutine until an event is set or the timeout expires.
+ *
+ * @param co The running coroutine.
+ * @param event The event, or NULL to only wait for the timeout.
+ * @param timeout Timeout in OSSleep() units.
+ * @return The result.
+ */
+static wait_result_t coro_block(osdep_coro_t *co, event_t *event, unsigned int timeout) {
+    osdep_coro_sched_t *sched = co->sched;
+
+    co->event = event;
+    co->wait_timeout = timeout;
+    if (timeout != OSDEP_CORO_WAIT_FOREVER) {
+        co->wait_start = osdep_clock_ms();
+    }
+    co->wait_result = WAIT_RESULT_TIMEOUT;
+    co->state = CORO_WAITING;
+    coro_waiting_push(sched, co);
+    coro_switch(&co->ctx, &sched->ctx);
+    return co->wait_result;
+}
+
+osdep_coro_sched_t *osdep_coro_sched_create(size_t stack_size, size_t max_pooled, bool per_coro_tls) {
+    stack_size = (stack_size + 7u) & (~((size_t) 7u));
+    if (stack_size < 64 || stack_size > SIZE_MAX - coro_header_size()) {
+        return NULL;
+    }
+
+    osdep_coro_sched_t *sched = osdep_heap_alloc(sizeof(osdep_coro_sched_t));
+    if (sched == NULL) {
+        return NULL;
+    }
+    sched->thread = NULL;
+    sched->alias = NULL;
+    sched->current = NULL;
+    sched->ready_head = NULL;
+    sched->ready_tail = NULL;
+    sched->ready_count = 0;
+    sched->waiting_head = NULL;
+    sched->waiting_tail = NULL;
+    sched->pool = NULL;
+    sched->pooled = 0;
+    sched->max_pooled = max_pooled;
+    sched->stack_size = stack_size;
+    sched->live = 0;
+    sched->per_coro_tls = per_coro_tls;
+    return sched;
+}
+
+void osdep_coro_sched_destroy(osdep_coro_sched_t *sched) {
+    osdep_coro_t *lists[] = { sched->ready_head, sched->waiting_head, sched->pool };
+
+    // Unfinished coroutines are dropped along with whatever their stacks still reference.
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        osdep_coro_t *co = lists[i];
+        while (co != NULL) {
+            osdep_coro_t *next = co->next;
+            osdep_tsd_run_destructors(co->tls);
+            osdep_utls_block_destroy(co->tls);
+            osdep_heap_free(co);
+            co = next;
+        }
+    }
+    osdep_heap_free(sched);
+}
+
+osdep_coro_t *osdep_coro_spawn(osdep_coro_sched_t *sched, osdep_coro_func_t func, void *user_data) {
+    if (func == NULL) {
+        return NULL;
+    }
+
+    osdep_coro_t *co = sched->pool;
+    if (co != NULL) {
+        sched->pool = co->next;
+        sched->pooled--;
+    } else {
+        co = osdep_heap_alloc(coro_header_size() + sched->stack_size);
+        if (co == NULL) {
+            return NULL;
+        }
+    }
+
+    co->tls = NULL;
+    if (sched->per_coro_tls) {
+        co->tls = osdep_utls_block_create();
+        if (co->tls == NULL) {
+            coro_free(sched, co);
+            return NULL;
+        }
+    }
+
+    uint8_t *stack_bottom = ((uint8_t *) co) + coro_header_size();
+    co->sched = sched;
+    co->func = func;
+    co->user_data = user_data;
+    co->canary = (uint32_t *) stack_bottom;
+    *co->canary = CORO_CANARY;
+    co->event = NULL;
+    co->wait_start = 0;
+    co->wait_timeout = 0;
+    co->wait_result = WAIT_RESULT_RESOLVED;
+    coro_context_init(co, stack_bottom + sched->stack_size);
+
+    sched->live++;
+    coro_ready_push(sched, co);
+    return co;
+}
+
+bool osdep_coro_sched_run(osdep_coro_sched_t *sched) {
+    const int key = coro_ktls_key();
+    if (key < 0) {
+        WriteComDebugMsg("osdep_coro_sched_run: No KTLS slot available.");
+        return false;
+    }
+
+    thread_t *thr = osdep_thread_get_current();
+    if (sched->thread != NULL || osdep_ktls_getvalue_guarded(thr, key, coro_ktls_salt()) != NULL) {
+        return false;
+    }
+    sched->thread = thr;
+    osdep_ktls_set_guarded(thr, key, sched, coro_ktls_salt());
+    sched->alias = osdep_thread_alias_create(thr);
+    if (sched->alias == NULL) {
+        WriteComDebugMsg("osdep_coro_sched_run: Thread registry is full. Falling back to the slow thread lookup.");
+    }
+
+    while (sched->live != 0) {
+        if (sched->waiting_head != NULL) {
+            coro_poll(sched, sched->ready_head == NULL);
+        }
+        // Only run the coroutines that are ready now. Those that yield go to the back and run in the next round, after
+        // the waiters got polled.
+        for (size_t n = sched->ready_count; n != 0; n--) {
+            coro_resume(sched, coro_ready_pop(sched));
+        }
+    }
+
+    osdep_thread_alias_destroy(sched->alias);
+    sched->alias = NULL;
+    osdep_ktls_set_guarded(thr, key, NULL, coro_ktls_salt());
+    sched->thread = NULL;
+    return true;
+}
+
+osdep_coro_t *osdep_coro_self(void) {
+    osdep_coro_sched_t *sched = coro_current_sched();
+    return (sched != NULL) ? sched->current : NULL;
+}
+
+void osdep_coro_yield(void) {
+    osdep_coro_sched_t *sched = coro_current_sched();
+    if (sched == NULL || sched->current == NULL) {
+        return;
+    }
+    osdep_coro_t *co = sched->current;
+    coro_ready_push(sched, co);
+    coro_switch(&co->ctx, &sched->ctx);
+}
+
+void osdep_coro_sleep(unsigned int millis) {
+    osdep_coro_sched_t *sched = coro_current_sched();
+    if (sched == NULL || sched->current == NULL) {
+        while (millis != 0) {
+            const unsigned int slice = (millis < CORO_WAIT_SLICE) ? millis : CORO_WAIT_SLICE;
+            OSSleep((short) slice);
+            millis -= slice;
+        }
+        return;
+    }
+    if (millis == 0) {
+        osdep_coro_yield();
+        return;
+    }
+    coro_block(sched->current, NULL, millis);
+}
+
+wait_result_t osdep_coro_wait_event(event_t *event, unsigned int timeout) {
+    osdep_coro_sched_t *sched = coro_current_sched();
+    if (sched == NULL || sched->current == NULL) {
+        if (timeout == 0) {
+            return coro_event_try(event) ? WAIT_RESULT_RESOLVED : WAIT_RESULT_TIMEOUT;
+        }
+        for (;;) {
+            const unsigned int slice = (timeout < CORO_WAIT_SLICE) ? timeout : CORO_WAIT_SLICE;
+            wait_result_t wr = OSWaitForEvent(event, (short) slice);
+            if (wr != WAIT_RESULT_TIMEOUT || timeout == slice) {
+                return wr;
+            }
+            if (timeout != OSDEP_CORO_WAIT_FOREVER) {
+                timeout -= slice;
+            }
+        }
+    }
+
+    if (coro_event_try(event)) {
+        return WAIT_RESULT_RESOLVED;
+    }
+    if (timeout == 0) {
+        return WAIT_RESULT_TIMEOUT;
+    }
+    return coro_block(sched->current, event, timeout);
+}
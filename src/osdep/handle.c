@@ -0,0 +1,415 @@
+#include "osdep/handle.h"
+#include "osdep/heap.h"
+#include "osdep/memops.h"
+#include "muteki/threading.h"
+
+typedef struct handle_block_s handle_block_t;
+
+#define HZONE_ALIGN_UP(x) (((x) + 7u) & (~((size_t) 7u)))
+#define HZONE_HEADER_SIZE HZONE_ALIGN_UP(sizeof(osdep_hzone_t))
+
+struct handle_block_s {
+    /** Size of the block including this header. Always a multiple of 8. */
+    size_t size;
+    /** Handle that owns the block, or `NULL` if the block is free. */
+    osdep_handle_t owner;
+};
+
+struct osdep_handle_s {
+    /** Block owned by the handle. `NULL` when the handle is not in use. */
+    handle_block_t *block;
+    /** Next unused handle. */
+    osdep_handle_t next_free;
+    size_t lock_count;
+};
+
+struct osdep_hzone_s {
+    critical_section_t cs;
+    /** First block. */
+    uint8_t *start;
+    /** End of the last block. */
+    uint8_t *end;
+    osdep_handle_t handles;
+    osdep_handle_t free_handles;
+    size_t max_handles;
+    size_t handles_used;
+    size_t free_bytes;
+    size_t compactions;
+    size_t blocks_moved;
+    size_t bytes_moved;
+    size_t last_bytes_moved;
+    size_t failed_allocs;
+};
+
+static inline handle_block_t *hzone_next_block(const handle_block_t *block) {
+    return (handle_block_t *) (((uint8_t *) block) + block->size);
+}
+
+static inline void hzone_make_free(uint8_t *p, size_t size) {
+    handle_block_t *block = (handle_block_t *) p;
+    block->size = size;
+    block->owner = NULL;
+}
+
+/**
+ * @brief Merge the free blocks that directly follow a block into it.
+ *
+ * @param zone The zone descriptor.
+ * @param block The block.
+ * @x_void_return
+ */
+static void hzone_absorb_free(osdep_hzone_t *zone, handle_block_t *block) {
+    handle_block_t *next = hzone_next_block(block);
+    while (((uint8_t *) next) < zone->end && next->owner == NULL) {
+        block->size += next->size;
+        next = hzone_next_block(next);
+    }
+}
+
+/**
+ * @brief Shrink a block to `size` bytes and turn the rest into a free block.
+ *
+ * @param block The block.
+ * @param size New size of the block including the header.
+ * @return Number of bytes given back.
+ */
+static size_t hzone_split(handle_block_t *block, size_t size) {
+    // A free block needs at least room for its header.
+    const size_t rest = block->size - size;
+    if (rest < sizeof(handle_block_t)) {
+        return 0;
+    }
+    block->size = size;
+    hzone_make_free((uint8_t *) hzone_next_block(block), rest);
+    return rest;
+}
+
+static handle_block_t *hzone_find_free(osdep_hzone_t *zone, size_t size) {
+    // First fit. Zones are meant to hold a handful of large blocks so the walk stays short. Adjacent free blocks left
+    // behind by frees are merged on the way.
+    for (uint8_t *p = zone->start; p < zone->end; p += ((handle_block_t *) p)->size) {
+        handle_block_t *block = (handle_block_t *) p;
+        if (block->owner != NULL) {
+            continue;
+        }
+        hzone_absorb_free(zone, block);
+        if (block->size >= size) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static size_t hzone_largest_free_locked(osdep_hzone_t *zone) {
+    size_t largest = 0;
+    for (uint8_t *p = zone->start; p < zone->end; p += ((handle_block_t *) p)->size) {
+        handle_block_t *block = (handle_block_t *) p;
+        if (block->owner == NULL) {
+            hzone_absorb_free(zone, block);
+            if (block->size > largest) {
+                largest = block->size;
+            }
+        }
+    }
+    return (largest > sizeof(handle_block_t)) ? (largest - sizeof(handle_block_t)) : 0;
+}
+
+static void hzone_compact_locked(osdep_hzone_t *zone) {
+    uint8_t *dst = zone->start;
+    uint8_t *p = zone->start;
+    size_t blocks_moved = 0;
+    size_t bytes_moved = 0;
+
+    while (p < zone->end) {
+        handle_block_t *block = (handle_block_t *) p;
+        const size_t size = block->size;
+
+        if (block->owner == NULL) {
+            p += size;
+            continue;
+        }
+
+        if (block->owner->lock_count != 0) {
+            // Pinned. Whatever free space was collected before it stays there as a free block.
+            if (dst != p) {
+                hzone_make_free(dst, p - dst);
+            }
+            p += size;
+            dst = p;
+            continue;
+        }
+
+        if (dst != p) {
+            // Blocks only ever move down, which osdep_memops_copy() handles even when the ranges overlap.
+            osdep_memops_copy(dst, p, size);
+            ((handle_block_t *) dst)->owner->block = (handle_block_t *) dst;
+            blocks_moved++;
+            bytes_moved += size;
+        }
+        dst += size;
+        p += size;
+    }
+
+    if (dst != zone->end) {
+        hzone_make_free(dst, zone->end - dst);
+    }
+
+    zone->compactions++;
+    zone->blocks_moved += blocks_moved;
+    zone->bytes_moved += bytes_moved;
+    zone->last_bytes_moved = bytes_moved;
+}
+
+/**
+ * @brief Find a free block of at least `size` bytes, compacting the zone if that helps.
+ *
+ * @param zone The zone descriptor.
+ * @param size Size of the block including the header.
+ * @return The free block, or `NULL` if there's not enough memory.
+ */
+static handle_block_t *hzone_reserve(osdep_hzone_t *zone, size_t size) {
+    handle_block_t *block = hzone_find_free(zone, size);
+    if (block == NULL && zone->free_bytes >= size) {
+        hzone_compact_locked(zone);
+        block = hzone_find_free(zone, size);
+    }
+    if (block == NULL) {
+        zone->failed_allocs++;
+    }
+    return block;
+}
+
+static inline size_t hzone_block_size(size_t size) {
+    const size_t total = HZONE_ALIGN_UP(size) + sizeof(handle_block_t);
+    return (total < size) ? 0 : total;
+}
+
+osdep_hzone_t *osdep_hzone_create(size_t size, size_t max_handles) {
+    size = HZONE_ALIGN_UP(size);
+    const size_t handles_size = HZONE_ALIGN_UP(sizeof(struct osdep_handle_s) * max_handles);
+
+    if (size < sizeof(handle_block_t) || max_handles == 0) {
+        return NULL;
+    }
+    if (handles_size / max_handles < sizeof(struct osdep_handle_s)) {
+        return NULL;
+    }
+    if (HZONE_HEADER_SIZE + handles_size + size < size) {
+        return NULL;
+    }
+
+    osdep_hzone_t *zone = osdep_heap_alloc(HZONE_HEADER_SIZE + handles_size + size);
+    if (zone == NULL) {
+        return NULL;
+    }
+
+    OSInitCriticalSection(&zone->cs);
+
+    zone->handles = (osdep_handle_t) (((uint8_t *) zone) + HZONE_HEADER_SIZE);
+    zone->max_handles = max_handles;
+    zone->free_handles = NULL;
+    for (size_t i = max_handles; i > 0; i--) {
+        osdep_handle_t handle = &zone->handles[i - 1];
+        handle->block = NULL;
+        handle->lock_count = 0;
+        handle->next_free = zone->free_handles;
+        zone->free_handles = handle;
+    }
+    zone->handles_used = 0;
+
+    zone->start = ((uint8_t *) zone->handles) + handles_size;
+    zone->end = zone->start + size;
+    hzone_make_free(zone->start, size);
+    zone->free_bytes = size;
+
+    zone->compactions = 0;
+    zone->blocks_moved = 0;
+    zone->bytes_moved = 0;
+    zone->last_bytes_moved = 0;
+    zone->failed_allocs = 0;
+
+    return zone;
+}
+
+void osdep_hzone_destroy(osdep_hzone_t *zone) {
+    if (zone == NULL) {
+        return;
+    }
+    OSDeleteCriticalSection(&zone->cs);
+    osdep_heap_free(zone);
+}
+
+size_t osdep_hzone_compact(osdep_hzone_t *zone) {
+    OSEnterCriticalSection(&zone->cs);
+    hzone_compact_locked(zone);
+    size_t largest = hzone_largest_free_locked(zone);
+    OSLeaveCriticalSection(&zone->cs);
+    return largest;
+}
+
+void osdep_hzone_get_stats(osdep_hzone_t *zone, osdep_hzone_stats_t *stats) {
+    OSEnterCriticalSection(&zone->cs);
+
+    stats->size = zone->end - zone->start;
+    stats->free_bytes = zone->free_bytes;
+    stats->largest_free = hzone_largest_free_locked(zone);
+    stats->handles_used = zone->handles_used;
+    stats->handles_locked = 0;
+    for (size_t i = 0; i < zone->max_handles; i++) {
+        if (zone->handles[i].block != NULL && zone->handles[i].lock_count != 0) {
+            stats->handles_locked++;
+        }
+    }
+    stats->compactions = zone->compactions;
+    stats->blocks_moved = zone->blocks_moved;
+    stats->bytes_moved = zone->bytes_moved;
+    stats->last_bytes_moved = zone->last_bytes_moved;
+    stats->failed_allocs = zone->failed_allocs;
+
+    OSLeaveCriticalSection(&zone->cs);
+}
+
+osdep_handle_t osdep_handle_alloc(osdep_hzone_t *zone, size_t size) {
+    const size_t block_size = hzone_block_size(size);
+    if (block_size == 0) {
+        return NULL;
+    }
+
+    OSEnterCriticalSection(&zone->cs);
+
+    osdep_handle_t handle = zone->free_handles;
+    if (handle == NULL) {
+        zone->failed_allocs++;
+        OSLeaveCriticalSection(&zone->cs);
+        return NULL;
+    }
+
+    handle_block_t *block = hzone_reserve(zone, block_size);
+    if (block == NULL) {
+        OSLeaveCriticalSection(&zone->cs);
+        return NULL;
+    }
+
+    zone->free_handles = handle->next_free;
+    zone->handles_used++;
+
+    hzone_split(block, block_size);
+    zone->free_bytes -= block->size;
+    block->owner = handle;
+    handle->block = block;
+    handle->next_free = NULL;
+    handle->lock_count = 0;
+
+    OSLeaveCriticalSection(&zone->cs);
+
+    return handle;
+}
+
+void osdep_handle_free(osdep_hzone_t *zone, osdep_handle_t handle) {
+    if (handle == NULL) {
+        return;
+    }
+
+    OSEnterCriticalSection(&zone->cs);
+
+    handle_block_t *block = handle->block;
+    block->owner = NULL;
+    zone->free_bytes += block->size;
+    // Merging with the previous block would need a walk. That happens lazily on the next allocation instead.
+    hzone_absorb_free(zone, block);
+
+    handle->block = NULL;
+    handle->lock_count = 0;
+    handle->next_free = zone->free_handles;
+    zone->free_handles = handle;
+    zone->handles_used--;
+
+    OSLeaveCriticalSection(&zone->cs);
+}
+
+bool osdep_handle_resize(osdep_hzone_t *zone, osdep_handle_t handle, size_t size) {
+    const size_t block_size = hzone_block_size(size);
+    if (block_size == 0) {
+        return false;
+    }
+
+    OSEnterCriticalSection(&zone->cs);
+
+    handle_block_t *block = handle->block;
+    const size_t old_size = block->size;
+
+    // Try in place first, with whatever free memory directly follows the block.
+    hzone_absorb_free(zone, block);
+    if (block->size >= block_size) {
+        hzone_split(block, block_size);
+        zone->free_bytes -= block->size;
+        zone->free_bytes += old_size;
+        OSLeaveCriticalSection(&zone->cs);
+        return true;
+    }
+    hzone_split(block, old_size);
+
+    if (handle->lock_count != 0) {
+        OSLeaveCriticalSection(&zone->cs);
+        return false;
+    }
+
+    handle_block_t *new_block = hzone_find_free(zone, block_size);
+    if (new_block == NULL && zone->free_bytes >= block_size - old_size) {
+        // Compaction moves the block itself to the low end, so free memory may now follow it.
+        hzone_compact_locked(zone);
+        block = handle->block;
+        hzone_absorb_free(zone, block);
+        if (block->size >= block_size) {
+            hzone_split(block, block_size);
+            zone->free_bytes -= block->size;
+            zone->free_bytes += old_size;
+            OSLeaveCriticalSection(&zone->cs);
+            return true;
+        }
+        hzone_split(block, old_size);
+        new_block = hzone_find_free(zone, block_size);
+    }
+    if (new_block == NULL) {
+        zone->failed_allocs++;
+        OSLeaveCriticalSection(&zone->cs);
+        return false;
+    }
+
+    hzone_split(new_block, block_size);
+    osdep_memops_copy(new_block + 1, block + 1, old_size - sizeof(handle_block_t));
+    new_block->owner = handle;
+    handle->block = new_block;
+    block->owner = NULL;
+    zone->free_bytes -= new_block->size;
+    zone->free_bytes += old_size;
+    hzone_absorb_free(zone, block);
+
+    OSLeaveCriticalSection(&zone->cs);
+
+    return true;
+}
+
+__attribute__((assume_aligned(8)))
+void *osdep_handle_lock(osdep_hzone_t *zone, osdep_handle_t handle) {
+    OSEnterCriticalSection(&zone->cs);
+    handle->lock_count++;
+    void *p = handle->block + 1;
+    OSLeaveCriticalSection(&zone->cs);
+    return p;
+}
+
+void osdep_handle_unlock(osdep_hzone_t *zone, osdep_handle_t handle) {
+    OSEnterCriticalSection(&zone->cs);
+    if (handle->lock_count != 0) {
+        handle->lock_count--;
+    }
+    OSLeaveCriticalSection(&zone->cs);
+}
+
+size_t osdep_handle_get_size(osdep_hzone_t *zone, osdep_handle_t handle) {
+    OSEnterCriticalSection(&zone->cs);
+    size_t size = handle->block->size - sizeof(handle_block_t);
+    OSLeaveCriticalSection(&zone->cs);
+    return size;
+}
@@ -1,19 +1,182 @@
 #include "osdep/heap.h"
 #include "muteki/memory.h"  // for _lfree() and lmalloc()
 #include "muteki/file.h"  // for _afopen() et al
+#include "muteki/threading.h"
+#include "osdep/abi.h"
+#include "osdep/ktls.h"
+#include "osdep/memops.h"
+#include "osdep/mutex.h"
+#include "osdep/threading.h"
+
+#include <stdarg.h>
 
 typedef struct {
     size_t usable_size;
     void *raw_ptr;
 } __mchx_t;
 
+typedef struct slab_chunk_s slab_chunk_t;
+typedef struct slab_class_s slab_class_t;
+typedef struct slab_container_s slab_container_t;
+typedef struct heap_tcache_s heap_tcache_t;
+typedef struct heaptracer_record_s heaptracer_record_t;
+typedef struct heaptracer_container_s heaptracer_container_t;
+typedef struct heap_stats_container_s heap_stats_container_t;
+
+// Size classes are 8, 16, 32, 64, 128 and 256 bytes.
+#define SLAB_MIN_SHIFT (3u)
+#define SLAB_CLASSES (6u)
+#define SLAB_MAX_SIZE (1u << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+#define SLAB_CHUNK_SIZE (4096u)
+#define SLAB_HEADER_MAGIC (0x5ab0c4a7u)
+
+// Maximum number of objects per size class held in a thread cache, and the number of objects moved from the slab
+// allocator to a thread cache at once.
+#define TCACHE_MAX_DEPTH (16u)
+#define TCACHE_REFILL (8u)
+
+// lmalloc() is 4-bytes aligned, so the lowest bit of the raw pointer is free to tag slab objects with.
+#define MCHX_SLAB_TAG ((uintptr_t) 1u)
+
+struct slab_chunk_s {
+    /** Previous chunk in the partial list of the size class. */
+    slab_chunk_t *prev;
+    /** Next chunk in the partial list of the size class. */
+    slab_chunk_t *next;
+    /** Original pointer given by lmalloc(). */
+    void *raw_ptr;
+    /** Singly-linked list of free objects, threaded through the first word of each object. */
+    void *free_list;
+    unsigned short class_index;
+    unsigned short used;
+    unsigned short capacity;
+    bool is_partial;
+};
+
+struct slab_class_s {
+    /** Chunks that have at least one free object. */
+    slab_chunk_t *partial;
+    size_t chunks;
+};
+
+// Number of records in the tracer ring. Must be a power of 2.
+#define HEAPTRACER_RING_SIZE (512u)
+// Interval in milliseconds at which the background thread drains the ring when it's not getting full.
+#define HEAPTRACER_FLUSH_INTERVAL (500)
+#define HEAPTRACER_FLUSHER_STACK_SIZE (0x800u)
+#define HEAPTRACER_HEADER_MAGIC (0x48545232u)
+// Value of heaptracer_record_t::ptr for records that report the number of records dropped since the previous one.
+#define HEAPTRACER_DROP_MARKER (~((uintptr_t) 0u))
+
+struct heaptracer_record_s {
+    /** Raw pointer given by lmalloc(). */
+    uintptr_t ptr;
+    /** Size of the memchunk, 0 when the memchunk was freed, or number of dropped records for drop markers. */
+    size_t size;
+    /** Monotonic sequence number of the event. Dropped events also take a number. */
+    uint32_t timestamp;
+    /** Thread that issued the call. */
+    uintptr_t thread;
+    /** Return address of the osdep heap call. */
+    uintptr_t caller;
+};
+
+struct heaptracer_container_s {
+    unsigned int magic;
+    /** Ring buffer. Non-NULL when the tracer is running. */
+    heaptracer_record_t * volatile ring;
+    /** Number of records ever pushed into the ring. */
+    volatile size_t head;
+    /** Number of records ever drained from the ring. */
+    volatile size_t tail;
+    volatile size_t dropped;
+    uint32_t timestamp;
+    size_t records_written;
+    size_t records_dropped;
+    volatile bool is_stopping;
+    file_descriptor_t *osfh;
+    thread_t *flusher;
+    event_t *flush_event;
+    event_t *flusher_exited;
+    /** Protects the ring indices. */
+    critical_section_t cs;
+    /** Serializes flushes. */
+    critical_section_t flush_cs;
+};
+
+struct heap_tcache_s {
+    /** Free objects of each size class, threaded through their first word. */
+    void *bins[SLAB_CLASSES];
+    unsigned short counts[SLAB_CLASSES];
+};
+
+struct slab_container_s {
+    unsigned int magic;
+    bool is_enabled;
+    bool is_tcache_enabled;
+    osdep_mutex_t lock;
+    slab_class_t classes[SLAB_CLASSES];
+    size_t hits;
+    size_t tcache_hits;
+    size_t misses;
+    size_t objects_used;
+    size_t objects_free;
+};
+
+struct heap_stats_container_s {
+    /** Zero-initialized, which makes it a valid #OSDEP_MUTEX_NORMAL mutex. */
+    osdep_mutex_t lock;
+    size_t live_bytes;
+    size_t live_blocks;
+    size_t peak_live_bytes;
+    size_t total_allocs;
+    size_t total_frees;
+    size_t overhead_bytes;
+    size_t largest_block;
+};
+
+// Default number of lmalloc() attempts made by osdep_heap_probe_largest_block(), and the precision at which the probe
+// stops early.
+#define HEAP_PROBE_DEFAULT_STEPS (16u)
+#define HEAP_PROBE_GRANULARITY (256u)
+
 static const size_t __OVER_ALLOC_SIZE = 4 + sizeof(__mchx_t);
-static const char TRACE_START[4] = {'H', 'T', 'R', 'C'};
-static file_descriptor_t *__heap_tracer_osfh = NULL;
+static const char TRACE_START[4] = {'H', 'T', 'R', '2'};
+static heaptracer_container_t __heaptracer;
+static slab_container_t __slab;
+static heap_stats_container_t __heap_stats;
+
+// Moving a block to shrink it is only worth it when it gives back at least this much memory.
+#define REALLOC_SHRINK_MIN_GAIN (256u)
 
 // So we lose as little performance as possible when heap tracer is turned off.
 #define _unlikely(x) __builtin_expect(!!(x), 0)
 
+/**
+ * @brief Place an mchx header in a memchunk and align the usable memory to an arbitrary power of 2.
+ *
+ * @details
+ * The aligned pointer is the first one that leaves room for the header between it and `q`. Since `q` is at least
+ * 4-bytes aligned, `span` needs to be at least `size + alignment + sizeof(__mchx_t) - 4` for `size` bytes to fit after
+ * the aligned pointer.
+ *
+ * The usable size recorded in the header covers everything from the aligned pointer to the end of the memchunk, so
+ * `(aligned pointer - raw pointer) + usable size` always spans the whole memchunk. This is what lets
+ * osdep_heap_realloc() grow allocations in place.
+ *
+ * @param q Unaligned pointer given by Besta lmalloc().
+ * @param span Size of the memchunk.
+ * @param alignment Alignment of the usable memory. Must be a power of 2 and at least 8.
+ * @return Aligned pointer.
+ */
+static inline void *__mchx_format_aligned(void *q, size_t span, size_t alignment) {
+    uintptr_t pp = (((uintptr_t) q) + sizeof(__mchx_t) + (alignment - 1)) & (~((uintptr_t) (alignment - 1)));
+    __mchx_t *mchx = (__mchx_t *) (pp - sizeof(__mchx_t));
+    mchx->raw_ptr = q;
+    mchx->usable_size = (((uintptr_t) q) + span) - pp;
+    return (void *) pp;
+}
+
 /**
  * @brief A hack that fixes allocator alignment by adding an extra header to allocated memchunk.
  *
@@ -23,16 +186,12 @@ static file_descriptor_t *__heap_tracer_osfh = NULL;
  * that there are at least 8 bytes available for us to store the original pointer and the allocation size so we don't
  * have to resort to using the memchunk header to determine whether we're at the original pointer or not.
  *
- * @param q Unaligned pointer given by Besta lmalloc().
- * @param size Usable size of the allocation.
+ * @param q Unaligned pointer given by Besta lmalloc() for `size + __OVER_ALLOC_SIZE` bytes.
+ * @param size Requested size of the allocation.
  * @return Pointer that aligns to 8-bytes.
  */
 static inline void *__mchx_format(void *q, size_t size) {
-    uintptr_t pp = ((((uintptr_t) q) + __OVER_ALLOC_SIZE) & (~((uintptr_t) 7u)));
-    __mchx_t *mchx = (__mchx_t *) (pp - sizeof(__mchx_t));
-    mchx->raw_ptr = q;
-    mchx->usable_size = size;
-    return (void *) pp;
+    return __mchx_format_aligned(q, size + __OVER_ALLOC_SIZE, 8);
 }
 
 /**
@@ -59,37 +218,527 @@ static inline void *__mchx_get_raw(void *p) {
     return mchx->raw_ptr;
 }
 
-static void _heaptracer_on_malloc(void *p, size_t size) {
-    uintptr_t r = (uintptr_t) p;
-    size_t s = size;
-    if (_unlikely(__heap_tracer_osfh != NULL)) {
-        _fwrite(&r, 1, sizeof(r), __heap_tracer_osfh);
-        _fwrite(&s, 1, sizeof(s), __heap_tracer_osfh);
-        __fflush(__heap_tracer_osfh);
+static void _heaptracer_push(uintptr_t ptr, size_t size, void *caller) {
+    thread_t *thr = osdep_thread_get_current();
+
+    OSEnterCriticalSection(&__heaptracer.cs);
+
+    heaptracer_record_t *ring = __heaptracer.ring;
+    if (ring == NULL) {
+        OSLeaveCriticalSection(&__heaptracer.cs);
+        return;
+    }
+
+    const size_t pending = __heaptracer.head - __heaptracer.tail;
+    const uint32_t timestamp = __heaptracer.timestamp++;
+
+    if (pending >= HEAPTRACER_RING_SIZE) {
+        // Never stall the allocator on I/O. Just count what we lost and report it on the next flush.
+        __heaptracer.dropped++;
+        OSLeaveCriticalSection(&__heaptracer.cs);
+        return;
+    }
+
+    heaptracer_record_t *record = &ring[__heaptracer.head & (HEAPTRACER_RING_SIZE - 1)];
+    record->ptr = ptr;
+    record->size = size;
+    record->timestamp = timestamp;
+    record->thread = (uintptr_t) thr;
+    record->caller = (uintptr_t) caller;
+    __heaptracer.head++;
+
+    // Wake up the flusher once when the ring becomes half full.
+    if (pending + 1 == HEAPTRACER_RING_SIZE / 2) {
+        OSSetEvent(__heaptracer.flush_event);
+    }
+
+    OSLeaveCriticalSection(&__heaptracer.cs);
+}
+
+static inline void _heaptracer_on_malloc(void *p, size_t size, void *caller) {
+    if (_unlikely(__heaptracer.ring != NULL)) {
+        _heaptracer_push((uintptr_t) p, size, caller);
+    }
+}
+
+static inline void _heaptracer_on_free(void *p, void *caller) {
+    if (_unlikely(__heaptracer.ring != NULL)) {
+        _heaptracer_push((uintptr_t) p, 0, caller);
+    }
+}
+
+static int heaptracer_flusher_main(void) {
+    while (!__heaptracer.is_stopping) {
+        OSWaitForEvent(__heaptracer.flush_event, HEAPTRACER_FLUSH_INTERVAL);
+        osdep_heap_trace_flush();
+    }
+    OSSetEvent(__heaptracer.flusher_exited);
+    return 0;
+}
+
+APCS_WRAPPER_STATIC(heaptracer_flusher_entry, args, int, void *user_data) {
+    (void) va_arg(args, void *);
+    return heaptracer_flusher_main();
+}
+
+static inline void heap_stats_lock(void) {
+    osdep_mutex_lock(&__heap_stats.lock);
+}
+
+static inline void heap_stats_unlock(void) {
+    osdep_mutex_unlock(&__heap_stats.lock);
+}
+
+/**
+ * @brief Get the number of bytes taken by the mchx header and alignment padding of an allocation.
+ *
+ * @param p Pointer produced by osdep_heap_alloc().
+ * @return The overhead in bytes.
+ */
+static inline size_t heap_block_overhead(void *p) {
+    uintptr_t q = (uintptr_t) __mchx_get_raw(p);
+    if (q & MCHX_SLAB_TAG) {
+        return sizeof(__mchx_t);
+    }
+    return ((uintptr_t) p) - q;
+}
+
+static void heap_stats_on_alloc(void *p) {
+    const size_t size = __mchx_get_size(p);
+    const size_t overhead = heap_block_overhead(p);
+
+    heap_stats_lock();
+    __heap_stats.live_bytes += size;
+    __heap_stats.live_blocks++;
+    __heap_stats.total_allocs++;
+    __heap_stats.overhead_bytes += overhead;
+    if (__heap_stats.live_bytes > __heap_stats.peak_live_bytes) {
+        __heap_stats.peak_live_bytes = __heap_stats.live_bytes;
+    }
+    heap_stats_unlock();
+}
+
+static void heap_stats_on_free(void *p) {
+    const size_t size = __mchx_get_size(p);
+    const size_t overhead = heap_block_overhead(p);
+
+    heap_stats_lock();
+    __heap_stats.live_bytes -= size;
+    __heap_stats.live_blocks--;
+    __heap_stats.total_frees++;
+    __heap_stats.overhead_bytes -= overhead;
+    heap_stats_unlock();
+}
+
+static inline size_t slab_class_index(size_t size) {
+    size_t index = 0;
+    size_t class_size = 1u << SLAB_MIN_SHIFT;
+    while (class_size < size) {
+        class_size <<= 1;
+        index++;
+    }
+    return index;
+}
+
+static inline size_t slab_class_size(size_t index) {
+    return 1u << (SLAB_MIN_SHIFT + index);
+}
+
+static inline size_t slab_class_stride(size_t index) {
+    // Each object carries its own mchx header so osdep_heap_free() can find the owning chunk.
+    return slab_class_size(index) + sizeof(__mchx_t);
+}
+
+static void slab_partial_push(slab_class_t *cls, slab_chunk_t *chunk) {
+    chunk->prev = NULL;
+    chunk->next = cls->partial;
+    if (cls->partial != NULL) {
+        cls->partial->prev = chunk;
+    }
+    cls->partial = chunk;
+    chunk->is_partial = true;
+}
+
+static void slab_partial_remove(slab_class_t *cls, slab_chunk_t *chunk) {
+    if (chunk->prev != NULL) {
+        chunk->prev->next = chunk->next;
+    } else {
+        cls->partial = chunk->next;
+    }
+    if (chunk->next != NULL) {
+        chunk->next->prev = chunk->prev;
+    }
+    chunk->prev = NULL;
+    chunk->next = NULL;
+    chunk->is_partial = false;
+}
+
+static slab_chunk_t *slab_chunk_new(size_t index, void *caller) {
+    void *q = lmalloc(SLAB_CHUNK_SIZE);
+
+    _heaptracer_on_malloc(q, SLAB_CHUNK_SIZE, caller);
+
+    if (q == NULL) {
+        return NULL;
+    }
+
+    const uintptr_t chunk_end = ((uintptr_t) q) + SLAB_CHUNK_SIZE;
+    const size_t stride = slab_class_stride(index);
+    slab_chunk_t *chunk = (slab_chunk_t *) ((((uintptr_t) q) + 7u) & (~((uintptr_t) 7u)));
+    uintptr_t obj = (((uintptr_t) (chunk + 1)) + 7u) & (~((uintptr_t) 7u));
+
+    chunk->prev = NULL;
+    chunk->next = NULL;
+    chunk->raw_ptr = q;
+    chunk->free_list = NULL;
+    chunk->class_index = index;
+    chunk->used = 0;
+    chunk->capacity = 0;
+    chunk->is_partial = false;
+
+    // Format every object up front so allocation is just a list pop.
+    void **tail = &chunk->free_list;
+    for (; obj + stride <= chunk_end; obj += stride) {
+        __mchx_t *mchx = (__mchx_t *) obj;
+        void *p = (void *) (obj + sizeof(__mchx_t));
+        mchx->usable_size = slab_class_size(index);
+        mchx->raw_ptr = (void *) (((uintptr_t) chunk) | MCHX_SLAB_TAG);
+        *tail = p;
+        tail = (void **) p;
+        chunk->capacity++;
+    }
+    *tail = NULL;
+
+    return chunk;
+}
+
+static void slab_chunk_delete(slab_chunk_t *chunk, void *caller) {
+    void *q = chunk->raw_ptr;
+
+    _heaptracer_on_free(q, caller);
+    _lfree(q);
+}
+
+static void *slab_pop_locked(size_t index, void *caller) {
+    slab_class_t *cls = &__slab.classes[index];
+
+    slab_chunk_t *chunk = cls->partial;
+    if (chunk == NULL) {
+        chunk = slab_chunk_new(index, caller);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        slab_partial_push(cls, chunk);
+        cls->chunks++;
+        __slab.objects_free += chunk->capacity;
+    }
+
+    void *p = chunk->free_list;
+    chunk->free_list = *((void **) p);
+    chunk->used++;
+    if (chunk->free_list == NULL) {
+        slab_partial_remove(cls, chunk);
     }
+
+    __slab.objects_used++;
+    __slab.objects_free--;
+
+    return p;
 }
 
-static void _heaptracer_on_free(void *p) {
-    uintptr_t r = (uintptr_t) p;
-    size_t s = 0;
-    if (_unlikely(__heap_tracer_osfh != NULL)) {
-        _fwrite(&r, 1, sizeof(r), __heap_tracer_osfh);
-        _fwrite(&s, 1, sizeof(s), __heap_tracer_osfh);
-        __fflush(__heap_tracer_osfh);
+static void slab_push_locked(slab_chunk_t *chunk, void *p, void *caller) {
+    slab_class_t *cls = &__slab.classes[chunk->class_index];
+
+    *((void **) p) = chunk->free_list;
+    chunk->free_list = p;
+    chunk->used--;
+    __slab.objects_used--;
+    __slab.objects_free++;
+
+    if (!chunk->is_partial) {
+        slab_partial_push(cls, chunk);
+    }
+
+    // Keep one empty chunk around per size class so alloc/free pairs on a class boundary don't thrash lmalloc().
+    // Everything is released once the slab allocator is disabled.
+    if (chunk->used == 0 && (!__slab.is_enabled || cls->partial != chunk || chunk->next != NULL)) {
+        slab_partial_remove(cls, chunk);
+        cls->chunks--;
+        __slab.objects_free -= chunk->capacity;
+        slab_chunk_delete(chunk, caller);
+    }
+}
+
+static inline slab_chunk_t *slab_owner(const void *p) {
+    return (slab_chunk_t *) (((uintptr_t) __mchx_get_raw((void *) p)) & (~MCHX_SLAB_TAG));
+}
+
+static void *slab_alloc(size_t size, void *caller) {
+    osdep_mutex_lock(&__slab.lock);
+
+    void *p = slab_pop_locked(slab_class_index(size), caller);
+    if (p != NULL) {
+        __slab.hits++;
+    } else {
+        __slab.misses++;
+    }
+
+    osdep_mutex_unlock(&__slab.lock);
+
+    return p;
+}
+
+static void slab_free(slab_chunk_t *chunk, void *p, void *caller) {
+    osdep_mutex_lock(&__slab.lock);
+    slab_push_locked(chunk, p, caller);
+    osdep_mutex_unlock(&__slab.lock);
+}
+
+static heap_tcache_t *tcache_get(thread_t *thr) {
+    return osdep_ktls_getvalue_guarded(thr, OSDEP_KTLS_KEY_HEAP_TCACHE, (uintptr_t) &__slab);
+}
+
+static heap_tcache_t *tcache_get_or_create(thread_t *thr) {
+    heap_tcache_t *tc = tcache_get(thr);
+    if (tc != NULL) {
+        return tc;
+    }
+
+    // This must not go through osdep_heap_alloc() or we would end up here again.
+    void *q = lmalloc(sizeof(heap_tcache_t) + __OVER_ALLOC_SIZE);
+
+    _heaptracer_on_malloc(q, sizeof(heap_tcache_t) + __OVER_ALLOC_SIZE, __builtin_return_address(0));
+
+    if (q == NULL) {
+        return NULL;
+    }
+
+    tc = __mchx_format(q, sizeof(heap_tcache_t));
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        tc->bins[i] = NULL;
+        tc->counts[i] = 0;
+    }
+    osdep_ktls_set_guarded(thr, OSDEP_KTLS_KEY_HEAP_TCACHE, tc, (uintptr_t) &__slab);
+    return tc;
+}
+
+/**
+ * @brief Return objects from a thread cache bin to the slab allocator.
+ *
+ * @param tc The thread cache.
+ * @param index Size class index.
+ * @param keep Number of objects to keep in the bin.
+ * @param caller Caller address for the heap tracer.
+ * @x_void_return
+ */
+static void tcache_flush_bin(heap_tcache_t *tc, size_t index, size_t keep, void *caller) {
+    if (tc->counts[index] <= keep) {
+        return;
+    }
+
+    osdep_mutex_lock(&__slab.lock);
+    while (tc->counts[index] > keep) {
+        void *p = tc->bins[index];
+        tc->bins[index] = *((void **) p);
+        tc->counts[index]--;
+        slab_push_locked(slab_owner(p), p, caller);
+    }
+    osdep_mutex_unlock(&__slab.lock);
+}
+
+static void tcache_flush_all(heap_tcache_t *tc, void *caller) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        tcache_flush_bin(tc, i, 0, caller);
+    }
+}
+
+static void *tcache_alloc(size_t size, void *caller) {
+    heap_tcache_t *tc = tcache_get_or_create(osdep_thread_get_current());
+    if (tc == NULL) {
+        return slab_alloc(size, caller);
+    }
+
+    const size_t index = slab_class_index(size);
+
+    if (tc->counts[index] == 0) {
+        // Refill a batch at once so the lock is taken once every few allocations.
+        osdep_mutex_lock(&__slab.lock);
+        while (tc->counts[index] < TCACHE_REFILL) {
+            void *p = slab_pop_locked(index, caller);
+            if (p == NULL) {
+                break;
+            }
+            *((void **) p) = tc->bins[index];
+            tc->bins[index] = p;
+            tc->counts[index]++;
+        }
+        if (tc->counts[index] == 0) {
+            __slab.misses++;
+            osdep_mutex_unlock(&__slab.lock);
+            return NULL;
+        }
+        osdep_mutex_unlock(&__slab.lock);
+    }
+
+    void *p = tc->bins[index];
+    tc->bins[index] = *((void **) p);
+    tc->counts[index]--;
+
+    // Not locked since this is only for statistics.
+    __slab.hits++;
+    __slab.tcache_hits++;
+
+    return p;
+}
+
+static void tcache_free(slab_chunk_t *chunk, void *p, void *caller) {
+    // The object may have been allocated on any thread. Slab objects are not owned by a thread, so it simply goes to
+    // the cache of whichever thread frees it.
+    heap_tcache_t *tc = tcache_get_or_create(osdep_thread_get_current());
+    if (tc == NULL) {
+        slab_free(chunk, p, caller);
+        return;
+    }
+
+    const size_t index = chunk->class_index;
+    if (tc->counts[index] >= TCACHE_MAX_DEPTH) {
+        tcache_flush_bin(tc, index, TCACHE_MAX_DEPTH / 2, caller);
+    }
+
+    *((void **) p) = tc->bins[index];
+    tc->bins[index] = p;
+    tc->counts[index]++;
+}
+
+static void tcache_on_thread_exit(thread_t *thr) {
+    heap_tcache_t *tc = tcache_get(thr);
+    if (tc == NULL) {
+        return;
+    }
+
+    tcache_flush_all(tc, __builtin_return_address(0));
+    osdep_ktls_set_guarded(thr, OSDEP_KTLS_KEY_HEAP_TCACHE, NULL, (uintptr_t) &__slab);
+
+    // Allocated with lmalloc() directly, so it's not in the heap statistics either.
+    void *q = __mchx_get_raw(tc);
+    _heaptracer_on_free(q, __builtin_return_address(0));
+    _lfree(q);
+}
+
+static void slab_release_empty_chunks(void *caller) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        slab_class_t *cls = &__slab.classes[i];
+        slab_chunk_t *chunk = cls->partial;
+        while (chunk != NULL) {
+            slab_chunk_t *next = chunk->next;
+            if (chunk->used == 0) {
+                slab_partial_remove(cls, chunk);
+                cls->chunks--;
+                __slab.objects_free -= chunk->capacity;
+                slab_chunk_delete(chunk, caller);
+            }
+            chunk = next;
+        }
     }
 }
 
 __attribute__((assume_aligned(8)))
 void *osdep_heap_alloc(size_t size) {
+    if (__slab.is_enabled) {
+        if (size <= SLAB_MAX_SIZE) {
+            void *p = __slab.is_tcache_enabled ?
+                tcache_alloc(size, __builtin_return_address(0)) :
+                slab_alloc(size, __builtin_return_address(0));
+            if (p != NULL) {
+                heap_stats_on_alloc(p);
+                return p;
+            }
+        } else {
+            // Not locked since this is only for statistics.
+            __slab.misses++;
+        }
+    }
+
+    if (size > SIZE_MAX - __OVER_ALLOC_SIZE) {
+        return NULL;
+    }
+
     void *q = lmalloc(size + __OVER_ALLOC_SIZE);
 
-    _heaptracer_on_malloc(q, size + __OVER_ALLOC_SIZE);
+    _heaptracer_on_malloc(q, size + __OVER_ALLOC_SIZE, __builtin_return_address(0));
+
+    if (q == NULL) {
+        return NULL;
+    }
+
+    void *p = __mchx_format(q, size);
+    heap_stats_on_alloc(p);
+    return p;
+}
+
+void *osdep_heap_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+
+    if (alignment <= 8) {
+        return osdep_heap_alloc(size);
+    }
+
+    // A single over-allocation covers both the header and the alignment padding. The header only needs its own room
+    // when the padding before the aligned pointer happens to be shorter than it.
+    const size_t span = size + alignment + sizeof(__mchx_t) - 4;
+    if (span < size) {
+        return NULL;
+    }
+
+    void *q = lmalloc(span);
+
+    _heaptracer_on_malloc(q, span, __builtin_return_address(0));
 
     if (q == NULL) {
         return NULL;
     }
 
-    return __mchx_format(q, size);
+    void *p = __mchx_format_aligned(q, span, alignment);
+    heap_stats_on_alloc(p);
+    return p;
+}
+
+void *osdep_heap_aligned_alloc(size_t alignment, size_t size) {
+    return osdep_heap_memalign(alignment, size);
+}
+
+void *osdep_heap_calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    size *= nmemb;
+
+    if (__slab.is_enabled && size <= SLAB_MAX_SIZE) {
+        // Recycled slab objects are dirty. They are small enough that clearing them here is cheap.
+        void *p = osdep_heap_alloc(size);
+        if (p != NULL) {
+            osdep_memops_zero(p, size);
+        }
+        return p;
+    }
+
+    if (size + __OVER_ALLOC_SIZE < size) {
+        return NULL;
+    }
+
+    void *q = lcalloc(1, size + __OVER_ALLOC_SIZE);
+
+    _heaptracer_on_malloc(q, size + __OVER_ALLOC_SIZE, __builtin_return_address(0));
+
+    if (q == NULL) {
+        return NULL;
+    }
+
+    void *p = __mchx_format(q, size);
+    heap_stats_on_alloc(p);
+    return p;
 }
 
 size_t osdep_heap_get_alloc_size(const void *ptr) {
@@ -101,35 +750,376 @@ void osdep_heap_free(void *ptr) {
         return;
     }
 
+    heap_stats_on_free(ptr);
+
     void *q = __mchx_get_raw(ptr);
 
-    _heaptracer_on_free(q);
+    if (((uintptr_t) q) & MCHX_SLAB_TAG) {
+        slab_chunk_t *chunk = (slab_chunk_t *) (((uintptr_t) q) & (~MCHX_SLAB_TAG));
+        // The cache is only drained by allocations while the slab allocator is enabled, so don't fill it otherwise.
+        if (__slab.is_enabled && __slab.is_tcache_enabled) {
+            tcache_free(chunk, ptr, __builtin_return_address(0));
+        } else {
+            slab_free(chunk, ptr, __builtin_return_address(0));
+        }
+        return;
+    }
+
+    _heaptracer_on_free(q, __builtin_return_address(0));
     _lfree(q);
 }
 
+void *osdep_heap_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return osdep_heap_alloc(size);
+    }
+
+    if (size == 0) {
+        osdep_heap_free(ptr);
+        return NULL;
+    }
+
+    const size_t capacity = __mchx_get_size(ptr);
+    const bool is_slab = (((uintptr_t) __mchx_get_raw(ptr)) & MCHX_SLAB_TAG) != 0;
+
+    if (size <= capacity) {
+        // The size of the memchunk stays the same either way, so there's nothing to update in the header. Only move
+        // large blocks that shrink a lot, since that's the only way to hand the unused part back to the OS.
+        if (is_slab || size >= (capacity >> 1) || capacity - size < REALLOC_SHRINK_MIN_GAIN) {
+            return ptr;
+        }
+    } else {
+        // Leave some headroom on growth so the next few small extensions (e.g. appending to a string builder) happen
+        // in place.
+        size_t headroom = size >> 3;
+        if (size + headroom > size) {
+            size += headroom;
+        }
+    }
+
+    void *new_ptr = osdep_heap_alloc(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+
+    osdep_memops_copy(new_ptr, ptr, (size < capacity) ? size : capacity);
+    osdep_heap_free(ptr);
+
+    return new_ptr;
+}
+
+void osdep_heap_slab_enable(bool enable) {
+    if (__slab.magic != SLAB_HEADER_MAGIC) {
+        if (!enable) {
+            return;
+        }
+        osdep_mutex_init(&__slab.lock, OSDEP_MUTEX_NORMAL);
+        __slab.magic = SLAB_HEADER_MAGIC;
+    }
+
+    osdep_mutex_lock(&__slab.lock);
+    __slab.is_enabled = enable;
+    if (!enable) {
+        slab_release_empty_chunks(__builtin_return_address(0));
+    }
+    osdep_mutex_unlock(&__slab.lock);
+}
+
+void osdep_heap_tcache_enable(bool enable) {
+    if (enable) {
+        if (!osdep_thread_add_exit_hook(&tcache_on_thread_exit)) {
+            return;
+        }
+        __slab.is_tcache_enabled = true;
+        return;
+    }
+
+    // Caches of other threads are used without holding any lock, so they can only be flushed by their own threads.
+    __slab.is_tcache_enabled = false;
+    osdep_heap_tcache_flush_self();
+}
+
+void osdep_heap_tcache_flush_self(void) {
+    thread_t *thr = osdep_thread_get_current();
+    heap_tcache_t *tc = tcache_get(thr);
+    if (tc == NULL) {
+        return;
+    }
+    tcache_flush_all(tc, __builtin_return_address(0));
+}
+
+void osdep_heap_slab_get_stats(osdep_heap_slab_stats_t *stats) {
+    if (__slab.magic != SLAB_HEADER_MAGIC) {
+        stats->is_enabled = false;
+        stats->hits = 0;
+        stats->tcache_hits = 0;
+        stats->misses = 0;
+        stats->chunks = 0;
+        stats->objects_used = 0;
+        stats->objects_free = 0;
+        return;
+    }
+
+    osdep_mutex_lock(&__slab.lock);
+
+    stats->is_enabled = __slab.is_enabled;
+    stats->hits = __slab.hits;
+    stats->tcache_hits = __slab.tcache_hits;
+    stats->misses = __slab.misses;
+    stats->chunks = 0;
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        stats->chunks += __slab.classes[i].chunks;
+    }
+    stats->objects_used = __slab.objects_used;
+    stats->objects_free = __slab.objects_free;
+
+    osdep_mutex_unlock(&__slab.lock);
+}
+
+void osdep_heap_get_stats(osdep_heap_stats_t *stats) {
+    // Query this before taking the lock since it's a syscall.
+    const size_t free_bytes = GetFreeMemory();
+
+    heap_stats_lock();
+    stats->live_bytes = __heap_stats.live_bytes;
+    stats->live_blocks = __heap_stats.live_blocks;
+    stats->peak_live_bytes = __heap_stats.peak_live_bytes;
+    stats->total_allocs = __heap_stats.total_allocs;
+    stats->total_frees = __heap_stats.total_frees;
+    stats->overhead_bytes = __heap_stats.overhead_bytes;
+    stats->largest_block = __heap_stats.largest_block;
+    heap_stats_unlock();
+
+    stats->free_bytes = free_bytes;
+}
+
+void osdep_heap_reset_peak(void) {
+    heap_stats_lock();
+    __heap_stats.peak_live_bytes = __heap_stats.live_bytes;
+    heap_stats_unlock();
+}
+
+size_t osdep_heap_probe_largest_block(unsigned int max_steps) {
+    if (max_steps == 0) {
+        max_steps = HEAP_PROBE_DEFAULT_STEPS;
+    }
+
+    // good is known to be allocatable and bad is known not to be. Nothing larger than the free memory can be
+    // allocatable.
+    size_t good = 0;
+    size_t bad = GetFreeMemory() + 1;
+
+    for (unsigned int i = 0; i < max_steps && bad - good > HEAP_PROBE_GRANULARITY; i++) {
+        const size_t mid = (good + ((bad - good) >> 1)) & (~((size_t) 3u));
+        // Probes are not traced since they are not real allocations.
+        void *q = lmalloc(mid);
+        if (q != NULL) {
+            _lfree(q);
+            good = mid;
+        } else {
+            bad = mid;
+        }
+    }
+
+    const size_t largest = (good > __OVER_ALLOC_SIZE) ? (good - __OVER_ALLOC_SIZE) : 0;
+
+    heap_stats_lock();
+    __heap_stats.largest_block = largest;
+    heap_stats_unlock();
+
+    return largest;
+}
+
 bool osdep_heap_trace_start(void) {
-    if (__heap_tracer_osfh != NULL) {
+    if (__heaptracer.magic != HEAPTRACER_HEADER_MAGIC) {
+        OSInitCriticalSection(&__heaptracer.cs);
+        OSInitCriticalSection(&__heaptracer.flush_cs);
+        __heaptracer.magic = HEAPTRACER_HEADER_MAGIC;
+    }
+
+    if (__heaptracer.osfh != NULL) {
         return false;
     }
     // ab+ doesn't seem to work
-    __heap_tracer_osfh = _afopen("C:\\HEAPT.BIN", "rb+");
-    if (__heap_tracer_osfh == NULL) {
-        __heap_tracer_osfh = _afopen("C:\\HEAPT.BIN", "wb+");
-        if (__heap_tracer_osfh == NULL) {
+    __heaptracer.osfh = _afopen("C:\\HEAPT.BIN", "rb+");
+    if (__heaptracer.osfh == NULL) {
+        __heaptracer.osfh = _afopen("C:\\HEAPT.BIN", "wb+");
+        if (__heaptracer.osfh == NULL) {
             return false;
         }
     }
-    __fseek(__heap_tracer_osfh, 0, _SYS_SEEK_END);
-    _fwrite(TRACE_START, 1, sizeof(TRACE_START), __heap_tracer_osfh);
-    __fflush(__heap_tracer_osfh);
+    __fseek(__heaptracer.osfh, 0, _SYS_SEEK_END);
+    _fwrite(TRACE_START, 1, sizeof(TRACE_START), __heaptracer.osfh);
+    __fflush(__heaptracer.osfh);
+
+    // The ring itself is not traced.
+    heaptracer_record_t *ring = lmalloc(sizeof(heaptracer_record_t) * HEAPTRACER_RING_SIZE);
+    __heaptracer.flush_event = OSCreateEvent(0, 0);
+    __heaptracer.flusher_exited = OSCreateEvent(1, 0);
+    if (ring == NULL || __heaptracer.flush_event == NULL || __heaptracer.flusher_exited == NULL) {
+        goto fail;
+    }
+
+    __heaptracer.head = 0;
+    __heaptracer.tail = 0;
+    __heaptracer.dropped = 0;
+    __heaptracer.timestamp = 0;
+    __heaptracer.records_written = 0;
+    __heaptracer.records_dropped = 0;
+    __heaptracer.is_stopping = false;
+
+    __heaptracer.flusher = OSCreateThread(&heaptracer_flusher_entry, NULL, HEAPTRACER_FLUSHER_STACK_SIZE, false);
+    if (__heaptracer.flusher == NULL) {
+        goto fail;
+    }
+
+    // Publish the ring last. This is what turns tracing on for the allocator.
+    OSEnterCriticalSection(&__heaptracer.cs);
+    __heaptracer.ring = ring;
+    OSLeaveCriticalSection(&__heaptracer.cs);
+
+    return true;
+
+fail:
+    if (ring != NULL) {
+        _lfree(ring);
+    }
+    if (__heaptracer.flush_event != NULL) {
+        OSCloseEvent(__heaptracer.flush_event);
+        __heaptracer.flush_event = NULL;
+    }
+    if (__heaptracer.flusher_exited != NULL) {
+        OSCloseEvent(__heaptracer.flusher_exited);
+        __heaptracer.flusher_exited = NULL;
+    }
+    _fclose(__heaptracer.osfh);
+    __heaptracer.osfh = NULL;
+    return false;
+}
+
+/**
+ * @brief Write out a snapshot of the ring. Must be called while holding the flush lock.
+ *
+ * @param ring The ring.
+ * @param head Value of heaptracer_container_t::head in the snapshot.
+ * @param tail Value of heaptracer_container_t::tail in the snapshot.
+ * @param dropped Number of dropped records taken out of heaptracer_container_t::dropped.
+ * @x_void_return
+ */
+static void heaptracer_drain(heaptracer_record_t *ring, size_t head, size_t tail, size_t dropped) {
+    // Records between tail and head are not touched by the allocator until tail moves, so they can be written out
+    // without holding the ring lock. This takes at most 2 writes since the pending records may wrap around.
+    const size_t tail_index = tail & (HEAPTRACER_RING_SIZE - 1);
+    const size_t pending = head - tail;
+    size_t first = HEAPTRACER_RING_SIZE - tail_index;
+    if (first > pending) {
+        first = pending;
+    }
+    if (first != 0) {
+        _fwrite(&ring[tail_index], sizeof(heaptracer_record_t), first, __heaptracer.osfh);
+    }
+    if (pending - first != 0) {
+        _fwrite(&ring[0], sizeof(heaptracer_record_t), pending - first, __heaptracer.osfh);
+    }
+
+    if (dropped != 0) {
+        heaptracer_record_t marker = {
+            .ptr = HEAPTRACER_DROP_MARKER,
+            .size = dropped,
+            .timestamp = __heaptracer.timestamp,
+            .thread = 0,
+            .caller = 0,
+        };
+        _fwrite(&marker, sizeof(marker), 1, __heaptracer.osfh);
+    }
+
+    if (pending != 0 || dropped != 0) {
+        __fflush(__heaptracer.osfh);
+    }
+
+    OSEnterCriticalSection(&__heaptracer.cs);
+    __heaptracer.tail = head;
+    __heaptracer.records_written += pending;
+    __heaptracer.records_dropped += dropped;
+    OSLeaveCriticalSection(&__heaptracer.cs);
+}
+
+bool osdep_heap_trace_flush(void) {
+    if (__heaptracer.magic != HEAPTRACER_HEADER_MAGIC || __heaptracer.osfh == NULL) {
+        return false;
+    }
+
+    OSEnterCriticalSection(&__heaptracer.flush_cs);
+
+    OSEnterCriticalSection(&__heaptracer.cs);
+    heaptracer_record_t *ring = __heaptracer.ring;
+    const size_t head = __heaptracer.head;
+    const size_t tail = __heaptracer.tail;
+    const size_t dropped = __heaptracer.dropped;
+    __heaptracer.dropped = 0;
+    OSLeaveCriticalSection(&__heaptracer.cs);
+
+    if (ring == NULL) {
+        OSLeaveCriticalSection(&__heaptracer.flush_cs);
+        return false;
+    }
+
+    heaptracer_drain(ring, head, tail, dropped);
+
+    OSLeaveCriticalSection(&__heaptracer.flush_cs);
+
     return true;
 }
 
 bool osdep_heap_trace_stop(void) {
-    if (__heap_tracer_osfh == NULL) {
+    if (__heaptracer.magic != HEAPTRACER_HEADER_MAGIC || __heaptracer.osfh == NULL) {
         return false;
     }
-    _fclose(__heap_tracer_osfh);
-    __heap_tracer_osfh = NULL;
+
+    __heaptracer.is_stopping = true;
+    OSSetEvent(__heaptracer.flush_event);
+    while (OSWaitForEvent(__heaptracer.flusher_exited, HEAPTRACER_FLUSH_INTERVAL) == WAIT_RESULT_TIMEOUT) {}
+
+    // Detach the ring first so nothing can be pushed after the final drain.
+    OSEnterCriticalSection(&__heaptracer.flush_cs);
+    OSEnterCriticalSection(&__heaptracer.cs);
+    heaptracer_record_t *ring = __heaptracer.ring;
+    const size_t head = __heaptracer.head;
+    const size_t tail = __heaptracer.tail;
+    const size_t dropped = __heaptracer.dropped;
+    __heaptracer.ring = NULL;
+    __heaptracer.dropped = 0;
+    OSLeaveCriticalSection(&__heaptracer.cs);
+
+    heaptracer_drain(ring, head, tail, dropped);
+
+    _lfree(ring);
+    OSCloseEvent(__heaptracer.flush_event);
+    OSCloseEvent(__heaptracer.flusher_exited);
+    __heaptracer.flush_event = NULL;
+    __heaptracer.flusher_exited = NULL;
+    __heaptracer.flusher = NULL;
+
+    _fclose(__heaptracer.osfh);
+    __heaptracer.osfh = NULL;
+    OSLeaveCriticalSection(&__heaptracer.flush_cs);
+
     return true;
 }
+
+void osdep_heap_trace_get_stats(osdep_heap_trace_stats_t *stats) {
+    if (__heaptracer.magic != HEAPTRACER_HEADER_MAGIC) {
+        stats->is_running = false;
+        stats->records_written = 0;
+        stats->records_pending = 0;
+        stats->records_dropped = 0;
+        return;
+    }
+
+    OSEnterCriticalSection(&__heaptracer.cs);
+    stats->is_running = __heaptracer.ring != NULL;
+    stats->records_written = __heaptracer.records_written;
+    stats->records_pending = __heaptracer.head - __heaptracer.tail;
+    stats->records_dropped = __heaptracer.records_dropped + __heaptracer.dropped;
+    OSLeaveCriticalSection(&__heaptracer.cs);
+}
@@ -1,10 +1,336 @@
+#include "muteki/utils.h"
 #include "osdep/threading.h"
 #include "osdep/ktls.h"
 #include "osdep/heap.h"
 
+#define KTLS_GUARD_MAGIC (0x6b746c73u)
+#define KTLS_REGISTRY_MAGIC (0x6b726567u)
+#define KTLS_SLOTS (sizeof(((thread_t *) NULL)->ktls) / sizeof(((thread_t *) NULL)->ktls[0]))
+// Maximum number of packed fields across all packed slots.
+#define KTLS_FIELDS_MAX (16u)
+#define KTLS_PACKED_TAG "osdep.ktls.packed"
+#define KTLS_PACKED_MASK ((1u << OSDEP_KTLS_PACKED_BITS) - 1u)
+// Tags of slots that osdep itself manages with the guarded and packed accessors.
+#define KTLS_INTERNAL_TAG_PREFIX "osdep."
+// Owner of the slots left to other images by OSDEP_KTLS_CLAIM_SLOTS.
+#define KTLS_RESERVED_TAG "ktls.other_image"
+
+#ifndef OSDEP_KTLS_CLAIM_SLOTS
+#define OSDEP_KTLS_CLAIM_SLOTS (0xffu)
+#endif
+
+typedef struct {
+    const char *tag;
+    unsigned char bits;
+    osdep_ktls_field_t field;
+} ktls_field_claim_t;
+
+typedef struct {
+    unsigned int magic;
+    critical_section_t cs;
+    /** Owner of each slot. `NULL` when free. */
+    const char *owners[KTLS_SLOTS];
+    /** Number of slots claimed along with the slot, for slots that start a claim. 0 otherwise. */
+    unsigned char nslots[KTLS_SLOTS];
+    /** Number of bits handed out from each packed slot. */
+    unsigned char packed_used[KTLS_SLOTS];
+    ktls_field_claim_t fields[KTLS_FIELDS_MAX];
+} ktls_registry_t;
+
+static ktls_registry_t __ktls_registry;
+
+static inline uintptr_t ktls_guard(const thread_t *thr, void *value, uintptr_t salt) {
+    // Mix in the fields that identify a thread so a descriptor that got reused by a new thread does not match.
+    return ((uintptr_t) value) ^ ((uintptr_t) thr) ^ ((uintptr_t) thr->stack) ^ ((uintptr_t) thr->thread_func) ^
+        salt ^ KTLS_GUARD_MAGIC;
+}
+
+static bool ktls_tag_equals(const char *a, const char *b) {
+    if (a == b) {
+        return true;
+    }
+    if (a == NULL || b == NULL) {
+        return false;
+    }
+    while (*a != '\0' && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static inline uint32_t ktls_packed_check(const thread_t *thr, unsigned int key, uint32_t data) {
+    uint32_t check = ktls_guard(thr, (void *) (uintptr_t) data, key);
+    return ((check >> 16) ^ check) & KTLS_PACKED_MASK;
+}
+
+static bool ktls_range_is_free(unsigned int key, unsigned int nslots) {
+    for (unsigned int i = key; i < key + nslots; i++) {
+        if (__ktls_registry.owners[i] != NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void ktls_range_set_owner(const char *tag, unsigned int key, unsigned int nslots) {
+    for (unsigned int i = key; i < key + nslots; i++) {
+        __ktls_registry.owners[i] = tag;
+        __ktls_registry.nslots[i] = 0;
+        __ktls_registry.packed_used[i] = 0;
+    }
+    if (tag != NULL) {
+        __ktls_registry.nslots[key] = nslots;
+    }
+}
+
+static int ktls_find_tag(const char *tag) {
+    for (unsigned int i = 0; i < KTLS_SLOTS; i++) {
+        if (__ktls_registry.nslots[i] != 0 && ktls_tag_equals(__ktls_registry.owners[i], tag)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void ktls_registry_cinit(void) {
+    if (__ktls_registry.magic != KTLS_REGISTRY_MAGIC) {
+        OSInitCriticalSection(&__ktls_registry.cs);
+        __ktls_registry.magic = KTLS_REGISTRY_MAGIC;
+        // Slots used by osdep itself.
+        ktls_range_set_owner("osdep.utls", OSDEP_KTLS_KEY_UTLS, 2);
+        ktls_range_set_owner("osdep.heap.tcache", OSDEP_KTLS_KEY_HEAP_TCACHE, 2);
+        // The registry is private to this image, so keep out of the slots other images were built to claim.
+        for (unsigned int i = 0; i < KTLS_SLOTS; i++) {
+            if ((OSDEP_KTLS_CLAIM_SLOTS & (1u << i)) == 0 && __ktls_registry.owners[i] == NULL) {
+                ktls_range_set_owner(KTLS_RESERVED_TAG, i, 1);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Check whether a slot is claimed by osdep itself.
+ * @details Those slots hold guarded or packed values that osdep reads without any other check, so the raw key accessors
+ * must not touch them. Slots claimed by other tags are left to their owners, which may use either API.
+ *
+ * @param key The key.
+ * @retval true The slot is owned by osdep.
+ * @retval false The slot is free or owned by someone else.
+ */
+static bool ktls_slot_is_internal(unsigned int key) {
+    ktls_registry_cinit();
+    const char *owner = __ktls_registry.owners[key];
+    if (owner == NULL) {
+        return false;
+    }
+    const char *prefix = KTLS_INTERNAL_TAG_PREFIX;
+    while (*prefix != '\0' && *prefix == *owner) {
+        prefix++;
+        owner++;
+    }
+    return *prefix == '\0';
+}
+
+static bool ktls_raw_key_is_allowed(unsigned int key, const char *caller) {
+    if (ktls_slot_is_internal(key)) {
+        WriteComDebugMsg("%s: Slot %u is claimed by osdep. Use osdep_ktls_claim() to get a free slot.", caller, key);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Claim a range of slots while holding the registry lock.
+ *
+ * @param tag The tag.
+ * @param key The first key, or -1 to take the first free range.
+ * @param nslots Number of slots.
+ * @return The first key, or -1 on failure.
+ */
+static int ktls_claim_locked(const char *tag, int key, unsigned int nslots) {
+    if (tag == NULL || nslots == 0 || nslots > KTLS_SLOTS) {
+        return -1;
+    }
+
+    int existing = ktls_find_tag(tag);
+    if (existing >= 0) {
+        if (__ktls_registry.nslots[existing] == nslots && (key < 0 || key == existing)) {
+            return existing;
+        }
+        WriteComDebugMsg("osdep_ktls_claim: Tag is already claimed with a different range.");
+        return -1;
+    }
+
+    if (key < 0) {
+        for (unsigned int i = 0; i + nslots <= KTLS_SLOTS; i++) {
+            if (ktls_range_is_free(i, nslots)) {
+                key = i;
+                break;
+            }
+        }
+        if (key < 0) {
+            return -1;
+        }
+    } else if (((unsigned int) key) + nslots > KTLS_SLOTS || !ktls_range_is_free(key, nslots)) {
+        WriteComDebugMsg("osdep_ktls_claim_at: Slots are already claimed by another tag.");
+        return -1;
+    }
+
+    ktls_range_set_owner(tag, key, nslots);
+    return key;
+}
+
+int osdep_ktls_claim(const char *tag, unsigned int nslots) {
+    ktls_registry_cinit();
+    OSEnterCriticalSection(&__ktls_registry.cs);
+    int key = ktls_claim_locked(tag, -1, nslots);
+    OSLeaveCriticalSection(&__ktls_registry.cs);
+    return key;
+}
+
+int osdep_ktls_claim_at(const char *tag, unsigned int key, unsigned int nslots) {
+    if (key >= KTLS_SLOTS) {
+        return -1;
+    }
+    ktls_registry_cinit();
+    OSEnterCriticalSection(&__ktls_registry.cs);
+    int claimed = ktls_claim_locked(tag, key, nslots);
+    OSLeaveCriticalSection(&__ktls_registry.cs);
+    return (claimed < 0) ? -1 : 0;
+}
+
+int osdep_ktls_unclaim(const char *tag) {
+    if (tag == NULL || __ktls_registry.magic != KTLS_REGISTRY_MAGIC || ktls_tag_equals(tag, KTLS_RESERVED_TAG)) {
+        return -1;
+    }
+
+    OSEnterCriticalSection(&__ktls_registry.cs);
+    int key = ktls_find_tag(tag);
+    if (key >= 0) {
+        ktls_range_set_owner(NULL, key, __ktls_registry.nslots[key]);
+        OSLeaveCriticalSection(&__ktls_registry.cs);
+        return 0;
+    }
+    for (size_t i = 0; i < KTLS_FIELDS_MAX; i++) {
+        if (__ktls_registry.fields[i].bits != 0 && ktls_tag_equals(__ktls_registry.fields[i].tag, tag)) {
+            __ktls_registry.fields[i].tag = NULL;
+            __ktls_registry.fields[i].bits = 0;
+            OSLeaveCriticalSection(&__ktls_registry.cs);
+            return 0;
+        }
+    }
+    OSLeaveCriticalSection(&__ktls_registry.cs);
+    return -1;
+}
+
+const char *osdep_ktls_get_owner(unsigned int key) {
+    if (key >= KTLS_SLOTS) {
+        return NULL;
+    }
+    ktls_registry_cinit();
+    return __ktls_registry.owners[key];
+}
+
+int osdep_ktls_field_claim(const char *tag, unsigned int bits, osdep_ktls_field_t *field) {
+    if (tag == NULL || bits == 0 || bits > OSDEP_KTLS_PACKED_BITS) {
+        return -1;
+    }
+
+    ktls_registry_cinit();
+    OSEnterCriticalSection(&__ktls_registry.cs);
+
+    ktls_field_claim_t *free_claim = NULL;
+    for (size_t i = 0; i < KTLS_FIELDS_MAX; i++) {
+        ktls_field_claim_t *claim = &__ktls_registry.fields[i];
+        if (claim->bits == 0) {
+            if (free_claim == NULL) {
+                free_claim = claim;
+            }
+        } else if (ktls_tag_equals(claim->tag, tag)) {
+            OSLeaveCriticalSection(&__ktls_registry.cs);
+            if (claim->bits != bits) {
+                WriteComDebugMsg("osdep_ktls_field_claim: Tag is already claimed with a different width.");
+                return -1;
+            }
+            *field = claim->field;
+            return 0;
+        }
+    }
+    if (free_claim == NULL) {
+        OSLeaveCriticalSection(&__ktls_registry.cs);
+        return -1;
+    }
+
+    // First fit among the packed slots claimed so far, then claim a new one.
+    int key = -1;
+    for (unsigned int i = 0; i < KTLS_SLOTS; i++) {
+        if (__ktls_registry.owners[i] != NULL && ktls_tag_equals(__ktls_registry.owners[i], KTLS_PACKED_TAG) &&
+                __ktls_registry.packed_used[i] + bits <= OSDEP_KTLS_PACKED_BITS) {
+            key = i;
+            break;
+        }
+    }
+    if (key < 0) {
+        // Each packed slot is a claim of its own, so bypass the same-tag check.
+        for (unsigned int i = 0; i < KTLS_SLOTS; i++) {
+            if (__ktls_registry.owners[i] == NULL) {
+                ktls_range_set_owner(KTLS_PACKED_TAG, i, 1);
+                key = i;
+                break;
+            }
+        }
+    }
+    if (key < 0) {
+        OSLeaveCriticalSection(&__ktls_registry.cs);
+        return -1;
+    }
+
+    free_claim->tag = tag;
+    free_claim->bits = bits;
+    free_claim->field.key = key;
+    free_claim->field.shift = __ktls_registry.packed_used[key];
+    free_claim->field.width = bits;
+    __ktls_registry.packed_used[key] += bits;
+    *field = free_claim->field;
+
+    OSLeaveCriticalSection(&__ktls_registry.cs);
+    return 0;
+}
+
+uint32_t osdep_ktls_field_get(const thread_t *thr, osdep_ktls_field_t field) {
+    if (field.key >= KTLS_SLOTS) {
+        return 0;
+    }
+    uint32_t word = thr->ktls[field.key];
+    uint32_t data = word & KTLS_PACKED_MASK;
+    if ((word >> OSDEP_KTLS_PACKED_BITS) != ktls_packed_check(thr, field.key, data)) {
+        return 0;
+    }
+    return (data >> field.shift) & ((1u << field.width) - 1u);
+}
+
+int osdep_ktls_field_set(thread_t *thr, osdep_ktls_field_t field, uint32_t value) {
+    if (field.key >= KTLS_SLOTS) {
+        return -1;
+    }
+    uint32_t word = thr->ktls[field.key];
+    uint32_t data = word & KTLS_PACKED_MASK;
+    if ((word >> OSDEP_KTLS_PACKED_BITS) != ktls_packed_check(thr, field.key, data)) {
+        data = 0;
+    }
+    const uint32_t mask = ((1u << field.width) - 1u) << field.shift;
+    data = (data & ~mask) | ((value << field.shift) & mask);
+    thr->ktls[field.key] = (ktls_packed_check(thr, field.key, data) << OSDEP_KTLS_PACKED_BITS) | data;
+    return 0;
+}
+
 int osdep_ktls_init(thread_t *thr) {
     for (size_t i = 0; i < sizeof(thr->ktls) / sizeof(thr->ktls[0]); i++) {
-        thr->ktls[i] = 0;
+        // Garbage in slots owned by osdep is caught by their guards, while wiping e.g. a live heap cache would leak it.
+        if (!ktls_slot_is_internal(i)) {
+            thr->ktls[i] = 0;
+        }
     }
     return 0;
 }
@@ -24,16 +350,35 @@ void *osdep_ktls_getvalue(thread_t *thr, unsigned int key) {
 }
 
 int osdep_ktls_set(thread_t *thr, unsigned int key, void *value) {
-    if (key <= OSDEP_KTLS_KEY_MAX) {
+    if (key <= OSDEP_KTLS_KEY_MAX && ktls_raw_key_is_allowed(key, "osdep_ktls_set")) {
+        thr->ktls[key] = (uintptr_t) value;
+        return 0;
+    }
+    return -1;
+}
+
+int osdep_ktls_set_guarded(thread_t *thr, unsigned int key, void *value, uintptr_t salt) {
+    if (key < OSDEP_KTLS_KEY_MAX) {
         thr->ktls[key] = (uintptr_t) value;
+        thr->ktls[key + 1] = ktls_guard(thr, value, salt);
         return 0;
     }
     return -1;
 }
 
+void *osdep_ktls_getvalue_guarded(const thread_t *thr, unsigned int key, uintptr_t salt) {
+    if (key < OSDEP_KTLS_KEY_MAX) {
+        void *value = (void *) thr->ktls[key];
+        if (thr->ktls[key + 1] == ktls_guard(thr, value, salt)) {
+            return value;
+        }
+    }
+    return NULL;
+}
+
 void *osdep_ktls_alloc(thread_t *thr, unsigned int key, size_t bytes) {
     void **tls_area_p = osdep_ktls_get(thr, key);
-    if (tls_area_p == NULL) {
+    if (tls_area_p == NULL || !ktls_raw_key_is_allowed(key, "osdep_ktls_alloc")) {
         return NULL;
     }
     void *tls_area = *tls_area_p;
@@ -49,6 +394,9 @@ void *osdep_ktls_alloc(thread_t *thr, unsigned int key, size_t bytes) {
 }
 
 int osdep_ktls_free(thread_t *thr, unsigned int key) {
+    if (key > OSDEP_KTLS_KEY_MAX || !ktls_raw_key_is_allowed(key, "osdep_ktls_free")) {
+        return -1;
+    }
     void *tls_area = osdep_ktls_getvalue(thr, key);
     if (tls_area == NULL) {
         return -1;
@@ -0,0 +1,89 @@
+#include "osdep/memops.h"
+
+// Registers used for ldm/stm bursts. r9-r11 are left alone since they may be reserved for the static base or the frame
+// pointer.
+#define MEMOPS_BURST_REGS "{r3, r4, r5, r6, r7, r8, r12, lr}"
+#define MEMOPS_BURST_SIZE (32u)
+
+void osdep_memops_copy(void *dst, const void *src, size_t size) {
+    uint8_t *db = (uint8_t *) dst;
+    const uint8_t *sb = (const uint8_t *) src;
+
+    if (((((uintptr_t) db) ^ ((uintptr_t) sb)) & 3u) == 0) {
+        // Both ends reach a word boundary after the same number of bytes.
+        while ((((uintptr_t) db) & 3u) != 0 && size != 0) {
+            *db++ = *sb++;
+            size--;
+        }
+
+        size_t bursts = size / MEMOPS_BURST_SIZE;
+        if (bursts != 0) {
+            asm volatile (
+                "1:\n\t"
+                "ldmia %[src]!, " MEMOPS_BURST_REGS "\n\t"
+                "stmia %[dst]!, " MEMOPS_BURST_REGS "\n\t"
+                "subs %[n], %[n], #1\n\t"
+                "bne 1b"
+                : [dst] "+r" (db), [src] "+r" (sb), [n] "+r" (bursts)
+                :
+                : "r3", "r4", "r5", "r6", "r7", "r8", "r12", "lr", "cc", "memory"
+            );
+            size &= MEMOPS_BURST_SIZE - 1;
+        }
+
+        uint32_t *dw = (uint32_t *) db;
+        const uint32_t *sw = (const uint32_t *) sb;
+        for (; size >= 4; size -= 4) {
+            *dw++ = *sw++;
+        }
+        db = (uint8_t *) dw;
+        sb = (const uint8_t *) sw;
+    }
+
+    while (size != 0) {
+        *db++ = *sb++;
+        size--;
+    }
+}
+
+void osdep_memops_zero(void *dst, size_t size) {
+    uint8_t *db = (uint8_t *) dst;
+
+    while ((((uintptr_t) db) & 3u) != 0 && size != 0) {
+        *db++ = 0;
+        size--;
+    }
+
+    size_t bursts = size / MEMOPS_BURST_SIZE;
+    if (bursts != 0) {
+        asm volatile (
+            "mov r3, #0\n\t"
+            "mov r4, #0\n\t"
+            "mov r5, #0\n\t"
+            "mov r6, #0\n\t"
+            "mov r7, #0\n\t"
+            "mov r8, #0\n\t"
+            "mov r12, #0\n\t"
+            "mov lr, #0\n\t"
+            "1:\n\t"
+            "stmia %[dst]!, " MEMOPS_BURST_REGS "\n\t"
+            "subs %[n], %[n], #1\n\t"
+            "bne 1b"
+            : [dst] "+r" (db), [n] "+r" (bursts)
+            :
+            : "r3", "r4", "r5", "r6", "r7", "r8", "r12", "lr", "cc", "memory"
+        );
+        size &= MEMOPS_BURST_SIZE - 1;
+    }
+
+    uint32_t *dw = (uint32_t *) db;
+    for (; size >= 4; size -= 4) {
+        *dw++ = 0;
+    }
+    db = (uint8_t *) dw;
+
+    while (size != 0) {
+        *db++ = 0;
+        size--;
+    }
+}
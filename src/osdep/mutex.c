@@ -0,0 +1,172 @@
+#include "osdep/atomic.h"
+#include "osdep/mutex.h"
+#include "osdep/threading.h"
+#include "clock.h"
+
+#define MUTEX_UNLOCKED (0u)
+#define MUTEX_LOCKED (1u)
+#define MUTEX_CONTENDED (2u)
+// Waiters wake up this often (in OSSleep() units) and retry even when nobody released the semaphore.
+#define MUTEX_WAIT_TIMEOUT (1000)
+
+static semaphore_t *mutex_get_sem(osdep_mutex_t *mutex) {
+    semaphore_t *sem = mutex->sem;
+    if (sem != NULL) {
+        return sem;
+    }
+
+    // Only ever taken on first contention, so a sleeping spin lock is fine.
+    while (osdep_atomic_swap(&mutex->sem_lock, 1) != 0) {
+        OSSleep(1);
+    }
+    sem = mutex->sem;
+    if (sem == NULL) {
+        sem = OSCreateSemaphore(0);
+        mutex->sem = sem;
+    }
+    OSDEP_BARRIER();
+    mutex->sem_lock = 0;
+    return sem;
+}
+
+static void mutex_lock_slow(osdep_mutex_t *mutex) {
+    // The semaphore must exist before the state says there may be waiters, since that's when unlockers post to it.
+    semaphore_t *sem = mutex_get_sem(mutex);
+
+    // Whoever gets the lock here can't tell whether other threads are still waiting, so it keeps the contended state
+    // and wakes one of them on unlock. Extra wakeups only cost a retry.
+    while (osdep_atomic_swap(&mutex->state, MUTEX_CONTENDED) != MUTEX_UNLOCKED) {
+        if (sem != NULL) {
+            OSWaitForSemaphore(sem, MUTEX_WAIT_TIMEOUT);
+        } else {
+            OSSleep(1);
+        }
+    }
+}
+
+static inline bool mutex_tracks_owner(const osdep_mutex_t *mutex) {
+    return mutex->type != OSDEP_MUTEX_NORMAL;
+}
+
+void osdep_mutex_init(osdep_mutex_t *mutex, osdep_mutex_type_t type) {
+    mutex->state = MUTEX_UNLOCKED;
+    mutex->sem_lock = 0;
+    mutex->sem = NULL;
+    mutex->owner = NULL;
+    mutex->depth = 0;
+    mutex->type = type;
+}
+
+void osdep_mutex_destroy(osdep_mutex_t *mutex) {
+    if (mutex->sem != NULL) {
+        OSCloseSemaphore(mutex->sem);
+        mutex->sem = NULL;
+    }
+}
+
+bool osdep_mutex_lock(osdep_mutex_t *mutex) {
+    thread_t *self = NULL;
+    if (mutex_tracks_owner(mutex)) {
+        self = osdep_thread_get_current();
+        if (mutex->owner == self) {
+            if (mutex->type != OSDEP_MUTEX_RECURSIVE) {
+                return false;
+            }
+            mutex->depth++;
+            return true;
+        }
+    }
+
+    if (osdep_atomic_swap(&mutex->state, MUTEX_LOCKED) != MUTEX_UNLOCKED) {
+        mutex_lock_slow(mutex);
+    }
+
+    if (self != NULL) {
+        mutex->owner = self;
+        mutex->depth = 1;
+    }
+    return true;
+}
+
+bool osdep_mutex_trylock(osdep_mutex_t *mutex) {
+    thread_t *self = NULL;
+    if (mutex_tracks_owner(mutex)) {
+        self = osdep_thread_get_current();
+        if (mutex->owner == self) {
+            if (mutex->type != OSDEP_MUTEX_RECURSIVE) {
+                return false;
+            }
+            mutex->depth++;
+            return true;
+        }
+    }
+
+    uint32_t old = osdep_atomic_swap(&mutex->state, MUTEX_LOCKED);
+    if (old == MUTEX_CONTENDED) {
+        // That swap may have hidden waiters from the owner. Put the contended state back. If the owner released the
+        // lock in between, the lock is ours now.
+        old = osdep_atomic_swap(&mutex->state, MUTEX_CONTENDED);
+    }
+    if (old != MUTEX_UNLOCKED) {
+        return false;
+    }
+
+    if (self != NULL) {
+        mutex->owner = self;
+        mutex->depth = 1;
+    }
+    return true;
+}
+
+bool osdep_mutex_unlock(osdep_mutex_t *mutex) {
+    if (mutex_tracks_owner(mutex)) {
+        if (mutex->owner != osdep_thread_get_current()) {
+            return false;
+        }
+        if (--mutex->depth != 0) {
+            return true;
+        }
+        mutex->owner = NULL;
+    }
+
+    OSDEP_BARRIER();
+    if (osdep_atomic_swap(&mutex->state, MUTEX_UNLOCKED) == MUTEX_CONTENDED && mutex->sem != NULL) {
+        OSReleaseSemaphore(mutex->sem);
+    }
+    return true;
+}
+
+void osdep_mutex_benchmark(size_t iterations, osdep_mutex_benchmark_t *result) {
+    osdep_mutex_t normal = OSDEP_MUTEX_INITIALIZER(OSDEP_MUTEX_NORMAL);
+    osdep_mutex_t recursive = OSDEP_MUTEX_INITIALIZER(OSDEP_MUTEX_RECURSIVE);
+    critical_section_t cs;
+    unsigned int start;
+
+    result->iterations = iterations;
+
+    start = osdep_clock_ms();
+    for (size_t i = 0; i < iterations; i++) {
+        osdep_mutex_lock(&normal);
+        osdep_mutex_unlock(&normal);
+    }
+    result->mutex_normal_ms = osdep_clock_elapsed_ms(start, osdep_clock_ms());
+
+    start = osdep_clock_ms();
+    for (size_t i = 0; i < iterations; i++) {
+        osdep_mutex_lock(&recursive);
+        osdep_mutex_unlock(&recursive);
+    }
+    result->mutex_recursive_ms = osdep_clock_elapsed_ms(start, osdep_clock_ms());
+
+    OSInitCriticalSection(&cs);
+    start = osdep_clock_ms();
+    for (size_t i = 0; i < iterations; i++) {
+        OSEnterCriticalSection(&cs);
+        OSLeaveCriticalSection(&cs);
+    }
+    result->critical_section_ms = osdep_clock_elapsed_ms(start, osdep_clock_ms());
+    OSDeleteCriticalSection(&cs);
+
+    osdep_mutex_destroy(&normal);
+    osdep_mutex_destroy(&recursive);
+}
@@ -0,0 +1,102 @@
+#include "osdep/region.h"
+#include "osdep/heap.h"
+#include "muteki/memory.h"  // for AllocBlock() and FreeBlock()
+#include "muteki/utils.h"  // for WriteComDebugMsg()
+
+typedef struct region_fallback_s region_fallback_t;
+
+// AllocBlock() is only 4-bytes aligned.
+#define REGION_ALIGN_PAD (4u)
+
+struct region_fallback_s {
+    region_fallback_t *next;
+    // Keeps the payload 8-bytes aligned.
+    uintptr_t _padding;
+};
+
+static osdep_region_t *__region_top = NULL;
+
+static void *region_alloc_fallback(osdep_region_t *region, size_t size) {
+    if (sizeof(region_fallback_t) + size < size) {
+        return NULL;
+    }
+    region_fallback_t *node = osdep_heap_alloc(sizeof(region_fallback_t) + size);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->next = region->fallback;
+    region->fallback = node;
+    return node + 1;
+}
+
+static void region_end_one(osdep_region_t *region) {
+    if (region->segment != NULL) {
+        // Freeing the segment block frees every block allocated after it.
+        FreeBlock(region->segment);
+        region->segment = NULL;
+    }
+
+    region_fallback_t *node = region->fallback;
+    while (node != NULL) {
+        region_fallback_t *next = node->next;
+        osdep_heap_free(node);
+        node = next;
+    }
+    region->fallback = NULL;
+    region->is_ended = true;
+}
+
+void osdep_region_begin(osdep_region_t *region, unsigned short tag) {
+    region->parent = __region_top;
+    region->segment = NULL;
+    region->fallback = NULL;
+    region->tag = tag;
+    region->is_ended = false;
+    __region_top = region;
+}
+
+void osdep_region_end(osdep_region_t *region) {
+    if (region->is_ended) {
+        return;
+    }
+
+    // Regions left open inside this one usually live in stack frames that are gone by now, so they can't be unwound.
+    // Their blocks would also go away with our segment while they may still be in use.
+    if (region != __region_top) {
+        WriteComDebugMsg("osdep_region_end: Region %p is not the innermost one. End %p first.", (void *) region,
+                         (void *) __region_top);
+        return;
+    }
+
+    __region_top = region->parent;
+    region_end_one(region);
+}
+
+__attribute__((assume_aligned(8)))
+void *osdep_region_alloc(osdep_region_t *region, size_t size) {
+    if (region->is_ended) {
+        return NULL;
+    }
+
+    // Only the innermost region can use the secondary heap. Anything allocated there by an outer region would be freed
+    // together with the inner region's segment.
+    if (region == __region_top && size + REGION_ALIGN_PAD > size) {
+        void *block = AllocBlock(size + REGION_ALIGN_PAD, region->tag, region->segment == NULL);
+        if (block != NULL) {
+            if (region->segment == NULL) {
+                region->segment = block;
+            }
+            return (void *) ((((uintptr_t) block) + 7u) & (~((uintptr_t) 7u)));
+        }
+    }
+
+    return region_alloc_fallback(region, size);
+}
+
+__attribute__((assume_aligned(8)))
+void *osdep_region_alloc_array(osdep_region_t *region, size_t size, size_t nmemb) {
+    if (nmemb != 0 && size > ((size_t) -1) / nmemb) {
+        return NULL;
+    }
+    return osdep_region_alloc(region, size * nmemb);
+}
@@ -0,0 +1,171 @@
+#include "osdep/rwlock.h"
+#include "wait.h"
+
+typedef struct osdep_rwlock_waiter_s rwlock_waiter_t;
+
+struct osdep_rwlock_waiter_s {
+    rwlock_waiter_t *next;
+    /** Per-wait event. */
+    event_t *event;
+    bool is_writer;
+    /** Set when the lock has been handed over. Only read or written while holding osdep_rwlock_t::lock. */
+    bool granted;
+};
+
+static inline bool rwlock_can_take(const osdep_rwlock_t *rwlock, bool is_writer) {
+    // Anything already queued goes first.
+    return rwlock->head == NULL && !rwlock->writer && (!is_writer || rwlock->readers == 0);
+}
+
+static inline void rwlock_take(osdep_rwlock_t *rwlock, bool is_writer) {
+    if (is_writer) {
+        rwlock->writer = true;
+    } else {
+        rwlock->readers++;
+    }
+}
+
+static void rwlock_unlink(osdep_rwlock_t *rwlock, rwlock_waiter_t *waiter) {
+    rwlock_waiter_t *prev = NULL;
+    for (rwlock_waiter_t *w = rwlock->head; w != NULL; prev = w, w = w->next) {
+        if (w != waiter) {
+            continue;
+        }
+        if (prev == NULL) {
+            rwlock->head = w->next;
+        } else {
+            prev->next = w->next;
+        }
+        if (rwlock->tail == w) {
+            rwlock->tail = prev;
+        }
+        return;
+    }
+}
+
+static void rwlock_grant(osdep_rwlock_t *rwlock) {
+    // Hand the lock over to either the writer at the head of the queue, or to all readers before the next writer.
+    while (rwlock->head != NULL && !rwlock->writer) {
+        rwlock_waiter_t *waiter = rwlock->head;
+        if (waiter->is_writer && rwlock->readers != 0) {
+            break;
+        }
+        rwlock->head = waiter->next;
+        if (rwlock->head == NULL) {
+            rwlock->tail = NULL;
+        }
+        rwlock_take(rwlock, waiter->is_writer);
+        // The waiter frees the event and its stack frame as soon as it sees this under the lock, which can't happen
+        // before we release the lock.
+        waiter->granted = true;
+        OSSetEvent(waiter->event);
+    }
+}
+
+static bool rwlock_acquire(osdep_rwlock_t *rwlock, bool is_writer) {
+    osdep_mutex_lock(&rwlock->lock);
+    if (rwlock_can_take(rwlock, is_writer)) {
+        rwlock_take(rwlock, is_writer);
+        osdep_mutex_unlock(&rwlock->lock);
+        return true;
+    }
+    osdep_mutex_unlock(&rwlock->lock);
+
+    // Create the event outside the lock so the fast path of other threads doesn't wait for the svc.
+    rwlock_waiter_t waiter = {
+        .next = NULL,
+        .event = OSCreateEvent(0, 0),
+        .is_writer = is_writer,
+        .granted = false,
+    };
+    if (waiter.event == NULL) {
+        return false;
+    }
+
+    osdep_mutex_lock(&rwlock->lock);
+    if (rwlock_can_take(rwlock, is_writer)) {
+        rwlock_take(rwlock, is_writer);
+        osdep_mutex_unlock(&rwlock->lock);
+        OSCloseEvent(waiter.event);
+        return true;
+    }
+    if (rwlock->tail == NULL) {
+        rwlock->head = &waiter;
+    } else {
+        rwlock->tail->next = &waiter;
+    }
+    rwlock->tail = &waiter;
+    osdep_mutex_unlock(&rwlock->lock);
+
+    bool granted;
+    for (;;) {
+        wait_result_t wr = OSWaitForEvent(waiter.event, OSDEP_WAIT_MAX);
+        osdep_mutex_lock(&rwlock->lock);
+        granted = waiter.granted;
+        if (!granted && wr == WAIT_RESULT_ERROR) {
+            rwlock_unlink(rwlock, &waiter);
+            // We may have been holding up readers behind us.
+            rwlock_grant(rwlock);
+        }
+        osdep_mutex_unlock(&rwlock->lock);
+        if (granted || wr == WAIT_RESULT_ERROR) {
+            break;
+        }
+    }
+
+    OSCloseEvent(waiter.event);
+    return granted;
+}
+
+static bool rwlock_try_acquire(osdep_rwlock_t *rwlock, bool is_writer) {
+    osdep_mutex_lock(&rwlock->lock);
+    bool taken = rwlock_can_take(rwlock, is_writer);
+    if (taken) {
+        rwlock_take(rwlock, is_writer);
+    }
+    osdep_mutex_unlock(&rwlock->lock);
+    return taken;
+}
+
+void osdep_rwlock_init(osdep_rwlock_t *rwlock) {
+    osdep_mutex_init(&rwlock->lock, OSDEP_MUTEX_NORMAL);
+    rwlock->readers = 0;
+    rwlock->writer = false;
+    rwlock->head = NULL;
+    rwlock->tail = NULL;
+}
+
+void osdep_rwlock_destroy(osdep_rwlock_t *rwlock) {
+    osdep_mutex_destroy(&rwlock->lock);
+}
+
+bool osdep_rwlock_rdlock(osdep_rwlock_t *rwlock) {
+    return rwlock_acquire(rwlock, false);
+}
+
+bool osdep_rwlock_tryrdlock(osdep_rwlock_t *rwlock) {
+    return rwlock_try_acquire(rwlock, false);
+}
+
+bool osdep_rwlock_wrlock(osdep_rwlock_t *rwlock) {
+    return rwlock_acquire(rwlock, true);
+}
+
+bool osdep_rwlock_trywrlock(osdep_rwlock_t *rwlock) {
+    return rwlock_try_acquire(rwlock, true);
+}
+
+bool osdep_rwlock_unlock(osdep_rwlock_t *rwlock) {
+    osdep_mutex_lock(&rwlock->lock);
+    if (rwlock->writer) {
+        rwlock->writer = false;
+    } else if (rwlock->readers != 0) {
+        rwlock->readers--;
+    } else {
+        osdep_mutex_unlock(&rwlock->lock);
+        return false;
+    }
+    rwlock_grant(rwlock);
+    osdep_mutex_unlock(&rwlock->lock);
+    return true;
+}
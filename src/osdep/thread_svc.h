@@ -0,0 +1,36 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file thread_svc.h
+ * @brief Current thread lookup without the stack registry, used internally by osdep.
+ */
+
+#ifndef __OSDEP_THREAD_SVC_H__
+#define __OSDEP_THREAD_SVC_H__
+
+#include <muteki/threading.h>
+
+/**
+ * @brief Get the current running thread with an svc.
+ * @details This is what osdep_thread_get_current() falls back to on threads missing from the stack registry.
+ *
+ * @x_void_param
+ * @return Current running thread.
+ */
+static inline thread_t *osdep_thread_get_current_svc(void) {
+    critical_section_t cs;
+
+    /* This is based on the observation that critical sections don't touch any
+     * kernel structures when there's nothing else that acquired it. It
+     * initializes the critical section descriptor just enough and call
+     * OSEnterCriticalSection() to grab the current thread ID. */
+    cs.thr = NULL;
+    cs.refcount = 0;
+    OSEnterCriticalSection(&cs);
+    return cs.thr;
+}
+
+#endif  // __OSDEP_THREAD_SVC_H__
@@ -1,14 +1,358 @@
+#include "muteki/utils.h"
+#include "osdep/abi.h"
+#include "osdep/atomic.h"
+#include "osdep/heap.h"
 #include "osdep/threading.h"
+#include "clock.h"
+#include "thread_svc.h"
+#include <stdarg.h>
 
-thread_t *osdep_thread_get_current(void) {
+#define THREAD_EXIT_HOOKS_MAX (8u)
+#define THREAD_HOOKS_MAGIC (0x7e4d0e17u)
+#define THREAD_REGISTRY_MAX (16u)
+#define THREAD_REGISTRY_MAGIC (0x5ac4e61du)
+// thread_t::magic of a live thread.
+#define THREAD_MAGIC (0x100)
+
+typedef struct {
+    unsigned int magic;
+    critical_section_t cs;
+    size_t count;
+    osdep_thread_exit_hook_t hooks[THREAD_EXIT_HOOKS_MAX];
+} thread_hooks_t;
+
+typedef struct {
+    /** Entrypoint passed to osdep_thread_create(). */
+    thread_func_t func;
+    /** User data passed to osdep_thread_create(). */
+    void *user_data;
+    /** Set when this was allocated on its own because the registry was full. */
+    bool is_allocated;
+} thread_start_t;
+
+typedef struct {
+    /** Registered thread. `NULL` while the entry is not published. */
+    thread_t *volatile thr;
+    /** Lowest address of the thread stack. */
+    uintptr_t stack_start;
+    /** End of the thread stack. */
+    uintptr_t stack_end;
+    /** Odd while a published entry changes, so lookups racing with it can tell. */
+    volatile unsigned int seq;
+    /** Passed to the new thread by osdep_thread_create(). */
+    thread_start_t start;
+    /** Thread owning an alias from osdep_thread_alias_create(), or `NULL` for the own stack of a thread. */
+    thread_t *alias_thr;
+    /** Set while the entry is owned by a thread, published or not. */
+    volatile bool is_claimed;
+} thread_entry_t;
+
+typedef struct {
+    unsigned int magic;
     critical_section_t cs;
+    /** Number of entries that were ever claimed. Lookups don't need to look further than this. */
+    volatile size_t high_water;
+    thread_entry_t entries[THREAD_REGISTRY_MAX];
+} thread_registry_t;
+
+static thread_hooks_t __thread_hooks;
+static thread_registry_t __thread_registry;
+
+static thread_entry_t *thread_registry_claim(void) {
+    if (__thread_registry.magic != THREAD_REGISTRY_MAGIC) {
+        OSInitCriticalSection(&__thread_registry.cs);
+        __thread_registry.magic = THREAD_REGISTRY_MAGIC;
+    }
+
+    OSEnterCriticalSection(&__thread_registry.cs);
+    for (size_t i = 0; i < THREAD_REGISTRY_MAX; i++) {
+        thread_entry_t *entry = &__thread_registry.entries[i];
+        if (!entry->is_claimed) {
+            entry->is_claimed = true;
+            if (i >= __thread_registry.high_water) {
+                __thread_registry.high_water = i + 1;
+            }
+            OSLeaveCriticalSection(&__thread_registry.cs);
+            return entry;
+        }
+    }
+    OSLeaveCriticalSection(&__thread_registry.cs);
+    return NULL;
+}
+
+static void thread_registry_publish(thread_entry_t *entry, thread_t *thr, uintptr_t stack_start, size_t stack_size) {
+    entry->stack_start = stack_start;
+    entry->stack_end = stack_start + stack_size;
+    // Lookups are lock-free, so the range must be in place before the entry becomes visible.
+    OSDEP_BARRIER();
+    entry->thr = thr;
+}
+
+static inline void thread_registry_begin_update(thread_entry_t *entry) {
+    entry->seq++;
+    OSDEP_BARRIER();
+}
+
+static inline void thread_registry_end_update(thread_entry_t *entry) {
+    OSDEP_BARRIER();
+    entry->seq++;
+}
+
+static void thread_registry_release(thread_entry_t *entry) {
+    thread_registry_begin_update(entry);
+    entry->thr = NULL;
+    entry->stack_start = 0;
+    entry->stack_end = 0;
+    entry->alias_thr = NULL;
+    thread_registry_end_update(entry);
+    entry->is_claimed = false;
+}
+
+static thread_entry_t *thread_registry_find(const thread_t *thr) {
+    for (size_t i = 0; i < __thread_registry.high_water; i++) {
+        if (__thread_registry.entries[i].thr == thr && __thread_registry.entries[i].alias_thr == NULL) {
+            return &__thread_registry.entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Look up the current thread by its stack pointer.
+ *
+ * @x_void_param
+ * @return The current thread, or `NULL` if it is not registered.
+ */
+static thread_t *thread_registry_lookup(void) {
+    // Any local lives on the current stack, so its address is as good as sp and doesn't need any assembly.
+    volatile uintptr_t marker = 0;
+    const uintptr_t sp = (uintptr_t) &marker;
+
+    const size_t high_water = __thread_registry.high_water;
+    for (size_t i = 0; i < high_water; i++) {
+        thread_entry_t *entry = &__thread_registry.entries[i];
+        const unsigned int seq = entry->seq;
+        OSDEP_BARRIER();
+        thread_t *thr = entry->thr;
+        if (thr == NULL || (seq & 1u) != 0) {
+            continue;
+        }
+        OSDEP_BARRIER();
+        const uintptr_t stack_start = entry->stack_start;
+        if (sp < stack_start || sp >= entry->stack_end) {
+            continue;
+        }
+        // Aliases are not described by the descriptor, which only knows about the stack the kernel allocated.
+        const bool is_own_stack = (entry->alias_thr == NULL);
+        OSDEP_BARRIER();
+        // A range that changed while it was being read may be torn.
+        if (entry->seq != seq) {
+            continue;
+        }
+        // Stacks of live threads never overlap, so a match can only be stale if the thread exited without running the
+        // exit hooks. Make sure the descriptor still describes the same live thread.
+        if (thr->magic == THREAD_MAGIC && (!is_own_stack || ((uintptr_t) thr->stack) == stack_start)) {
+            return thr;
+        }
+    }
+    return NULL;
+}
+
+static int thread_main(thread_start_t *start) {
+    thread_func_t func = start->func;
+    void *user_data = start->user_data;
+    if (start->is_allocated) {
+        osdep_heap_free(start);
+    }
+    return osdep_thread_exit(func(user_data));
+}
+
+// Called by the kernel, which doesn't keep the stack 8-byte aligned.
+APCS_WRAPPER_STATIC(thread_trampoline, args, int, void *user_data) {
+    return thread_main(va_arg(args, thread_start_t *));
+}
+
+thread_t *osdep_thread_get_current(void) {
+    thread_t *thr = thread_registry_lookup();
+    if (thr == NULL) {
+        return osdep_thread_get_current_svc();
+    }
+#ifdef OSDEP_THREAD_VERIFY_CURRENT
+    thread_t *expected = osdep_thread_get_current_svc();
+    if (thr != expected) {
+        WriteComDebugMsg("osdep_thread_get_current: Stack registry returned the wrong thread.");
+        return expected;
+    }
+#endif
+    return thr;
+}
+
+thread_t *osdep_thread_create(thread_func_t func, void *user_data, size_t stack_size, bool defer_start) {
+    thread_entry_t *entry = thread_registry_claim();
+    if (entry == NULL) {
+        // The thread still works and runs the exit hooks, it just takes the slow path in osdep_thread_get_current().
+        WriteComDebugMsg("osdep_thread_create: Thread registry is full. Falling back to the slow thread lookup.");
+        thread_start_t *start = osdep_heap_alloc(sizeof(thread_start_t));
+        if (start == NULL) {
+            return NULL;
+        }
+        start->func = func;
+        start->user_data = user_data;
+        start->is_allocated = true;
+        thread_t *thr = OSCreateThread(&thread_trampoline, start, stack_size, defer_start);
+        if (thr == NULL) {
+            osdep_heap_free(start);
+        }
+        return thr;
+    }
+
+    entry->start.func = func;
+    entry->start.user_data = user_data;
+    entry->start.is_allocated = false;
+
+    // Always create the thread suspended so it can't look itself up before the entry is published.
+    thread_t *thr = OSCreateThread(&thread_trampoline, &entry->start, stack_size, true);
+    if (thr == NULL) {
+        thread_registry_release(entry);
+        return NULL;
+    }
+    thread_registry_publish(entry, thr, (uintptr_t) thr->stack, stack_size);
+
+    if (!defer_start) {
+        OSResumeThread(thr);
+    }
+    return thr;
+}
+
+bool osdep_thread_register_current(size_t stack_size) {
+    thread_t *thr = osdep_thread_get_current_svc();
+    if (thread_registry_find(thr) != NULL) {
+        return true;
+    }
+
+    volatile uintptr_t marker = 0;
+    const uintptr_t sp = (uintptr_t) &marker;
+    const uintptr_t stack_start = (uintptr_t) thr->stack;
+    if (sp < stack_start || sp - stack_start >= stack_size) {
+        // Either the size is wrong or this thread doesn't run on the stack the kernel allocated for it.
+        return false;
+    }
+
+    thread_entry_t *entry = thread_registry_claim();
+    if (entry == NULL) {
+        return false;
+    }
+    thread_registry_publish(entry, thr, stack_start, stack_size);
+    return true;
+}
+
+bool osdep_thread_add_exit_hook(osdep_thread_exit_hook_t hook) {
+    if (__thread_hooks.magic != THREAD_HOOKS_MAGIC) {
+        OSInitCriticalSection(&__thread_hooks.cs);
+        __thread_hooks.magic = THREAD_HOOKS_MAGIC;
+    }
+
+    OSEnterCriticalSection(&__thread_hooks.cs);
+    for (size_t i = 0; i < __thread_hooks.count; i++) {
+        if (__thread_hooks.hooks[i] == hook) {
+            OSLeaveCriticalSection(&__thread_hooks.cs);
+            return true;
+        }
+    }
+    if (__thread_hooks.count >= THREAD_EXIT_HOOKS_MAX) {
+        OSLeaveCriticalSection(&__thread_hooks.cs);
+        return false;
+    }
+    __thread_hooks.hooks[__thread_hooks.count] = hook;
+    __thread_hooks.count++;
+    OSLeaveCriticalSection(&__thread_hooks.cs);
+    return true;
+}
+
+void osdep_thread_run_exit_hooks(thread_t *thr) {
+    if (thr == NULL) {
+        return;
+    }
+
+    if (__thread_hooks.magic == THREAD_HOOKS_MAGIC) {
+        // Hooks are only ever appended, so it's safe to walk the list without holding the lock. Run them in the reverse
+        // order of registration so later subsystems go away before the ones they may depend on.
+        for (size_t i = __thread_hooks.count; i > 0; i--) {
+            __thread_hooks.hooks[i - 1](thr);
+        }
+    }
+
+    // Hooks may still look up the current thread, so only drop the stack range afterwards.
+    thread_entry_t *entry = thread_registry_find(thr);
+    if (entry != NULL) {
+        thread_registry_release(entry);
+    }
+
+    // Aliases stay claimed until their owner destroys them, but must stop matching a descriptor that may get reused.
+    for (size_t i = 0; i < __thread_registry.high_water; i++) {
+        thread_entry_t *alias = &__thread_registry.entries[i];
+        if (alias->is_claimed && alias->alias_thr == thr) {
+            thread_registry_begin_update(alias);
+            alias->thr = NULL;
+            alias->alias_thr = NULL;
+            thread_registry_end_update(alias);
+        }
+    }
+}
+
+osdep_thread_alias_t *osdep_thread_alias_create(thread_t *thr) {
+    if (thr == NULL) {
+        return NULL;
+    }
+    thread_entry_t *entry = thread_registry_claim();
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->alias_thr = thr;
+    return (osdep_thread_alias_t *) entry;
+}
+
+void osdep_thread_alias_move(osdep_thread_alias_t *alias, void *stack, size_t stack_size) {
+    thread_entry_t *entry = (thread_entry_t *) alias;
+    thread_registry_begin_update(entry);
+    entry->thr = NULL;
+    entry->stack_start = (uintptr_t) stack;
+    entry->stack_end = (uintptr_t) stack + stack_size;
+    if (stack != NULL) {
+        entry->thr = entry->alias_thr;
+    }
+    thread_registry_end_update(entry);
+}
+
+void osdep_thread_alias_destroy(osdep_thread_alias_t *alias) {
+    if (alias != NULL) {
+        thread_registry_release((thread_entry_t *) alias);
+    }
+}
+
+int osdep_thread_exit(int exit_code) {
+    osdep_thread_run_exit_hooks(osdep_thread_get_current());
+    return OSExitThread(exit_code);
+}
+
+void osdep_thread_benchmark_get_current(size_t iterations, osdep_thread_benchmark_t *result) {
+    thread_t *volatile sink;
+    unsigned int start;
+
+    result->iterations = iterations;
+    result->is_registered = (thread_registry_lookup() != NULL);
+
+    start = osdep_clock_ms();
+    for (size_t i = 0; i < iterations; i++) {
+        sink = thread_registry_lookup();
+    }
+    result->registry_ms = osdep_clock_elapsed_ms(start, osdep_clock_ms());
+
+    start = osdep_clock_ms();
+    for (size_t i = 0; i < iterations; i++) {
+        sink = osdep_thread_get_current_svc();
+    }
+    result->svc_ms = osdep_clock_elapsed_ms(start, osdep_clock_ms());
 
-    /* This is based on the observation that critical sections don't touch any
-     * kernel structures when there's nothing else that acquired it. It
-     * initializes the critical section descriptor just enough and call
-     * OSEnterCriticalSection() to grab the current thread ID. */
-    cs.thr = NULL;
-    cs.refcount = 0;
-    OSEnterCriticalSection(&cs);
-    return cs.thr;
+    (void) sink;
 }
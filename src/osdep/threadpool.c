@@ -0,0 +1,309 @@
+#include "muteki/utils.h"
+#include "osdep/atomic.h"
+#include "osdep/cond.h"
+#include "osdep/heap.h"
+#include "osdep/mutex.h"
+#include "osdep/threading.h"
+#include "osdep/threadpool.h"
+#include "wait.h"
+
+#define FUTURE_PENDING (0u)
+#define FUTURE_WAITING (1u)
+#define FUTURE_DONE (2u)
+
+typedef struct threadpool_job_s threadpool_job_t;
+typedef struct threadpool_lane_s threadpool_lane_t;
+
+struct threadpool_job_s {
+    osdep_threadpool_func_t func;
+    void *user_data;
+    osdep_threadpool_future_t *future;
+};
+
+struct threadpool_lane_s {
+    osdep_threadpool_t *pool;
+    /** Guards everything below. */
+    osdep_mutex_t lock;
+    /** Submitters wait on this while the queue is full. */
+    osdep_cond_t not_full;
+    /** Idle workers park on this. */
+    semaphore_t *work_sem;
+    threadpool_job_t *jobs;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+    size_t count;
+    /** Number of workers parked on ::work_sem. */
+    size_t idle;
+    /** Set when the pool is being destroyed. */
+    bool stopping;
+};
+
+struct osdep_threadpool_s {
+    size_t lanes;
+    /** Number of workers that were started. */
+    size_t workers;
+    /** Posted by each worker right before it exits. */
+    semaphore_t *exit_sem;
+    threadpool_lane_t lane[OSDEP_THREADPOOL_LANES_MAX];
+};
+
+static void threadpool_future_complete(osdep_threadpool_future_t *future, int result) {
+    future->result = result;
+    OSDEP_BARRIER();
+    if (osdep_atomic_swap(&future->state, FUTURE_DONE) == FUTURE_WAITING) {
+        // The waiter doesn't return before the event is set, so the future is still there.
+        OSSetEvent(future->event);
+    }
+}
+
+static wait_result_t threadpool_future_wait_common(osdep_threadpool_future_t *future, bool timed,
+                                                   unsigned int timeout) {
+    if (future->state == FUTURE_DONE) {
+        return WAIT_RESULT_RESOLVED;
+    }
+
+    event_t *event = OSCreateEvent(0, 0);
+    if (event == NULL) {
+        return WAIT_RESULT_ERROR;
+    }
+    future->event = event;
+    OSDEP_BARRIER();
+    if (osdep_atomic_swap(&future->state, FUTURE_WAITING) == FUTURE_DONE) {
+        future->state = FUTURE_DONE;
+        OSCloseEvent(event);
+        return WAIT_RESULT_RESOLVED;
+    }
+
+    // Once the state says we are waiting, the worker will set the event no matter what, so only stop waiting on the
+    // event itself, or when we manage to take the waiting state back before the worker sees it.
+    for (;;) {
+        unsigned int slice = OSDEP_WAIT_MAX;
+        if (timed && timeout < slice) {
+            slice = timeout;
+        }
+        wait_result_t wr = (slice != 0) ? OSWaitForEvent(event, (short) slice) : WAIT_RESULT_TIMEOUT;
+        if (wr == WAIT_RESULT_RESOLVED) {
+            break;
+        }
+        if (!timed) {
+            continue;
+        }
+        timeout -= slice;
+        if (timeout == 0) {
+            if (osdep_atomic_swap(&future->state, FUTURE_PENDING) == FUTURE_WAITING) {
+                OSCloseEvent(event);
+                return WAIT_RESULT_TIMEOUT;
+            }
+            // Finished in the meantime. The event is about to be set.
+            future->state = FUTURE_DONE;
+            timed = false;
+        }
+    }
+
+    OSCloseEvent(event);
+    return WAIT_RESULT_RESOLVED;
+}
+
+static int threadpool_worker(void *user_data) {
+    threadpool_lane_t *lane = user_data;
+    osdep_threadpool_t *pool = lane->pool;
+
+    osdep_mutex_lock(&lane->lock);
+    for (;;) {
+        while (lane->count == 0 && !lane->stopping) {
+            lane->idle++;
+            osdep_mutex_unlock(&lane->lock);
+            OSWaitForSemaphore(lane->work_sem, OSDEP_WAIT_MAX);
+            osdep_mutex_lock(&lane->lock);
+            lane->idle--;
+        }
+        if (lane->count == 0) {
+            break;
+        }
+
+        threadpool_job_t job = lane->jobs[lane->head];
+        if (++lane->head == lane->capacity) {
+            lane->head = 0;
+        }
+        lane->count--;
+        // Submitters only post on the empty to non-empty transition, so jobs queued since then need us to wake up
+        // another worker.
+        if (lane->count != 0 && lane->idle != 0) {
+            OSReleaseSemaphore(lane->work_sem);
+        }
+        osdep_cond_signal(&lane->not_full);
+        osdep_mutex_unlock(&lane->lock);
+
+        int result = job.func(job.user_data);
+        if (job.future != NULL) {
+            threadpool_future_complete(job.future, result);
+        }
+
+        osdep_mutex_lock(&lane->lock);
+    }
+    osdep_mutex_unlock(&lane->lock);
+
+    OSReleaseSemaphore(pool->exit_sem);
+    return 0;
+}
+
+static bool threadpool_submit_common(osdep_threadpool_t *pool, size_t lane_index, osdep_threadpool_func_t func,
+                                     void *user_data, osdep_threadpool_future_t *future, bool wait) {
+    if (lane_index >= pool->lanes || func == NULL) {
+        return false;
+    }
+    threadpool_lane_t *lane = &pool->lane[lane_index];
+
+    if (future != NULL) {
+        future->state = FUTURE_PENDING;
+        future->result = 0;
+        future->event = NULL;
+    }
+
+    osdep_mutex_lock(&lane->lock);
+    while (lane->count == lane->capacity && wait && !lane->stopping) {
+        osdep_cond_wait(&lane->not_full, &lane->lock);
+    }
+    if (lane->count == lane->capacity || lane->stopping) {
+        osdep_mutex_unlock(&lane->lock);
+        return false;
+    }
+
+    threadpool_job_t *job = &lane->jobs[lane->tail];
+    job->func = func;
+    job->user_data = user_data;
+    job->future = future;
+    if (++lane->tail == lane->capacity) {
+        lane->tail = 0;
+    }
+    if (lane->count++ == 0 && lane->idle != 0) {
+        OSReleaseSemaphore(lane->work_sem);
+    }
+    osdep_mutex_unlock(&lane->lock);
+    return true;
+}
+
+osdep_threadpool_t *osdep_threadpool_create(const osdep_threadpool_config_t *config) {
+    if (config->lanes == 0 || config->lanes > OSDEP_THREADPOOL_LANES_MAX) {
+        return NULL;
+    }
+    for (size_t i = 0; i < config->lanes; i++) {
+        const size_t capacity = config->lane[i].capacity;
+        if (config->lane[i].workers == 0 || capacity == 0 || capacity > SIZE_MAX / sizeof(threadpool_job_t)) {
+            return NULL;
+        }
+    }
+
+    osdep_threadpool_t *pool = osdep_heap_alloc(sizeof(osdep_threadpool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->lanes = 0;
+    pool->workers = 0;
+    pool->exit_sem = OSCreateSemaphore(0);
+    if (pool->exit_sem == NULL) {
+        osdep_heap_free(pool);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < config->lanes; i++) {
+        threadpool_lane_t *lane = &pool->lane[i];
+        lane->pool = pool;
+        osdep_mutex_init(&lane->lock, OSDEP_MUTEX_NORMAL);
+        osdep_cond_init(&lane->not_full);
+        lane->capacity = config->lane[i].capacity;
+        lane->head = 0;
+        lane->tail = 0;
+        lane->count = 0;
+        lane->idle = 0;
+        lane->stopping = false;
+        lane->work_sem = OSCreateSemaphore(0);
+        lane->jobs = osdep_heap_alloc(lane->capacity * sizeof(threadpool_job_t));
+        pool->lanes++;
+        if (lane->work_sem == NULL || lane->jobs == NULL) {
+            osdep_threadpool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < config->lanes; i++) {
+        const osdep_threadpool_lane_config_t *lane_config = &config->lane[i];
+        for (size_t j = 0; j < lane_config->workers; j++) {
+            // Move the worker to its slot before it runs anything.
+            thread_t *thr = osdep_thread_create(&threadpool_worker, &pool->lane[i], config->stack_size, true);
+            if (thr == NULL) {
+                osdep_threadpool_destroy(pool);
+                return NULL;
+            }
+            pool->workers++;
+            if (lane_config->slot >= 0 && !OSSetThreadPriority(thr, lane_config->slot)) {
+                WriteComDebugMsg("osdep_threadpool_create: Failed to move worker to slot %d.", lane_config->slot);
+            }
+            OSResumeThread(thr);
+        }
+    }
+
+    return pool;
+}
+
+void osdep_threadpool_destroy(osdep_threadpool_t *pool) {
+    for (size_t i = 0; i < pool->lanes; i++) {
+        threadpool_lane_t *lane = &pool->lane[i];
+        osdep_mutex_lock(&lane->lock);
+        lane->stopping = true;
+        // Workers drain the queue before exiting, so only the idle ones need a kick.
+        for (size_t j = 0; j < lane->idle && lane->work_sem != NULL; j++) {
+            OSReleaseSemaphore(lane->work_sem);
+        }
+        osdep_mutex_unlock(&lane->lock);
+    }
+
+    for (size_t i = 0; i < pool->workers; i++) {
+        while (OSWaitForSemaphore(pool->exit_sem, OSDEP_WAIT_MAX) != WAIT_RESULT_RESOLVED) {
+            // Wait for the remaining jobs to finish.
+        }
+    }
+
+    for (size_t i = 0; i < pool->lanes; i++) {
+        threadpool_lane_t *lane = &pool->lane[i];
+        if (lane->work_sem != NULL) {
+            OSCloseSemaphore(lane->work_sem);
+        }
+        osdep_heap_free(lane->jobs);
+        osdep_cond_destroy(&lane->not_full);
+        osdep_mutex_destroy(&lane->lock);
+    }
+    OSCloseSemaphore(pool->exit_sem);
+    osdep_heap_free(pool);
+}
+
+bool osdep_threadpool_submit(osdep_threadpool_t *pool, size_t lane, osdep_threadpool_func_t func, void *user_data,
+                             osdep_threadpool_future_t *future) {
+    return threadpool_submit_common(pool, lane, func, user_data, future, true);
+}
+
+bool osdep_threadpool_try_submit(osdep_threadpool_t *pool, size_t lane, osdep_threadpool_func_t func, void *user_data,
+                                 osdep_threadpool_future_t *future) {
+    return threadpool_submit_common(pool, lane, func, user_data, future, false);
+}
+
+bool osdep_threadpool_future_is_done(const osdep_threadpool_future_t *future) {
+    return future->state == FUTURE_DONE;
+}
+
+int osdep_threadpool_future_wait(osdep_threadpool_future_t *future) {
+    while (threadpool_future_wait_common(future, false, 0) != WAIT_RESULT_RESOLVED) {
+        // Only fails when the event can't be created. Try again later.
+        OSSleep(1);
+    }
+    return future->result;
+}
+
+wait_result_t osdep_threadpool_future_timedwait(osdep_threadpool_future_t *future, unsigned int timeout, int *result) {
+    wait_result_t wr = threadpool_future_wait_common(future, true, timeout);
+    if (wr == WAIT_RESULT_RESOLVED && result != NULL) {
+        *result = future->result;
+    }
+    return wr;
+}
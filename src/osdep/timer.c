@@ -0,0 +1,418 @@
+#include "muteki/system.h"
+#include "muteki/threading.h"
+#include "osdep/abi.h"
+#include "osdep/atomic.h"
+#include "osdep/mutex.h"
+#include "osdep/threading.h"
+#include "osdep/timer.h"
+#include "wait.h"
+#include <stdarg.h>
+
+#define TIMER_SERVICE_MAGIC (0x71e3b0c5u)
+
+#define TIMER_IDLE (0u)
+#define TIMER_PENDING (1u)
+
+// 4 levels of 64 slots cover 2^24 ticks, which is about 46 hours at the shortest tick. Timers further out than that
+// are parked in the last level and moved again when their slot comes up.
+#define TIMER_LEVEL_BITS (6u)
+#define TIMER_LEVEL_SIZE (1u << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SIZE - 1u)
+#define TIMER_LEVELS (4u)
+#define TIMER_MAX_DELTA ((1u << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1u)
+#define TIMER_BITMAP_WORDS (TIMER_LEVEL_SIZE / 32u)
+
+#define TIMER_SLOT_EXPIRED (TIMER_LEVELS * TIMER_LEVEL_SIZE)
+#define TIMER_SLOT_NONE (0xffffu)
+
+typedef struct {
+    unsigned int magic;
+    /** Guards the wheel and all pending timers. Never taken by the Timer1 callback. */
+    osdep_mutex_t lock;
+    /** Only written by the Timer1 callback. */
+    volatile uint32_t ticks;
+    /** The Timer1 callback wakes up the dispatcher once this tick is reached. */
+    volatile uint32_t wake_at;
+    /** Set when the dispatcher has been woken up and hasn't started processing yet. */
+    volatile uint32_t wake_pending;
+    volatile bool stopping;
+    event_t *event;
+    semaphore_t *exit_sem;
+    timer1_callback_t prev_handler;
+    short prev_interval;
+
+    /** Next tick to process. */
+    uint32_t next;
+    /** Number of timers in the wheel, not counting the expired list. */
+    size_t count;
+    uint32_t bitmap[TIMER_LEVELS][TIMER_BITMAP_WORDS];
+    osdep_timer_node_t slots[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+    /** Timers whose callback is about to run. */
+    osdep_timer_node_t expired;
+    /** Timer whose callback is running on the dispatcher thread. */
+    osdep_timer_t *running;
+} timer_service_t;
+
+static timer_service_t __timer;
+
+static inline void timer_list_init(osdep_timer_node_t *head) {
+    head->prev = head;
+    head->next = head;
+}
+
+static inline bool timer_list_is_empty(const osdep_timer_node_t *head) {
+    return head->next == head;
+}
+
+static inline void timer_list_append(osdep_timer_node_t *head, osdep_timer_node_t *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static inline void timer_list_remove(osdep_timer_node_t *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static inline void timer_bitmap_set(unsigned int level, unsigned int index) {
+    __timer.bitmap[level][index >> 5] |= 1u << (index & 31u);
+}
+
+static inline void timer_bitmap_clear(unsigned int level, unsigned int index) {
+    __timer.bitmap[level][index >> 5] &= ~(1u << (index & 31u));
+}
+
+static void timer_enqueue(osdep_timer_t *timer) {
+    uint32_t expires = timer->expires;
+    uint32_t delta = expires - __timer.next;
+
+    if ((int32_t) delta < 0) {
+        expires = __timer.next;
+        delta = 0;
+    } else if (delta > TIMER_MAX_DELTA) {
+        expires = __timer.next + TIMER_MAX_DELTA;
+        delta = TIMER_MAX_DELTA;
+    }
+
+    unsigned int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (1u << (TIMER_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+    const unsigned int index = (expires >> (TIMER_LEVEL_BITS * level)) & TIMER_LEVEL_MASK;
+
+    timer_list_append(&__timer.slots[level][index], &timer->node);
+    timer_bitmap_set(level, index);
+    timer->slot = level * TIMER_LEVEL_SIZE + index;
+    __timer.count++;
+}
+
+static void timer_unlink(osdep_timer_t *timer) {
+    timer_list_remove(&timer->node);
+    if (timer->slot < TIMER_SLOT_EXPIRED) {
+        const unsigned int level = timer->slot / TIMER_LEVEL_SIZE;
+        const unsigned int index = timer->slot & TIMER_LEVEL_MASK;
+        if (timer_list_is_empty(&__timer.slots[level][index])) {
+            timer_bitmap_clear(level, index);
+        }
+        __timer.count--;
+    }
+    timer->slot = TIMER_SLOT_NONE;
+}
+
+static void timer_cascade(unsigned int level, unsigned int index) {
+    osdep_timer_node_t *head = &__timer.slots[level][index];
+    osdep_timer_node_t *node = head->next;
+
+    // Detach the whole slot first. Timers may land in the same slot again.
+    timer_list_init(head);
+    timer_bitmap_clear(level, index);
+    while (node != head) {
+        osdep_timer_node_t *next = node->next;
+        __timer.count--;
+        timer_enqueue((osdep_timer_t *) node);
+        node = next;
+    }
+}
+
+static void timer_advance(uint32_t until) {
+    while ((int32_t) (until - __timer.next) >= 0) {
+        if (__timer.count == 0) {
+            __timer.next = until + 1;
+            return;
+        }
+
+        const unsigned int index = __timer.next & TIMER_LEVEL_MASK;
+        if (index == 0) {
+            for (unsigned int level = 1; level < TIMER_LEVELS; level++) {
+                const unsigned int upper = (__timer.next >> (TIMER_LEVEL_BITS * level)) & TIMER_LEVEL_MASK;
+                timer_cascade(level, upper);
+                if (upper != 0) {
+                    break;
+                }
+            }
+        }
+
+        osdep_timer_node_t *head = &__timer.slots[0][index];
+        while (!timer_list_is_empty(head)) {
+            osdep_timer_node_t *node = head->next;
+            timer_list_remove(node);
+            timer_list_append(&__timer.expired, node);
+            ((osdep_timer_t *) node)->slot = TIMER_SLOT_EXPIRED;
+            __timer.count--;
+        }
+        timer_bitmap_clear(0, index);
+
+        __timer.next++;
+    }
+}
+
+static int timer_find_slot(const uint32_t *bitmap, unsigned int from) {
+    for (unsigned int w = from >> 5; w < TIMER_BITMAP_WORDS; w++) {
+        uint32_t bits = bitmap[w];
+        if (w == from >> 5) {
+            bits &= ~0u << (from & 31u);
+        }
+        if (bits != 0) {
+            return (int) (w * 32u + (unsigned int) __builtin_ctz(bits));
+        }
+    }
+    return -1;
+}
+
+static uint32_t timer_next_wake(void) {
+    if (__timer.count == 0) {
+        return __timer.next + 0x7fffffffu;
+    }
+
+    // Either the next occupied slot on the first level, or the point where the first level wraps around and the other
+    // levels cascade, whichever comes first.
+    const unsigned int position = __timer.next & TIMER_LEVEL_MASK;
+    const int slot = timer_find_slot(__timer.bitmap[0], position);
+    if (slot >= 0) {
+        return __timer.next + ((unsigned int) slot - position);
+    }
+    return __timer.next + (TIMER_LEVEL_SIZE - position);
+}
+
+static void timer_kick(void) {
+    if ((int32_t) (__timer.ticks - __timer.wake_at) >= 0 && osdep_atomic_swap(&__timer.wake_pending, 1) == 0) {
+        OSSetEvent(__timer.event);
+    }
+}
+
+static void timer_tick(void) {
+    // Keep this short. Everything else happens on the dispatcher thread.
+    __timer.ticks++;
+    timer_kick();
+}
+
+// Called by the kernel, which doesn't keep the stack 8-byte aligned.
+APCS_WRAPPER_STATIC(timer_on_tick, args, void, void) {
+    (void) args;
+    timer_tick();
+}
+
+static void timer_dispatch(void) {
+    osdep_mutex_lock(&__timer.lock);
+
+    do {
+        timer_advance(__timer.ticks);
+        __timer.wake_at = timer_next_wake();
+        OSDEP_BARRIER();
+    } while ((int32_t) (__timer.ticks - __timer.wake_at) >= 0);
+
+    while (!timer_list_is_empty(&__timer.expired)) {
+        osdep_timer_t *timer = (osdep_timer_t *) __timer.expired.next;
+        timer_unlink(timer);
+        if (timer->period != 0) {
+            // Re-arm before running the callback so it can cancel the timer, and so we never touch the timer again
+            // after the callback returns.
+            timer->expires += timer->period;
+            if ((int32_t) (timer->expires - __timer.next) < 0) {
+                timer->expires = __timer.next;
+            }
+            timer_enqueue(timer);
+        } else {
+            timer->state = TIMER_IDLE;
+        }
+
+        osdep_timer_callback_t callback = timer->callback;
+        void *user_data = timer->user_data;
+        __timer.running = timer;
+        osdep_mutex_unlock(&__timer.lock);
+        callback(timer, user_data);
+        osdep_mutex_lock(&__timer.lock);
+        __timer.running = NULL;
+    }
+
+    __timer.wake_at = timer_next_wake();
+    OSDEP_BARRIER();
+    osdep_mutex_unlock(&__timer.lock);
+    timer_kick();
+}
+
+static int timer_dispatcher(void *user_data) {
+    (void) user_data;
+
+    while (!__timer.stopping) {
+        OSWaitForEvent(__timer.event, OSDEP_WAIT_MAX);
+        osdep_atomic_swap(&__timer.wake_pending, 0);
+        if (!__timer.stopping) {
+            timer_dispatch();
+        }
+    }
+
+    OSReleaseSemaphore(__timer.exit_sem);
+    return 0;
+}
+
+bool osdep_timer_service_start(short interval, size_t stack_size) {
+    if (__timer.magic == TIMER_SERVICE_MAGIC || interval <= 0) {
+        return false;
+    }
+
+    osdep_mutex_init(&__timer.lock, OSDEP_MUTEX_NORMAL);
+    __timer.ticks = 0;
+    __timer.next = 1;
+    __timer.count = 0;
+    __timer.wake_at = __timer.next + 0x7fffffffu;
+    __timer.wake_pending = 0;
+    __timer.stopping = false;
+    for (unsigned int level = 0; level < TIMER_LEVELS; level++) {
+        for (unsigned int index = 0; index < TIMER_LEVEL_SIZE; index++) {
+            timer_list_init(&__timer.slots[level][index]);
+        }
+        for (unsigned int w = 0; w < TIMER_BITMAP_WORDS; w++) {
+            __timer.bitmap[level][w] = 0;
+        }
+    }
+    timer_list_init(&__timer.expired);
+    __timer.running = NULL;
+
+    __timer.event = OSCreateEvent(0, 0);
+    __timer.exit_sem = OSCreateSemaphore(0);
+    if (__timer.event == NULL || __timer.exit_sem == NULL) {
+        goto fail;
+    }
+    if (osdep_thread_create(&timer_dispatcher, NULL, stack_size, false) == NULL) {
+        goto fail;
+    }
+
+    __timer.magic = TIMER_SERVICE_MAGIC;
+    __timer.prev_handler = GetTimer1IntHandler(&__timer.prev_interval);
+    SetTimer1IntHandler(&timer_on_tick, interval);
+    return true;
+
+fail:
+    if (__timer.event != NULL) {
+        OSCloseEvent(__timer.event);
+    }
+    if (__timer.exit_sem != NULL) {
+        OSCloseSemaphore(__timer.exit_sem);
+    }
+    osdep_mutex_destroy(&__timer.lock);
+    return false;
+}
+
+void osdep_timer_service_stop(void) {
+    if (__timer.magic != TIMER_SERVICE_MAGIC) {
+        return;
+    }
+
+    SetTimer1IntHandler(__timer.prev_handler, __timer.prev_interval);
+    __timer.stopping = true;
+    OSDEP_BARRIER();
+    OSSetEvent(__timer.event);
+    while (OSWaitForSemaphore(__timer.exit_sem, OSDEP_WAIT_MAX) != WAIT_RESULT_RESOLVED) {
+        // Wait for the callback currently running to return.
+    }
+
+    osdep_mutex_lock(&__timer.lock);
+    __timer.magic = 0;
+    for (unsigned int level = 0; level < TIMER_LEVELS; level++) {
+        for (unsigned int index = 0; index < TIMER_LEVEL_SIZE; index++) {
+            osdep_timer_node_t *head = &__timer.slots[level][index];
+            while (!timer_list_is_empty(head)) {
+                osdep_timer_t *timer = (osdep_timer_t *) head->next;
+                timer_unlink(timer);
+                timer->state = TIMER_IDLE;
+            }
+        }
+    }
+    while (!timer_list_is_empty(&__timer.expired)) {
+        osdep_timer_t *timer = (osdep_timer_t *) __timer.expired.next;
+        timer_unlink(timer);
+        timer->state = TIMER_IDLE;
+    }
+    osdep_mutex_unlock(&__timer.lock);
+
+    OSCloseEvent(__timer.event);
+    OSCloseSemaphore(__timer.exit_sem);
+    osdep_mutex_destroy(&__timer.lock);
+}
+
+uint32_t osdep_timer_now(void) {
+    return __timer.ticks;
+}
+
+void osdep_timer_init(osdep_timer_t *timer, osdep_timer_callback_t callback, void *user_data) {
+    timer->node.prev = NULL;
+    timer->node.next = NULL;
+    timer->expires = 0;
+    timer->period = 0;
+    timer->callback = callback;
+    timer->user_data = user_data;
+    timer->slot = TIMER_SLOT_NONE;
+    timer->state = TIMER_IDLE;
+}
+
+bool osdep_timer_arm(osdep_timer_t *timer, uint32_t delay, uint32_t period) {
+    if (__timer.magic != TIMER_SERVICE_MAGIC || timer->callback == NULL) {
+        return false;
+    }
+
+    osdep_mutex_lock(&__timer.lock);
+    if (timer->state == TIMER_PENDING) {
+        timer_unlink(timer);
+    }
+    const uint32_t now = __timer.ticks;
+    if (__timer.count == 0) {
+        // Nothing to catch up on, so don't make the dispatcher walk through all the ticks since it last ran.
+        __timer.next = now + 1;
+    }
+    timer->expires = now + delay;
+    timer->period = period;
+    timer_enqueue(timer);
+    timer->state = TIMER_PENDING;
+    __timer.wake_at = timer_next_wake();
+    OSDEP_BARRIER();
+    osdep_mutex_unlock(&__timer.lock);
+
+    timer_kick();
+    return true;
+}
+
+bool osdep_timer_cancel(osdep_timer_t *timer) {
+    if (__timer.magic != TIMER_SERVICE_MAGIC) {
+        return false;
+    }
+
+    osdep_mutex_lock(&__timer.lock);
+    const bool was_pending = timer->state == TIMER_PENDING;
+    if (was_pending) {
+        timer_unlink(timer);
+        timer->state = TIMER_IDLE;
+    }
+    // Periodic timers are pending again while their callback runs, so that alone doesn't mean the timer is unused.
+    const bool is_running = (__timer.running == timer);
+    osdep_mutex_unlock(&__timer.lock);
+    return was_pending && !is_running;
+}
+
+bool osdep_timer_is_pending(const osdep_timer_t *timer) {
+    return timer->state == TIMER_PENDING;
+}
@@ -0,0 +1,197 @@
+#include "muteki/threading.h"
+#include "muteki/utils.h"
+#include "osdep/heap.h"
+#include "osdep/threading.h"
+#include "osdep/tsd.h"
+#include "osdep/utls.h"
+
+typedef struct tsd_slot_s tsd_slot_t;
+typedef struct tsd_array_s tsd_array_t;
+typedef struct tsd_key_s tsd_key_t;
+
+#define TSD_HEADER_MAGIC (0x75d0c3a1u)
+// Value arrays grow in steps of this many slots.
+#define TSD_ARRAY_STEP (8u)
+
+struct tsd_key_s {
+    /** Bumped every time the key is allocated, so values set before the key was deleted stop matching. Never 0. */
+    uint32_t seq;
+    bool is_used;
+    osdep_tsd_destructor_t destructor;
+};
+
+struct tsd_slot_s {
+    void *value;
+    /** tsd_key_t::seq of the key when the value was set. */
+    uint32_t seq;
+};
+
+struct tsd_array_s {
+    size_t capacity;
+    tsd_slot_t slots[];
+};
+
+typedef struct {
+    unsigned int magic;
+    critical_section_t cs;
+    tsd_key_t keys[OSDEP_TSD_KEYS_MAX];
+} tsd_container_t;
+
+static tsd_container_t __tsd;
+
+static inline tsd_array_t **tsd_array_ref(void *tls) {
+    // Word 0 of the UTLS TCB.
+    return (tsd_array_t **) tls;
+}
+
+void osdep_tsd_run_destructors(void *tls) {
+    if (tls == NULL || *tsd_array_ref(tls) == NULL) {
+        return;
+    }
+
+    // Destructors may call osdep_tsd_get() and osdep_tsd_set(), which must reach the values being destroyed rather
+    // than those of the calling thread, so install the TLS space on the calling thread while they run.
+    thread_t *self = osdep_thread_get_current();
+    void *prev = osdep_utls_self();
+    if (prev != tls) {
+        osdep_utls_switch(self, tls);
+    }
+
+    for (unsigned int pass = 0; pass < OSDEP_TSD_DESTRUCTOR_ITERATIONS; pass++) {
+        bool called = false;
+        // Destructors may set values, which may grow the array, so reload it on every slot.
+        for (size_t i = 0; i < (*tsd_array_ref(tls))->capacity; i++) {
+            tsd_slot_t *slot = &(*tsd_array_ref(tls))->slots[i];
+            const tsd_key_t *key = &__tsd.keys[i];
+            if (slot->value == NULL || !key->is_used || slot->seq != key->seq || key->destructor == NULL) {
+                continue;
+            }
+            void *value = slot->value;
+            slot->value = NULL;
+            key->destructor(value);
+            called = true;
+        }
+        if (!called) {
+            break;
+        }
+    }
+
+    osdep_heap_free(*tsd_array_ref(tls));
+    *tsd_array_ref(tls) = NULL;
+
+    if (prev != tls) {
+        // Go back through the dict rather than pinning the own TLS space of the thread as a switched one.
+        osdep_utls_switch(self, (prev == osdep_utls_peek(self)) ? NULL : prev);
+    }
+}
+
+static void tsd_on_thread_exit(thread_t *thr) {
+    void *tls = osdep_utls_peek(thr);
+    if (tls == NULL) {
+        return;
+    }
+    osdep_tsd_run_destructors(tls);
+}
+
+static void tsd_cinit(void) {
+    if (__tsd.magic != TSD_HEADER_MAGIC) {
+        // UTLS must register its exit hook first so ours runs before it frees the TLS space.
+        osdep_utls_cinit();
+        OSInitCriticalSection(&__tsd.cs);
+        __tsd.magic = TSD_HEADER_MAGIC;
+        if (!osdep_thread_add_exit_hook(&tsd_on_thread_exit)) {
+            WriteComDebugMsg("tsd_cinit: Failed to register exit hook. Destructors will not be called.");
+        }
+    }
+}
+
+bool osdep_tsd_key_create(osdep_tsd_key_t *key, osdep_tsd_destructor_t destructor) {
+    tsd_cinit();
+
+    OSEnterCriticalSection(&__tsd.cs);
+    for (size_t i = 0; i < OSDEP_TSD_KEYS_MAX; i++) {
+        tsd_key_t *k = &__tsd.keys[i];
+        if (!k->is_used) {
+            k->seq++;
+            if (k->seq == 0) {
+                k->seq++;
+            }
+            k->destructor = destructor;
+            k->is_used = true;
+            OSLeaveCriticalSection(&__tsd.cs);
+            *key = i;
+            return true;
+        }
+    }
+    OSLeaveCriticalSection(&__tsd.cs);
+    return false;
+}
+
+bool osdep_tsd_key_delete(osdep_tsd_key_t key) {
+    if (key >= OSDEP_TSD_KEYS_MAX || __tsd.magic != TSD_HEADER_MAGIC) {
+        return false;
+    }
+
+    OSEnterCriticalSection(&__tsd.cs);
+    tsd_key_t *k = &__tsd.keys[key];
+    bool was_used = k->is_used;
+    k->is_used = false;
+    k->destructor = NULL;
+    OSLeaveCriticalSection(&__tsd.cs);
+    return was_used;
+}
+
+void *osdep_tsd_get(osdep_tsd_key_t key) {
+    if (key >= OSDEP_TSD_KEYS_MAX) {
+        return NULL;
+    }
+
+    void *tls = osdep_utls_self();
+    if (tls == NULL) {
+        return NULL;
+    }
+    const tsd_array_t *array = *tsd_array_ref(tls);
+    if (array == NULL || key >= array->capacity) {
+        return NULL;
+    }
+
+    const tsd_slot_t *slot = &array->slots[key];
+    if (slot->seq != __tsd.keys[key].seq) {
+        return NULL;
+    }
+    return slot->value;
+}
+
+bool osdep_tsd_set(osdep_tsd_key_t key, const void *value) {
+    if (key >= OSDEP_TSD_KEYS_MAX || !__tsd.keys[key].is_used) {
+        return false;
+    }
+
+    void *tls = osdep_utls_self();
+    if (tls == NULL) {
+        return false;
+    }
+    tsd_array_t *array = *tsd_array_ref(tls);
+
+    if (array == NULL || key >= array->capacity) {
+        size_t old_capacity = (array == NULL) ? 0 : array->capacity;
+        size_t capacity = (key + TSD_ARRAY_STEP) & (~((size_t) TSD_ARRAY_STEP - 1));
+        if (capacity > OSDEP_TSD_KEYS_MAX) {
+            capacity = OSDEP_TSD_KEYS_MAX;
+        }
+        array = osdep_heap_realloc(array, sizeof(tsd_array_t) + capacity * sizeof(tsd_slot_t));
+        if (array == NULL) {
+            return false;
+        }
+        for (size_t i = old_capacity; i < capacity; i++) {
+            array->slots[i].value = NULL;
+            array->slots[i].seq = 0;
+        }
+        array->capacity = capacity;
+        *tsd_array_ref(tls) = array;
+    }
+
+    array->slots[key].value = (void *) value;
+    array->slots[key].seq = __tsd.keys[key].seq;
+    return true;
+}
@@ -1,27 +1,70 @@
 #include "muteki/threading.h"
 #include "muteki/utils.h"
 #include "osdep/heap.h"
+#include "osdep/ktls.h"
+#include "osdep/memops.h"
+#include "osdep/mutex.h"
 #include "osdep/threading.h"
 #include "osdep/utls.h"
+#include "clock.h"
+#include "thread_svc.h"
 
 typedef struct utls_container_s utls_container_t;
 typedef struct utls_element_s utls_element_t;
 typedef struct utls_key_s utls_key_t;
 typedef struct utls_dict_s utls_dict_t;
+typedef struct utls_pool_s utls_pool_t;
 
 #define UTLS_INIT_SHIFT (4u)
 #define UTLS_HEADER_MAGIC (0xb0ee6f5bu)
+// Marks a slot whose element was removed. Lookups keep probing past it while insertions may reuse it.
+#define UTLS_TOMBSTONE ((const thread_t *) 1)
+// Insertions never probe further than this many slots. The dict is grown instead.
+#define UTLS_PROBE_LIMIT (8u)
+// thread_t::magic of a live thread.
+#define UTLS_THREAD_MAGIC (0x100)
+// tbss regions at least this large are allocated pre-zeroed with lcalloc() instead of being cleared afterwards.
+#define UTLS_CALLOC_TBSS_SIZE (256u)
 
 struct utls_dict_s {
     size_t size_shift;
     size_t used;
+    size_t tombstones;
+    /** Longest probe sequence of any element in the dict. Lookups never need to probe further than this. */
+    size_t max_probe;
     utls_element_t *elements;
 };
 
+struct utls_pool_s {
+    /** Next pool. */
+    utls_pool_t *next;
+    /** First block. */
+    uint8_t *start;
+    /** End of the last block. */
+    uint8_t *end;
+    /** Singly-linked list of free blocks, threaded through the first word of each block. */
+    void *free_list;
+    size_t blocks;
+    size_t blocks_free;
+};
+
 struct utls_container_s {
     unsigned int magic;
+    /**
+     * Bumped every time the container is destroyed or a sweep frees blocks, so blocks cached in KTLS before that stop
+     * matching.
+     */
+    uint32_t generation;
     utls_dict_t dict;
-    critical_section_t cs;
+    /** The dict is never shrunk below this size. Set by osdep_utls_reserve(). */
+    size_t min_size_shift;
+    /** Pools of preallocated TLS blocks. */
+    utls_pool_t *pools;
+    /** Descriptor of the pool defined by OSDEP_UTLS_STATIC_TABLE(), if any. */
+    utls_pool_t static_pool;
+    /** Set while the table defined by OSDEP_UTLS_STATIC_TABLE() is used by the dict. */
+    bool is_static_table_used;
+    osdep_mutex_t lock;
 };
 
 struct utls_key_s {
@@ -35,16 +78,90 @@ struct utls_element_s {
     void *value;
 };
 
+extern uint8_t __tdata_start;
+extern uint8_t __tdata_end;
+extern uint8_t __tbss_start;
+extern uint8_t __tbss_end;
+
+// Defined by OSDEP_UTLS_STATIC_TABLE(). These are NULL when the application does not use it.
+extern uintptr_t __osdep_utls_static_table[] __attribute__((weak));
+extern const size_t __osdep_utls_static_table_shift __attribute__((weak));
+extern uint64_t __osdep_utls_static_pool[] __attribute__((weak));
+extern const size_t __osdep_utls_static_pool_size __attribute__((weak));
+
+_Static_assert(
+    sizeof(utls_element_t) == OSDEP_UTLS_ELEMENT_WORDS * sizeof(uintptr_t),
+    "OSDEP_UTLS_ELEMENT_WORDS does not match utls_element_t."
+);
+
 static utls_container_t __utls;
 
+#ifdef OSDEP_UTLS_STATS
+typedef struct {
+    osdep_utls_clock_t clock;
+    uint32_t read_tp_calls;
+    uint32_t read_tp_misses;
+    uint32_t lock_acquisitions;
+    uint32_t lock_contentions;
+    uint32_t first_touches;
+    uint32_t first_touch_bytes;
+    uint32_t first_touch_time;
+    uint32_t rebuilds;
+    uint32_t growths;
+    uint32_t rebuild_elements_moved;
+    uint32_t rebuild_time;
+} utls_counters_t;
+
+// Kept outside of the container so the counters survive osdep_utls_cfini().
+static utls_counters_t __utls_counters;
+
+#define UTLS_COUNT(field, n) (__utls_counters.field += (n))
+
+static inline uint32_t utls_clock(void) {
+    return (__utls_counters.clock != NULL) ? __utls_counters.clock() : 0;
+}
+#else
+#define UTLS_COUNT(field, n) ((void) 0)
+#endif
+
+static inline void utls_lock(void) {
+#ifdef OSDEP_UTLS_STATS
+    // Nothing in this module takes the lock recursively, so a held lock means another thread has it.
+    if (__utls.lock.state != 0) {
+        UTLS_COUNT(lock_contentions, 1);
+    }
+    UTLS_COUNT(lock_acquisitions, 1);
+#endif
+    osdep_mutex_lock(&__utls.lock);
+}
+
+static inline void utls_unlock(void) {
+    osdep_mutex_unlock(&__utls.lock);
+}
+
+static inline uintptr_t utls_cache_salt(void) {
+    // Every module has its own container, so the address also keeps modules from picking up each other's blocks.
+    return ((uintptr_t) &__utls) ^ __utls.generation;
+}
+
+static inline uintptr_t utls_switch_salt(void) {
+    // Blocks installed by osdep_utls_switch() are owned by the caller and never freed by a sweep, so they don't need
+    // to go stale when the generation changes.
+    return ((uintptr_t) &__utls.pools);
+}
+
 static uint32_t murmur2(const void *key, size_t len, uint32_t seed);
 static inline size_t rebuild_threshold(size_t current_shift);
-static void osdep_utls_dict_init(utls_dict_t *dict, size_t desired_size_shift);
+static bool osdep_utls_dict_init(utls_dict_t *dict, size_t desired_size_shift);
 static void osdep_utls_dict_fini(utls_dict_t *dict);
-static void osdep_utls_dict_grow(utls_dict_t *dict);
-static utls_element_t *osdep_utls_dict_lookup(const utls_dict_t *dict, const utls_key_t *key, bool find_empty);
+static utls_element_t *osdep_utls_dict_find_free(const utls_dict_t *dict, const utls_key_t *key, size_t *probe);
+static bool osdep_utls_dict_rebuild(utls_dict_t *dict, size_t size_shift);
+static utls_element_t *osdep_utls_dict_lookup(const utls_dict_t *dict, const utls_key_t *key);
 static void *osdep_utls_dict_get(const utls_dict_t *dict, const utls_key_t *key);
-static void *osdep_utls_dict_alloc_and_set(utls_dict_t *dict, const utls_key_t *key, size_t alloc_size);
+static void *osdep_utls_dict_alloc_and_set(utls_dict_t *dict, const utls_key_t *key, size_t alloc_size, bool *zeroed);
+static void *osdep_utls_dict_remove(utls_dict_t *dict, const utls_key_t *key);
+static size_t osdep_utls_dict_sweep(utls_dict_t *dict);
+static void osdep_utls_dict_shrink(utls_dict_t *dict);
 
 /**
  * @brief MurmurHash 2
@@ -119,141 +236,487 @@ static inline size_t dict_size(size_t shift) {
     return 1 << shift;
 }
 
-static void osdep_utls_dict_init(utls_dict_t *dict, size_t desired_size_shift) {
+static inline bool element_is_free(const utls_element_t *element) {
+    return element->key.desc == NULL || element->key.desc == UTLS_TOMBSTONE;
+}
+
+static inline size_t dict_hint(const utls_dict_t *dict, const utls_key_t *key) {
+    return murmur2(key, sizeof(*key), UTLS_HEADER_MAGIC) & (dict_size(dict->size_shift) - 1);
+}
+
+static void utls_free_elements(utls_element_t *elements) {
+    if (elements == (utls_element_t *) __osdep_utls_static_table) {
+        __utls.is_static_table_used = false;
+        return;
+    }
+    osdep_heap_free(elements);
+}
+
+static inline size_t utls_block_size(void) {
+    return (&__tdata_end - &__tdata_start) + (&__tbss_end - &__tbss_start) + 8;
+}
+
+static inline size_t utls_block_stride(void) {
+    return (utls_block_size() + 7u) & (~((size_t) 7u));
+}
+
+/**
+ * @brief Format a pool and add it to the container.
+ *
+ * @param pool The pool descriptor.
+ * @param mem Memory for the blocks. Must be 8-bytes aligned.
+ * @param size Size of `mem`.
+ * @x_void_return
+ */
+static void utls_pool_add(utls_pool_t *pool, void *mem, size_t size) {
+    const size_t stride = utls_block_stride();
+    pool->start = mem;
+    pool->end = pool->start;
+    pool->free_list = NULL;
+    pool->blocks = 0;
+
+    void **tail = &pool->free_list;
+    for (; ((size_t) (pool->end - pool->start)) + stride <= size; pool->end += stride) {
+        *tail = pool->end;
+        tail = (void **) pool->end;
+        pool->blocks++;
+    }
+    *tail = NULL;
+    pool->blocks_free = pool->blocks;
+
+    pool->next = __utls.pools;
+    __utls.pools = pool;
+}
+
+static size_t utls_pool_count_free(void) {
+    size_t blocks_free = 0;
+    for (utls_pool_t *pool = __utls.pools; pool != NULL; pool = pool->next) {
+        blocks_free += pool->blocks_free;
+    }
+    return blocks_free;
+}
+
+/**
+ * @brief Allocate a TLS block.
+ *
+ * @param size Size of the block.
+ * @param[out] zeroed Set to true when the whole block is known to be zero-filled.
+ * @return The block, or NULL if allocation fails.
+ */
+static void *utls_block_alloc(size_t size, bool *zeroed) {
+    *zeroed = false;
+    if (size <= utls_block_stride()) {
+        for (utls_pool_t *pool = __utls.pools; pool != NULL; pool = pool->next) {
+            void *block = pool->free_list;
+            if (block != NULL) {
+                pool->free_list = *((void **) block);
+                pool->blocks_free--;
+                return block;
+            }
+        }
+    }
+    if ((size_t) (&__tbss_end - &__tbss_start) >= UTLS_CALLOC_TBSS_SIZE) {
+        void *block = osdep_heap_calloc(1, size);
+        *zeroed = (block != NULL);
+        return block;
+    }
+    return osdep_heap_alloc(size);
+}
+
+static void utls_block_free(void *block) {
+    // TCB word 0 is the value array of tsd.c. Threads that didn't run the exit hooks still have it around.
+    void *tsd = ((void **) block)[0];
+    if (tsd != NULL) {
+        osdep_heap_free(tsd);
+    }
+
+    for (utls_pool_t *pool = __utls.pools; pool != NULL; pool = pool->next) {
+        if (((uint8_t *) block) >= pool->start && ((uint8_t *) block) < pool->end) {
+            *((void **) block) = pool->free_list;
+            pool->free_list = block;
+            pool->blocks_free++;
+            return;
+        }
+    }
+    osdep_heap_free(block);
+}
+
+/**
+ * @brief Fill a freshly allocated TLS block with its initial contents.
+ *
+ * @param block The block.
+ * @param zeroed Whether the block is known to be zero-filled already.
+ */
+static void utls_block_init(void *block, bool zeroed) {
+    size_t tdata_size = &__tdata_end - &__tdata_start;
+    size_t tbss_size = &__tbss_end - &__tbss_start;
+    uint8_t *tdata_base = ((uint8_t *) block) + 8;
+    uint8_t *tbss_base = tdata_base + tdata_size;
+
+    ((uint32_t *) block)[0] = 0;
+    ((uint32_t *) block)[1] = 0;
+    if (tdata_size != 0) {
+        osdep_memops_copy(tdata_base, &__tdata_start, tdata_size);
+    }
+    if (tbss_size != 0 && !zeroed) {
+        osdep_memops_zero(tbss_base, tbss_size);
+    }
+}
+
+static bool osdep_utls_dict_init(utls_dict_t *dict, size_t desired_size_shift) {
     if (desired_size_shift == 0) {
         desired_size_shift = UTLS_INIT_SHIFT;
     }
     size_t desired_size_nmemb = dict_size(desired_size_shift);
+    if (
+        &__osdep_utls_static_table_shift != NULL &&
+        desired_size_shift == __osdep_utls_static_table_shift &&
+        !__utls.is_static_table_used
+    ) {
+        dict->elements = (utls_element_t *) __osdep_utls_static_table;
+        __utls.is_static_table_used = true;
+    } else {
+        dict->elements = osdep_heap_alloc(sizeof(utls_element_t) * desired_size_nmemb);
+    }
+    if (dict->elements == NULL) {
+        dict->size_shift = 0;
+        dict->used = 0;
+        dict->tombstones = 0;
+        dict->max_probe = 0;
+        return false;
+    }
     dict->size_shift = desired_size_shift;
     dict->used = 0;
-    dict->elements = osdep_heap_alloc(sizeof(utls_element_t) * desired_size_nmemb);
+    dict->tombstones = 0;
+    dict->max_probe = 0;
     for (size_t i = 0; i < desired_size_nmemb; i++) {
         dict->elements[i].key.desc = NULL;
         dict->elements[i].value = NULL;
     }
+    return true;
 }
 
 static void osdep_utls_dict_fini(utls_dict_t *dict) {
+    if (dict->elements == NULL) {
+        return;
+    }
     for (size_t i = 0; i < dict_size(dict->size_shift); i++) {
-        if (dict->elements[i].key.desc != NULL) {
-            osdep_heap_free(dict->elements[i].value);
-            dict->elements[i].value = NULL;
-            dict->elements[i].key.desc = NULL;
-            dict->elements[i].key.stack_mem = NULL;
-            dict->elements[i].key.thread_func = NULL;
+        if (!element_is_free(&dict->elements[i])) {
+            utls_block_free(dict->elements[i].value);
         }
+        dict->elements[i].value = NULL;
+        dict->elements[i].key.desc = NULL;
+        dict->elements[i].key.stack_mem = NULL;
+        dict->elements[i].key.thread_func = NULL;
     }
-    osdep_heap_free(dict->elements);
+    utls_free_elements(dict->elements);
     dict->elements = NULL;
     dict->size_shift = 0;
     dict->used = 0;
+    dict->tombstones = 0;
+    dict->max_probe = 0;
+}
+
+/**
+ * @brief Find a free slot for a key that is not in the dict yet.
+ *
+ * @param dict The dict.
+ * @param key The key.
+ * @param probe Output. Length of the probe sequence that led to the slot.
+ * @return The free slot (empty or tombstone), or `NULL` if there's none within #UTLS_PROBE_LIMIT slots.
+ */
+static utls_element_t *osdep_utls_dict_find_free(const utls_dict_t *dict, const utls_key_t *key, size_t *probe) {
+    const size_t size = dict_size(dict->size_shift);
+    const size_t limit = (size < UTLS_PROBE_LIMIT) ? size : UTLS_PROBE_LIMIT;
+    const size_t hint_index = dict_hint(dict, key);
+
+    for (size_t i = 0; i < limit; i++) {
+        utls_element_t *element = &dict->elements[(hint_index + i) & (size - 1)];
+        if (element_is_free(element)) {
+            *probe = i + 1;
+            return element;
+        }
+    }
+    return NULL;
 }
 
-static void osdep_utls_dict_grow(utls_dict_t *dict) {
+/**
+ * @brief Rebuild the dict with a new size, dropping all tombstones.
+ * @details The size is increased further when some element would not fit within #UTLS_PROBE_LIMIT slots.
+ *
+ * @param dict The dict.
+ * @param size_shift Log2 of the minimum new size.
+ * @retval true @x_term ok
+ * @retval false @x_term ng
+ */
+static bool osdep_utls_dict_rebuild(utls_dict_t *dict, size_t size_shift) {
     utls_dict_t tmp;
 
-    size_t old_size_nmemb = dict_size(dict->size_shift);
+    const size_t old_size_nmemb = (dict->elements != NULL) ? dict_size(dict->size_shift) : 0;
+#ifdef OSDEP_UTLS_STATS
+    const uint32_t start = utls_clock();
+    UTLS_COUNT(rebuilds, 1);
+    if (size_shift > dict->size_shift) {
+        UTLS_COUNT(growths, 1);
+    }
+    UTLS_COUNT(rebuild_elements_moved, dict->used);
+#endif
+
+    for (; size_shift < sizeof(size_t) * 8 - 1; size_shift++) {
+        if (!osdep_utls_dict_init(&tmp, size_shift)) {
+            WriteComDebugMsg("osdep_utls_dict_rebuild: Failed to allocate memory.");
+            return false;
+        }
+
+        size_t i = 0;
+        for (; i < old_size_nmemb; i++) {
+            const utls_element_t *old = &dict->elements[i];
+            if (element_is_free(old)) {
+                continue;
+            }
+            size_t probe;
+            utls_element_t *element = osdep_utls_dict_find_free(&tmp, &old->key, &probe);
+            if (element == NULL) {
+                break;
+            }
+            *element = *old;
+            tmp.used++;
+            if (probe > tmp.max_probe) {
+                tmp.max_probe = probe;
+            }
+        }
 
-    osdep_utls_dict_init(&tmp, dict->size_shift + 1);
-    for (size_t i = 0; i < old_size_nmemb; i++) {
-        if (dict->elements[i].key.desc != NULL) {
-            utls_element_t *element = osdep_utls_dict_lookup(dict, &dict->elements[i].key, true);
-            if (element == NULL || element->key.desc != NULL) {
-                WriteComDebugMsg("Failed to grow dict.");
-                osdep_heap_free(tmp.elements);
-                return;
+        if (i == old_size_nmemb) {
+            if (dict->elements != NULL) {
+                utls_free_elements(dict->elements);
             }
-            element->key.desc = dict->elements[i].key.desc;
-            element->key.stack_mem = dict->elements[i].key.stack_mem;
-            element->key.thread_func = dict->elements[i].key.thread_func;
-            element->value = dict->elements[i].value;
+            *dict = tmp;
+            UTLS_COUNT(rebuild_time, utls_clock() - start);
+            return true;
         }
+
+        // Too many collisions. Try again with a larger table.
+        utls_free_elements(tmp.elements);
     }
-    osdep_heap_free(dict->elements);
-    dict->elements = tmp.elements;
-    dict->used = tmp.used;
-    dict->size_shift = tmp.size_shift;
+
+    UTLS_COUNT(rebuild_time, utls_clock() - start);
+    return false;
 }
 
-static utls_element_t *osdep_utls_dict_lookup(const utls_dict_t *dict, const utls_key_t *key, bool find_empty) {
+static utls_element_t *osdep_utls_dict_lookup(const utls_dict_t *dict, const utls_key_t *key) {
     const size_t size = dict_size(dict->size_shift);
-    const size_t hint_index = murmur2(key, sizeof(*key), UTLS_HEADER_MAGIC) & (size - 1);
+    const size_t hint_index = dict_hint(dict, key);
 
-    for (size_t i = 0; i < size; i++) {
-        size_t current_index = (hint_index + i) & (size - 1);
-        // Skip not allocated elements
-        if (dict->elements[current_index].key.desc == NULL) {
-            continue;
+    // No element was ever inserted further than max_probe slots from its hint, so there's no need to look further.
+    for (size_t i = 0; i < dict->max_probe; i++) {
+        utls_element_t *element = &dict->elements[(hint_index + i) & (size - 1)];
+        // The key would have been inserted here if it was in the dict.
+        if (element->key.desc == NULL) {
+            return NULL;
         }
-        // Exact match
         if (
-            dict->elements[current_index].key.desc == key->desc &&
-            dict->elements[current_index].key.stack_mem == key->stack_mem &&
-            dict->elements[current_index].key.thread_func == key->thread_func
+            element->key.desc == key->desc &&
+            element->key.stack_mem == key->stack_mem &&
+            element->key.thread_func == key->thread_func
         ) {
-            return &dict->elements[current_index];
+            return element;
         }
     }
 
-    if (find_empty) {
-        for (size_t i = 0; i < size; i++) {
-            size_t current_index = (hint_index + i) & (size - 1);
-            if (dict->elements[current_index].key.desc == NULL) {
-                return &dict->elements[current_index];
-            }
-        }
-    }
-
-    // No match after scanning the entire bucket
     return NULL;
 }
 
 // Temporarily disabling inlining here to workaround a potential instruction reordering issue.
 __attribute__((noinline))
 static void *osdep_utls_dict_get(const utls_dict_t *dict, const utls_key_t *key) {
-    utls_element_t *e = osdep_utls_dict_lookup(dict, key, false);
+    utls_element_t *e = osdep_utls_dict_lookup(dict, key);
     if (e == NULL) {
         return NULL;
     }
     return e->value;
 }
 
-static void *osdep_utls_dict_alloc_and_set(utls_dict_t *dict, const utls_key_t *key, size_t alloc_size) {
+static void *osdep_utls_dict_alloc_and_set(utls_dict_t *dict, const utls_key_t *key, size_t alloc_size, bool *zeroed) {
     if (alloc_size == 0) {
         return NULL;
     }
 
-    if (rebuild_threshold(dict->size_shift) <= dict->used) {
-        osdep_utls_dict_grow(dict);
+    utls_element_t *element = osdep_utls_dict_lookup(dict, key);
+    if (element != NULL) {
+        return element->value;
     }
 
-    utls_element_t *element = osdep_utls_dict_lookup(dict, key, true);
-    if (element == NULL) {
-        WriteComDebugMsg("osdep_utls_dict_alloc_and_set: Failed to find empty slot.");
+    // Tombstones take up slots just like live elements as far as probing is concerned, so count them towards the load
+    // factor. Only grow when the live elements alone fill half of the dict, otherwise just clean up the tombstones.
+    // Threads that exited without running the exit hooks are reclaimed first so they don't make the dict grow.
+    size_t probe = 0;
+    if (rebuild_threshold(dict->size_shift) <= dict->used + dict->tombstones) {
+        osdep_utls_dict_sweep(dict);
+        size_t size_shift = dict->size_shift;
+        if ((dict_size(size_shift) >> 1) <= dict->used) {
+            size_shift++;
+        }
+        osdep_utls_dict_rebuild(dict, size_shift);
+    }
+    if (dict->elements == NULL) {
         return NULL;
     }
-    if (element->key.desc == NULL) {
-        void *buf = osdep_heap_alloc(alloc_size);
-        if (buf == NULL) {
-            WriteComDebugMsg("osdep_utls_dict_alloc_and_set: Failed to allocate memory.");
+    element = osdep_utls_dict_find_free(dict, key, &probe);
+    if (element == NULL) {
+        if (!osdep_utls_dict_rebuild(dict, dict->size_shift + 1)) {
             return NULL;
         }
-        element->key.desc = key->desc;
-        element->key.stack_mem = key->stack_mem;
-        element->key.thread_func = key->thread_func;
-        element->value = buf;
-        dict->used++;
+        element = osdep_utls_dict_find_free(dict, key, &probe);
+        if (element == NULL) {
+            WriteComDebugMsg("osdep_utls_dict_alloc_and_set: Failed to find empty slot.");
+            return NULL;
+        }
+    }
+
+    void *buf = utls_block_alloc(alloc_size, zeroed);
+    if (buf == NULL) {
+        WriteComDebugMsg("osdep_utls_dict_alloc_and_set: Failed to allocate memory.");
+        return NULL;
+    }
+    if (element->key.desc == UTLS_TOMBSTONE) {
+        dict->tombstones--;
+    }
+    element->key.desc = key->desc;
+    element->key.stack_mem = key->stack_mem;
+    element->key.thread_func = key->thread_func;
+    element->value = buf;
+    dict->used++;
+    if (probe > dict->max_probe) {
+        dict->max_probe = probe;
+    }
+    return buf;
+}
+
+/**
+ * @brief Remove a key from the dict.
+ *
+ * @param dict The dict.
+ * @param key The key.
+ * @return The value that was associated with the key, or `NULL` if the key was not in the dict.
+ */
+static void *osdep_utls_dict_remove(utls_dict_t *dict, const utls_key_t *key) {
+    utls_element_t *element = osdep_utls_dict_lookup(dict, key);
+    if (element == NULL) {
+        return NULL;
+    }
+
+    void *value = element->value;
+    const size_t size = dict_size(dict->size_shift);
+    const utls_element_t *next = &dict->elements[((element - dict->elements) + 1) & (size - 1)];
+
+    // A slot followed by an empty one does not sit in the middle of any probe sequence, so it can go back to empty.
+    if (next->key.desc == NULL) {
+        element->key.desc = NULL;
+    } else {
+        element->key.desc = UTLS_TOMBSTONE;
+        dict->tombstones++;
+    }
+    element->key.stack_mem = NULL;
+    element->key.thread_func = NULL;
+    element->value = NULL;
+    dict->used--;
+
+    return value;
+}
+
+/**
+ * @brief Check whether the thread a key was made from may still be running.
+ * @details Descriptors and stacks of exited threads are freed and may be reused, so a mismatch on any of the fields the
+ * key was made from means the thread is gone. A match does not prove that the thread is alive, which is why the exit
+ * hook is still needed for prompt reclamation.
+ *
+ * @param key The key.
+ * @retval true The thread may still be running.
+ * @retval false The thread has exited.
+ */
+static inline bool utls_key_may_be_alive(const utls_key_t *key) {
+    return (
+        key->desc->magic == UTLS_THREAD_MAGIC &&
+        key->desc->stack == key->stack_mem &&
+        key->desc->thread_func == key->thread_func
+    );
+}
+
+/**
+ * @brief Remove and free the elements of all threads that have exited.
+ *
+ * @param dict The dict.
+ * @return Number of elements removed.
+ */
+static size_t osdep_utls_dict_sweep(utls_dict_t *dict) {
+    if (dict->elements == NULL) {
+        return 0;
+    }
+
+    size_t removed = 0;
+    const size_t size = dict_size(dict->size_shift);
+    for (size_t i = 0; i < size; i++) {
+        utls_element_t *element = &dict->elements[i];
+        if (element_is_free(element) || utls_key_may_be_alive(&element->key)) {
+            continue;
+        }
+        utls_key_t key = element->key;
+        utls_block_free(osdep_utls_dict_remove(dict, &key));
+        removed++;
     }
-    return element->value;
+    if (removed != 0) {
+        // A new thread that reuses the descriptor, stack and entrypoint of a swept one would still pass the guard of
+        // the stale cache it inherits, so invalidate all caches. Live threads pay for it with one more dict lookup.
+        __utls.generation++;
+    }
+    return removed;
+}
+
+/**
+ * @brief Rebuild the dict with a smaller size when it's mostly empty.
+ *
+ * @param dict The dict.
+ * @x_void_return
+ */
+static void osdep_utls_dict_shrink(utls_dict_t *dict) {
+    const size_t min_size_shift = (__utls.min_size_shift > UTLS_INIT_SHIFT) ? __utls.min_size_shift : UTLS_INIT_SHIFT;
+    if (dict->elements == NULL || dict->size_shift <= min_size_shift) {
+        return;
+    }
+    // Keep a wide margin between the shrink and grow thresholds so the dict does not flip back and forth.
+    if (dict->used >= (dict_size(dict->size_shift) >> 3)) {
+        return;
+    }
+
+    size_t size_shift = dict->size_shift;
+    while (size_shift > min_size_shift && dict->used < (dict_size(size_shift - 1) >> 2)) {
+        size_shift--;
+    }
+    osdep_utls_dict_rebuild(dict, size_shift);
+}
+
+static void utls_on_thread_exit(thread_t *thr) {
+    osdep_utls_release(thr);
 }
 
 void osdep_utls_cinit(void) {
     if (__utls.magic != UTLS_HEADER_MAGIC) {
-        OSInitCriticalSection(&__utls.cs);
-        OSEnterCriticalSection(&__utls.cs);
+        osdep_mutex_init(&__utls.lock, OSDEP_MUTEX_NORMAL);
+        utls_lock();
         __utls.magic = UTLS_HEADER_MAGIC;
-        osdep_utls_dict_init(&__utls.dict, UTLS_INIT_SHIFT);
-        OSLeaveCriticalSection(&__utls.cs);
+        __utls.pools = NULL;
+        __utls.min_size_shift = 0;
+        if (&__osdep_utls_static_pool_size != NULL) {
+            utls_pool_add(&__utls.static_pool, __osdep_utls_static_pool, __osdep_utls_static_pool_size);
+        }
+        if (&__osdep_utls_static_table_shift != NULL) {
+            __utls.min_size_shift = __osdep_utls_static_table_shift;
+        }
+        osdep_utls_dict_init(&__utls.dict, __utls.min_size_shift);
+        utls_unlock();
+        if (!osdep_thread_add_exit_hook(&utls_on_thread_exit)) {
+            WriteComDebugMsg("osdep_utls_cinit: Failed to register exit hook. Use osdep_utls_sweep() instead.");
+        }
     }
 }
 
@@ -261,11 +724,22 @@ void osdep_utls_cfini(void) {
     if (__utls.magic != UTLS_HEADER_MAGIC) {
         return;
     }
-    OSEnterCriticalSection(&__utls.cs);
+    utls_lock();
     __utls.magic = 0;
+    __utls.generation++;
     osdep_utls_dict_fini(&__utls.dict);
-    OSLeaveCriticalSection(&__utls.cs);
-    OSDeleteCriticalSection(&__utls.cs);
+    utls_pool_t *pool = __utls.pools;
+    while (pool != NULL) {
+        utls_pool_t *next = pool->next;
+        if (pool != &__utls.static_pool) {
+            // Heap pools live in the same memchunk as their blocks.
+            osdep_heap_free(pool);
+        }
+        pool = next;
+    }
+    __utls.pools = NULL;
+    utls_unlock();
+    osdep_mutex_destroy(&__utls.lock);
 }
 
 void *osdep_utls_peek(const thread_t *thr) {
@@ -273,74 +747,340 @@ void *osdep_utls_peek(const thread_t *thr) {
         return NULL;
     }
 
-    OSEnterCriticalSection(&__utls.cs);
+    utls_lock();
 
     utls_key_t key = { thr, thr->stack, thr->thread_func };
     void *val = osdep_utls_dict_get(&__utls.dict, &key);
 
-    OSLeaveCriticalSection(&__utls.cs);
+    utls_unlock();
 
     return val;
 }
 
+bool osdep_utls_release(thread_t *thr) {
+    if (thr == NULL || __utls.magic != UTLS_HEADER_MAGIC) {
+        return false;
+    }
+
+    utls_lock();
+
+    utls_key_t key = { thr, thr->stack, thr->thread_func };
+    void *val = osdep_utls_dict_remove(&__utls.dict, &key);
+    if (val == NULL) {
+        utls_unlock();
+        return false;
+    }
+
+    // Drop the cached pointer too, or the thread would keep using the freed block. Also drop it when it points to a
+    // block installed by osdep_utls_switch(), since a new thread reusing the descriptor would pick it up.
+    if (osdep_ktls_getvalue_guarded(thr, OSDEP_KTLS_KEY_UTLS, utls_cache_salt()) != NULL ||
+        osdep_ktls_getvalue_guarded(thr, OSDEP_KTLS_KEY_UTLS, utls_switch_salt()) != NULL) {
+        osdep_ktls_set_guarded(thr, OSDEP_KTLS_KEY_UTLS, NULL, utls_cache_salt());
+    }
+    utls_block_free(val);
+    osdep_utls_dict_shrink(&__utls.dict);
+
+    utls_unlock();
+
+    return true;
+}
+
+void *osdep_utls_block_create(void) {
+    osdep_utls_cinit();
+
+    utls_lock();
+    bool zeroed = false;
+    void *block = utls_block_alloc(utls_block_size(), &zeroed);
+    utls_unlock();
+
+    if (block != NULL) {
+        utls_block_init(block, zeroed);
+    }
+    return block;
+}
+
+void osdep_utls_block_destroy(void *block) {
+    if (block == NULL) {
+        return;
+    }
+    utls_lock();
+    utls_block_free(block);
+    utls_unlock();
+}
+
+void osdep_utls_switch(thread_t *thr, void *block) {
+    // With NULL the next lookup misses the cache and goes through the dict, which re-caches the own block.
+    osdep_ktls_set_guarded(thr, OSDEP_KTLS_KEY_UTLS, block, (block != NULL) ? utls_switch_salt() : utls_cache_salt());
+}
+
+bool osdep_utls_reserve(size_t nthreads) {
+    osdep_utls_cinit();
+
+    utls_lock();
+
+    // Make the dict large enough for all of them to be inserted without reaching the rebuild threshold.
+    size_t size_shift = (__utls.dict.size_shift > UTLS_INIT_SHIFT) ? __utls.dict.size_shift : UTLS_INIT_SHIFT;
+    while (rebuild_threshold(size_shift) < nthreads) {
+        size_shift++;
+    }
+    if (size_shift > __utls.min_size_shift) {
+        __utls.min_size_shift = size_shift;
+    }
+    if (
+        __utls.dict.elements == NULL ||
+        size_shift != __utls.dict.size_shift ||
+        __utls.dict.tombstones != 0
+    ) {
+        if (!osdep_utls_dict_rebuild(&__utls.dict, size_shift)) {
+            utls_unlock();
+            return false;
+        }
+    }
+
+    // Preallocate the blocks for the threads that don't have any yet in one go.
+    const size_t blocks_have = __utls.dict.used + utls_pool_count_free();
+    if (blocks_have < nthreads) {
+        const size_t header_size = (sizeof(utls_pool_t) + 7u) & (~((size_t) 7u));
+        const size_t blocks = nthreads - blocks_have;
+        const size_t stride = utls_block_stride();
+        if (blocks > (SIZE_MAX - header_size) / stride) {
+            utls_unlock();
+            return false;
+        }
+        utls_pool_t *pool = osdep_heap_alloc(header_size + blocks * stride);
+        if (pool == NULL) {
+            utls_unlock();
+            return false;
+        }
+        utls_pool_add(pool, ((uint8_t *) pool) + header_size, blocks * stride);
+    }
+
+    utls_unlock();
+
+    return true;
+}
+
+size_t osdep_utls_sweep(void) {
+    if (__utls.magic != UTLS_HEADER_MAGIC) {
+        return 0;
+    }
+
+    utls_lock();
+    size_t removed = osdep_utls_dict_sweep(&__utls.dict);
+    if (removed != 0) {
+        osdep_utls_dict_shrink(&__utls.dict);
+    }
+    utls_unlock();
+
+    return removed;
+}
+
 void osdep_utls_get_stats(osdep_utls_stats_t *stats) {
-    OSEnterCriticalSection(&__utls.cs);
+    utls_lock();
 
     stats->is_initialized = __utls.magic == UTLS_HEADER_MAGIC;
     stats->slots_used = __utls.dict.used;
     stats->slots_allocated = dict_size(__utls.dict.size_shift);
+    stats->slots_deleted = __utls.dict.tombstones;
+    stats->probe_length_total = 0;
+    stats->probe_length_max = 0;
+    stats->pool_blocks = 0;
+    stats->pool_blocks_free = 0;
+#ifdef OSDEP_UTLS_STATS
+    stats->has_counters = true;
+    stats->read_tp_calls = __utls_counters.read_tp_calls;
+    stats->read_tp_misses = __utls_counters.read_tp_misses;
+    stats->lock_acquisitions = __utls_counters.lock_acquisitions;
+    stats->lock_contentions = __utls_counters.lock_contentions;
+    stats->first_touches = __utls_counters.first_touches;
+    stats->first_touch_bytes = __utls_counters.first_touch_bytes;
+    stats->first_touch_time = __utls_counters.first_touch_time;
+    stats->rebuilds = __utls_counters.rebuilds;
+    stats->growths = __utls_counters.growths;
+    stats->rebuild_elements_moved = __utls_counters.rebuild_elements_moved;
+    stats->rebuild_time = __utls_counters.rebuild_time;
+#else
+    stats->has_counters = false;
+    stats->read_tp_calls = 0;
+    stats->read_tp_misses = 0;
+    stats->lock_acquisitions = 0;
+    stats->lock_contentions = 0;
+    stats->first_touches = 0;
+    stats->first_touch_bytes = 0;
+    stats->first_touch_time = 0;
+    stats->rebuilds = 0;
+    stats->growths = 0;
+    stats->rebuild_elements_moved = 0;
+    stats->rebuild_time = 0;
+#endif
+    if (stats->is_initialized) {
+        for (utls_pool_t *pool = __utls.pools; pool != NULL; pool = pool->next) {
+            stats->pool_blocks += pool->blocks;
+            stats->pool_blocks_free += pool->blocks_free;
+        }
+    }
 
-    OSLeaveCriticalSection(&__utls.cs);
+    if (stats->is_initialized && __utls.dict.elements != NULL) {
+        const size_t size = dict_size(__utls.dict.size_shift);
+        for (size_t i = 0; i < size; i++) {
+            const utls_element_t *element = &__utls.dict.elements[i];
+            if (element_is_free(element)) {
+                continue;
+            }
+            const size_t probe = ((i - dict_hint(&__utls.dict, &element->key)) & (size - 1)) + 1;
+            stats->probe_length_total += probe;
+            if (probe > stats->probe_length_max) {
+                stats->probe_length_max = probe;
+            }
+        }
+    }
+
+    utls_unlock();
 }
 
-extern uint8_t __tdata_start;
-extern uint8_t __tdata_end;
-extern uint8_t __tbss_start;
-extern uint8_t __tbss_end;
+void osdep_utls_reset_counters(void) {
+#ifdef OSDEP_UTLS_STATS
+    osdep_utls_clock_t clock = __utls_counters.clock;
+    __utls_counters = (utls_counters_t) { .clock = clock };
+#endif
+}
 
-__attribute__((used))
-static void *osdep_utls_read_tp(void) {
+void osdep_utls_set_stats_clock(osdep_utls_clock_t clock) {
+#ifdef OSDEP_UTLS_STATS
+    __utls_counters.clock = clock;
+#else
+    (void) clock;
+#endif
+}
+
+uint32_t osdep_utls_get_thread_calls(const thread_t *thr) {
+#ifdef OSDEP_UTLS_STATS
+    const uint32_t *tls = osdep_utls_peek(thr);
+    return (tls != NULL) ? tls[1] : 0;
+#else
+    (void) thr;
+    return 0;
+#endif
+}
+
+__attribute__((noinline))
+static void *osdep_utls_read_tp_slow(thread_t *thr) {
     osdep_utls_cinit();
 
-    OSEnterCriticalSection(&__utls.cs);
+    utls_lock();
 
-    thread_t *thr = osdep_thread_get_current();
     utls_key_t key = { thr, thr->stack, thr->thread_func };
 
     void *val = osdep_utls_dict_get(&__utls.dict, &key);
     if (val == NULL) {
-        size_t tdata_size = &__tdata_end - &__tdata_start;
-        size_t tbss_size = &__tbss_end - &__tbss_start;
+#ifdef OSDEP_UTLS_STATS
+        const uint32_t start = utls_clock();
+#endif
 
-        val = osdep_utls_dict_alloc_and_set(&__utls.dict, &key, tdata_size + tbss_size + 8);
+        bool zeroed = false;
+        val = osdep_utls_dict_alloc_and_set(&__utls.dict, &key, utls_block_size(), &zeroed);
         if (val == NULL) {
-            OSLeaveCriticalSection(&__utls.cs);
+            utls_unlock();
             WriteComDebugMsg("osdep_utls_read_tp: Cannot allocate memory. Will likely crash soon...");
             return NULL;
         }
 
-        uint8_t *tdata_base = ((uint8_t *) val) + 8;
-        uint8_t *tbss_base = tdata_base + tdata_size;
+        utls_block_init(val, zeroed);
 
-        ((uint32_t *) val)[0] = 0;
-        ((uint32_t *) val)[1] = 0;
-        if (tdata_size != 0) {
-            for (size_t i = 0; i < tdata_size; i++) {
-                tdata_base[i] = (&__tdata_start)[i];
-            }
-        }
-        if (tbss_size != 0) {
-            for (size_t i = 0; i < tbss_size; i++) {
-                tbss_base[i] = 0;
-            }
-        }
+        UTLS_COUNT(first_touches, 1);
+        UTLS_COUNT(first_touch_bytes, utls_block_size());
+        UTLS_COUNT(first_touch_time, utls_clock() - start);
     }
 
-    OSLeaveCriticalSection(&__utls.cs);
+    // Cache the block so the next lookups on this thread don't need the lock or the dict.
+    osdep_ktls_set_guarded(thr, OSDEP_KTLS_KEY_UTLS, val, utls_cache_salt());
+
+    utls_unlock();
+
+    return val;
+}
+
+__attribute__((used))
+static void *osdep_utls_read_tp(void) {
+    thread_t *thr = osdep_thread_get_current();
+
+    // The guard only matches when the block was cached by this module for this very thread since the last
+    // osdep_utls_cfini() or sweep that freed anything, so a hit can be returned as is.
+    void *val = osdep_ktls_getvalue_guarded(thr, OSDEP_KTLS_KEY_UTLS, utls_cache_salt());
+    if (val == NULL) {
+        val = osdep_ktls_getvalue_guarded(thr, OSDEP_KTLS_KEY_UTLS, utls_switch_salt());
+    }
+    if (val == NULL) {
+        UTLS_COUNT(read_tp_misses, 1);
+        val = osdep_utls_read_tp_slow(thr);
+    }
 
+#ifdef OSDEP_UTLS_STATS
+    UTLS_COUNT(read_tp_calls, 1);
+    if (val != NULL) {
+        // TCB word 1 is reserved for this.
+        ((uint32_t *) val)[1]++;
+    }
+#endif
     return val;
 }
 
+void *osdep_utls_self(void) {
+    return osdep_utls_read_tp();
+}
+
+void osdep_utls_benchmark(size_t iterations, osdep_utls_benchmark_t *result) {
+    void *volatile sink;
+    unsigned int start;
+
+    result->iterations = iterations;
+    result->cached_ms = 0;
+    result->dict_ms = 0;
+    result->legacy_ms = 0;
+
+    // Also makes sure the block is allocated and cached before timing anything.
+    if (osdep_utls_read_tp() == NULL) {
+        return;
+    }
+
+    start = osdep_clock_ms();
+    for (size_t i = 0; i < iterations; i++) {
+        sink = osdep_utls_read_tp();
+    }
+    result->cached_ms = osdep_clock_elapsed_ms(start, osdep_clock_ms());
+
+    // What a cache miss costs now.
+    start = osdep_clock_ms();
+    for (size_t i = 0; i < iterations; i++) {
+        thread_t *thr = osdep_thread_get_current();
+        utls_key_t key = { thr, thr->stack, thr->thread_func };
+        utls_lock();
+        sink = osdep_utls_dict_get(&__utls.dict, &key);
+        utls_unlock();
+    }
+    result->dict_ms = osdep_clock_elapsed_ms(start, osdep_clock_ms());
+
+    // What __aeabi_read_tp() did on every call before the block was cached: an svc to find the thread, then the dict
+    // under a critical section. The container lock is held throughout so the dict can't change under the private
+    // critical section.
+    critical_section_t cs;
+    OSInitCriticalSection(&cs);
+    utls_lock();
+    start = osdep_clock_ms();
+    for (size_t i = 0; i < iterations; i++) {
+        thread_t *thr = osdep_thread_get_current_svc();
+        utls_key_t key = { thr, thr->stack, thr->thread_func };
+        OSEnterCriticalSection(&cs);
+        sink = osdep_utls_dict_get(&__utls.dict, &key);
+        OSLeaveCriticalSection(&cs);
+    }
+    result->legacy_ms = osdep_clock_elapsed_ms(start, osdep_clock_ms());
+    utls_unlock();
+    OSDeleteCriticalSection(&cs);
+
+    (void) sink;
+}
+
 __attribute__((naked))
 void __aeabi_read_tp(void) {
     // Save registers that are normally scratch registers except r0 to satisfy the no clobber requirements
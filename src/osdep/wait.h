@@ -0,0 +1,22 @@
+/*
+ * Copyright 2025 dogtopus
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file wait.h
+ * @brief Kernel wait limits used internally by osdep.
+ * @details OSWaitForEvent() and OSWaitForSemaphore() take their timeout as a short and have no value that means
+ * forever. Waits without a deadline are therefore made of back-to-back waits of #OSDEP_WAIT_MAX, and every caller
+ * re-checks its own handoff state when one of them times out. None of these waits relies on timing out to notice a
+ * wakeup: each handoff sets its flag before it sets the event or posts the semaphore, and both stay set until the
+ * waiter consumes them.
+ */
+
+#ifndef __OSDEP_WAIT_H__
+#define __OSDEP_WAIT_H__
+
+/** Longest timeout (in OSSleep() units) that fits in a single kernel wait. */
+#define OSDEP_WAIT_MAX (0x7fffu)
+
+#endif  // __OSDEP_WAIT_H__